@@ -0,0 +1,498 @@
+/**
+ * bxCAN and the bus of the host build.
+ *
+ * Frames of other nodes are injected by the script and wait for the bus like
+ * the transmit mailboxes do. Whenever the bus is idle the frame with the
+ * lowest identifier wins arbitration and takes its length in bits, with stuff
+ * bits, CRC, end of frame and intermission, at the bitrate of the bus. Frames
+ * of other nodes are always acknowledged, the controller's own are acknowledged
+ * by another node.
+ *
+ * A frame of another node can be destroyed by an error (Sim_FrameTypeDef.lec).
+ * The error is detected at the end of the CRC and followed by an error flag,
+ * its delimiter and the intermission. A listening controller counts it in REC
+ * and the last error code, and a good frame counts REC back down. The
+ * controller's own frames never fail, so TEC stays 0 and the controller
+ * doesn't go bus-off.
+ *
+ * The controller receives frames of other nodes when it is out of
+ * initialization and sleep mode, and its own in loopback mode, into the 3 deep
+ * FIFO 0. Filters are ignored, the firmware accepts everything anyway. Every
+ * frame put in the FIFO is logged with the time its end of frame passed, so
+ * the host can tell how long it took and which were lost.
+ *
+ * Register writes with side effects come in through can_model_write(), @see
+ * WRITE_REG() in src/can.c. Changes of MCR are plain stores, MSR follows them
+ * in can_model_sync().
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "stm32f0xx.h"
+
+// Reset values, RM0091 29.9
+#define MCR_RESET           0x00010002u
+#define MSR_RESET           0x00000c02u
+#define TSR_RESET           0x1c000000u
+#define BTR_RESET           0x01230000u
+
+#define FIFO_SIZE           3
+#define MAILBOXES           3
+
+// TSR bits of a mailbox
+#define TSR_RQCP(i)         (CAN_TSR_RQCP0 << 8*(i))
+#define TSR_TXOK(i)         (CAN_TSR_TXOK0 << 8*(i))
+#define TSR_DONE(i)         (0x0fu << 8*(i))
+#define TSR_ABRQ(i)         (CAN_TSR_ABRQ0 << 8*(i))
+#define TSR_TME(i)          (CAN_TSR_TME0 << (i))
+
+// Bits after the CRC: delimiter, ACK slot and delimiter, end of frame,
+// intermission
+#define FRAME_TAIL_BITS     13
+// Bits after an error: error flag, delimiter, intermission
+#define ERROR_TAIL_BITS     17
+
+// Error counter limits, ISO 11898-1 12.1.4
+#define ERROR_WARNING       96
+#define ERROR_PASSIVE       128
+
+typedef struct {
+    uint32_t rir;
+    uint32_t rdtr;
+    uint32_t rdlr;
+    uint32_t rdhr;
+    uint32_t log;           /*< Index in can_model_log */
+} Fifo_EntryTypeDef;
+
+typedef struct {
+    uint8_t active;
+    uint64_t end;           /*< End of the intermission */
+    int8_t mailbox;         /*< Sending mailbox, -1 for another node */
+    uint8_t orphan;         /*< Controller was reset while sending */
+    Sim_FrameTypeDef frame;
+} Bus_TypeDef;
+
+Can_ModelStatsTypeDef can_model_stats;
+Can_LogTypeDef *can_model_log;
+uint32_t can_model_log_len;
+static uint32_t log_size;
+
+static Fifo_EntryTypeDef fifo[FIFO_SIZE];
+static uint8_t fifo_len;
+static uint8_t mailbox_pending[MAILBOXES];
+static uint32_t mailbox_seq[MAILBOXES]; /*< Order of the requests, TXFP */
+static uint32_t seq;
+
+static uint8_t rec;             /*< Receive error counter */
+static uint8_t tec;             /*< Transmit error counter */
+
+static Bus_TypeDef bus;
+static uint64_t bit_ns = 2000;
+static Sim_FrameTypeDef *waiting; /*< Frames of other nodes */
+static uint32_t waiting_len;
+static uint32_t waiting_size;
+
+/* Arbitration field as a number, the lowest wins. */
+static uint32_t arbitration_key(const Sim_FrameTypeDef *frame) {
+    if (frame->ext) {
+        return (frame->id >> 18) << 21 | 1u << 20 | 1u << 19
+            | (frame->id & 0x3ffff) << 1 | frame->rtr;
+    }
+    return frame->id << 21 | (uint32_t) frame->rtr << 20;
+}
+
+/**
+ * Length of a frame on the wire.
+ *
+ * @param[in] frame frame to measure
+ * @return number of bits from start of frame to the end of the intermission
+ */
+uint32_t can_model_frame_bits(const Sim_FrameTypeDef *frame) {
+    uint8_t bits[128];
+    uint32_t n = 0;
+    uint32_t crc = 0;
+    uint32_t stuffed = 0;
+    uint32_t run = 0;
+    uint8_t last = 2;
+    uint32_t len = frame->rtr ? 0 : (frame->dlc > 8 ? 8 : frame->dlc);
+    uint32_t i;
+    int32_t b;
+
+    bits[n++] = 0;
+    if (frame->ext) {
+        for (b = 28; b >= 18; b--) bits[n++] = (frame->id >> b) & 1;
+        bits[n++] = 1; // SRR
+        bits[n++] = 1; // IDE
+        for (b = 17; b >= 0; b--) bits[n++] = (frame->id >> b) & 1;
+        bits[n++] = frame->rtr;
+        bits[n++] = 0; // r1
+    } else {
+        for (b = 10; b >= 0; b--) bits[n++] = (frame->id >> b) & 1;
+        bits[n++] = frame->rtr;
+        bits[n++] = 0; // IDE
+    }
+    bits[n++] = 0; // r0
+    for (b = 3; b >= 0; b--) bits[n++] = (frame->dlc >> b) & 1;
+    for (i = 0; i < len; i++) {
+        for (b = 7; b >= 0; b--) bits[n++] = (frame->data[i] >> b) & 1;
+    }
+    for (i = 0; i < n; i++) {
+        uint32_t next = bits[i] ^ ((crc >> 14) & 1);
+        crc = (crc << 1) & 0x7fff;
+        if (next) {
+            crc ^= 0x4599;
+        }
+    }
+    for (b = 14; b >= 0; b--) bits[n++] = (crc >> b) & 1;
+
+    // A stuff bit after 5 equal bits counts towards the next run
+    for (i = 0; i < n; i++) {
+        if (bits[i] == last) {
+            run++;
+        } else {
+            last = bits[i];
+            run = 1;
+        }
+        if (run == 5) {
+            stuffed++;
+            last = !last;
+            run = 1;
+        }
+    }
+    return n + stuffed + FRAME_TAIL_BITS;
+}
+
+static uint8_t can_listening(void) {
+    return !(sim_can.MCR & (CAN_MCR_INRQ | CAN_MCR_SLEEP));
+}
+
+static void fifo_update(void) {
+    sim_can.RF0R = (sim_can.RF0R & CAN_RF0R_FOVR0) | fifo_len
+        | (fifo_len == FIFO_SIZE ? CAN_RF0R_FULL0 : 0);
+    if (fifo_len) {
+        sim_can.sFIFOMailBox[0].RIR = fifo[0].rir;
+        sim_can.sFIFOMailBox[0].RDTR = fifo[0].rdtr;
+        sim_can.sFIFOMailBox[0].RDLR = fifo[0].rdlr;
+        sim_can.sFIFOMailBox[0].RDHR = fifo[0].rdhr;
+    }
+}
+
+/* Counters and flags of ESR, the last error code is kept as written. */
+static void esr_update(void) {
+    uint8_t count = rec > tec ? rec : tec;
+    sim_can.ESR = (sim_can.ESR & CAN_ESR_LEC) | (uint32_t) rec << 24
+        | (uint32_t) tec << 16
+        | (count >= ERROR_WARNING ? CAN_ESR_EWGF : 0)
+        | (count >= ERROR_PASSIVE ? CAN_ESR_EPVF : 0);
+}
+
+/* Count an error detected while receiving, ERRI is set for the enabled
+ * conditions as in RM0091 29.8. */
+static void receive_error(uint8_t lec) {
+    uint32_t esr = sim_can.ESR;
+    uint32_t ier = sim_can.IER;
+
+    if (rec < 0xff) {
+        rec++;
+    }
+    sim_can.ESR = (esr & ~CAN_ESR_LEC) | ((uint32_t) lec << 4 & CAN_ESR_LEC);
+    esr_update();
+    if (((ier & CAN_IER_LECIE) && (sim_can.ESR & CAN_ESR_LEC))
+            || ((ier & CAN_IER_EWGIE) && (~esr & sim_can.ESR & CAN_ESR_EWGF))
+            || ((ier & CAN_IER_EPVIE) && (~esr & sim_can.ESR & CAN_ESR_EPVF))) {
+        sim_can.MSR |= CAN_MSR_ERRI;
+    }
+}
+
+/* A frame was received without error. */
+static void receive_ok(void) {
+    if (rec >= ERROR_PASSIVE) {
+        rec = 119;
+    } else if (rec) {
+        rec--;
+    }
+    esr_update();
+}
+
+/* Put a frame in FIFO 0, overwriting the last one when full. */
+static void fifo_receive(const Sim_FrameTypeDef *frame) {
+    Fifo_EntryTypeDef *entry;
+    Can_LogTypeDef *log;
+
+    if (fifo_len == FIFO_SIZE) {
+        sim_can.RF0R |= CAN_RF0R_FOVR0;
+        can_model_stats.fifo_lost++;
+        if (sim_can.MCR & CAN_MCR_RFLM) {
+            return;
+        }
+        can_model_log[fifo[FIFO_SIZE - 1].log].lost = 1;
+        fifo_len--;
+    }
+    if (can_model_log_len == log_size) {
+        log_size = log_size ? 2 * log_size : 1024;
+        can_model_log = realloc(can_model_log, log_size * sizeof(*can_model_log));
+        if (!can_model_log) {
+            abort();
+        }
+    }
+    log = &can_model_log[can_model_log_len];
+    log->frame = *frame;
+    log->end = sim_now;
+    log->lost = 0;
+    log->matched = 0;
+
+    entry = &fifo[fifo_len++];
+    entry->log = can_model_log_len++;
+    entry->rir = (frame->ext ? frame->id << 3 | CAN_RI0R_IDE : frame->id << 21)
+        | (frame->rtr ? CAN_RI0R_RTR : 0);
+    entry->rdtr = frame->dlc;
+    entry->rdlr = frame->data[0] | frame->data[1] << 8 | frame->data[2] << 16
+        | (uint32_t) frame->data[3] << 24;
+    entry->rdhr = frame->data[4] | frame->data[5] << 8 | frame->data[6] << 16
+        | (uint32_t) frame->data[7] << 24;
+    can_model_stats.fifo_frames++;
+    fifo_update();
+}
+
+static void mailbox_frame(uint8_t i, Sim_FrameTypeDef *frame) {
+    CAN_TxMailBox_TypeDef *mailbox = &sim_can.sTxMailBox[i];
+    uint32_t j;
+    frame->ext = (mailbox->TIR & CAN_TI0R_IDE) != 0;
+    frame->id = frame->ext ? mailbox->TIR >> 3 : mailbox->TIR >> 21;
+    frame->rtr = (mailbox->TIR & CAN_TI0R_RTR) != 0;
+    frame->dlc = mailbox->TDTR & 0xf;
+    for (j = 0; j < 4; j++) {
+        frame->data[j] = mailbox->TDLR >> 8*j;
+        frame->data[j + 4] = mailbox->TDHR >> 8*j;
+    }
+}
+
+/* CODE is the lowest empty mailbox. */
+static void tsr_update(void) {
+    uint8_t i;
+    for (i = 0; i < MAILBOXES && !(sim_can.TSR & TSR_TME(i)); i++);
+    sim_can.TSR = (sim_can.TSR & ~CAN_TSR_CODE)
+        | ((uint32_t) (i < MAILBOXES ? i : 0) << 24);
+}
+
+/* Start the next frame if the bus is idle. */
+static void bus_start(void) {
+    Sim_FrameTypeDef frame;
+    int32_t best = -1;
+    int32_t mailbox = -1;
+    uint32_t key = 0;
+    uint32_t i;
+
+    if (bus.active) {
+        return;
+    }
+    for (i = 0; i < waiting_len; i++) {
+        if (best < 0 || arbitration_key(&waiting[i]) < key) {
+            best = i;
+            key = arbitration_key(&waiting[i]);
+        }
+    }
+    if (can_listening()) {
+        for (i = 0; i < MAILBOXES; i++) {
+            if (!mailbox_pending[i]) {
+                continue;
+            }
+            mailbox_frame(i, &frame);
+            // Transmit FIFO priority sends in the order of the requests
+            if (mailbox < 0 || ((sim_can.MCR & CAN_MCR_TXFP)
+                    ? mailbox_seq[i] < mailbox_seq[mailbox]
+                    : arbitration_key(&frame) < arbitration_key(&bus.frame))) {
+                mailbox = i;
+                bus.frame = frame;
+            }
+        }
+    }
+    if (mailbox >= 0 && (best < 0 || arbitration_key(&bus.frame) <= key)) {
+        bus.mailbox = mailbox;
+    } else if (best >= 0) {
+        bus.mailbox = -1;
+        bus.frame = waiting[best];
+        memmove(&waiting[best], &waiting[best + 1],
+                (waiting_len - best - 1) * sizeof(*waiting));
+        waiting_len--;
+    } else {
+        return;
+    }
+    bus.active = 1;
+    bus.orphan = 0;
+    if (bus.frame.lec) {
+        bus.end = sim_now + (can_model_frame_bits(&bus.frame) - FRAME_TAIL_BITS
+                + ERROR_TAIL_BITS) * bit_ns;
+    } else {
+        bus.end = sim_now + can_model_frame_bits(&bus.frame) * bit_ns;
+    }
+    can_model_stats.busy_ns += bus.end - sim_now;
+}
+
+/**
+ * Back to the reset values, as after a reset through RCC.
+ */
+void can_model_reset(void) {
+    memset(&sim_can, 0, sizeof(sim_can));
+    sim_can.MCR = MCR_RESET;
+    sim_can.MSR = MSR_RESET;
+    sim_can.TSR = TSR_RESET;
+    sim_can.BTR = BTR_RESET;
+    fifo_len = 0;
+    rec = 0;
+    tec = 0;
+    memset(mailbox_pending, 0, sizeof(mailbox_pending));
+    if (bus.active && bus.mailbox >= 0) {
+        bus.orphan = 1;
+    }
+}
+
+/**
+ * Write a CAN register, with the side effects of the controller.
+ *
+ * @param[in] reg register in sim_can
+ * @param[in] value value written
+ */
+void can_model_write(volatile uint32_t *reg, uint32_t value) {
+    uint8_t i;
+
+    can_model_sync();
+    if (reg == &sim_can.TSR) {
+        for (i = 0; i < MAILBOXES; i++) {
+            if (value & TSR_RQCP(i)) {
+                sim_can.TSR &= ~TSR_DONE(i);
+            }
+            // A frame on the bus can't be aborted any more
+            if ((value & TSR_ABRQ(i)) && mailbox_pending[i]
+                    && !(bus.active && bus.mailbox == i)) {
+                mailbox_pending[i] = 0;
+                sim_can.TSR = (sim_can.TSR & ~TSR_DONE(i)) | TSR_RQCP(i)
+                    | TSR_TME(i);
+            }
+        }
+        tsr_update();
+    } else if (reg == &sim_can.RF0R) {
+        if (value & CAN_RF0R_FOVR0) {
+            sim_can.RF0R &= ~CAN_RF0R_FOVR0;
+        }
+        if ((value & CAN_RF0R_RFOM0) && fifo_len) {
+            memmove(&fifo[0], &fifo[1], --fifo_len * sizeof(*fifo));
+        }
+        fifo_update();
+    } else if (reg == &sim_can.MSR) {
+        sim_can.MSR &= ~(value & CAN_MSR_ERRI);
+    } else {
+        for (i = 0; i < MAILBOXES; i++) {
+            if (reg == &sim_can.sTxMailBox[i].TIR) {
+                break;
+            }
+        }
+        if (i < MAILBOXES) {
+            sim_can.sTxMailBox[i].TIR = value & ~CAN_TI0R_TXRQ;
+            if ((value & CAN_TI0R_TXRQ) && (sim_can.TSR & TSR_TME(i))) {
+                mailbox_pending[i] = 1;
+                mailbox_seq[i] = seq++;
+                sim_can.TSR &= ~TSR_TME(i);
+                tsr_update();
+                bus_start();
+            }
+        } else {
+            *reg = value;
+        }
+    }
+}
+
+/**
+ * Let MSR follow the mode requested in MCR, called whenever time passes.
+ */
+void can_model_sync(void) {
+    uint32_t msr = sim_can.MSR & ~(CAN_MSR_INAK | CAN_MSR_SLAK);
+    if (sim_can.MCR & CAN_MCR_INRQ) {
+        msr |= CAN_MSR_INAK;
+    } else if (sim_can.MCR & CAN_MCR_SLEEP) {
+        msr |= CAN_MSR_SLAK;
+    }
+    sim_can.MSR = msr;
+    esr_update();
+    bus_start();
+}
+
+/**
+ * @return 1 if the CAN interrupt is pending
+ */
+uint8_t can_model_irq_pending(void) {
+    uint32_t ier = sim_can.IER;
+    uint32_t rf0r = sim_can.RF0R;
+    return ((ier & CAN_IER_TMEIE) && (sim_can.TSR
+                & (TSR_RQCP(0) | TSR_RQCP(1) | TSR_RQCP(2))))
+        || ((ier & CAN_IER_FMPIE0) && (rf0r & CAN_RF0R_FMP0))
+        || ((ier & CAN_IER_FFIE0) && (rf0r & CAN_RF0R_FULL0))
+        || ((ier & CAN_IER_FOVIE0) && (rf0r & CAN_RF0R_FOVR0))
+        || ((ier & CAN_IER_ERRIE) && (sim_can.MSR & CAN_MSR_ERRI));
+}
+
+void can_model_set_bitrate(uint32_t bitrate) {
+    bit_ns = 1000000000ull / bitrate;
+}
+
+/**
+ * Queue a frame of another node, it is sent once it wins arbitration.
+ *
+ * @param[in] frame frame to send
+ */
+void can_model_inject(const Sim_FrameTypeDef *frame) {
+    if (waiting_len == waiting_size) {
+        waiting_size = waiting_size ? 2 * waiting_size : 64;
+        waiting = realloc(waiting, waiting_size * sizeof(*waiting));
+        if (!waiting) {
+            abort();
+        }
+    }
+    waiting[waiting_len++] = *frame;
+    bus_start();
+}
+
+/**
+ * @return time of the next end of frame, SIM_NEVER while the bus is idle
+ */
+uint64_t can_model_next(void) {
+    return bus.active ? bus.end : SIM_NEVER;
+}
+
+/**
+ * Finish the frame on the bus and start the next.
+ */
+void can_model_run(void) {
+    int8_t i = bus.mailbox;
+
+    if (!bus.active || sim_now < bus.end) {
+        return;
+    }
+    bus.active = 0;
+    if (i < 0 && bus.frame.lec) {
+        can_model_stats.errors++;
+        if (can_listening()) {
+            receive_error(bus.frame.lec);
+        }
+    } else if (i < 0) {
+        can_model_stats.bus_frames++;
+        if (can_listening()) {
+            receive_ok();
+            fifo_receive(&bus.frame);
+        } else {
+            can_model_stats.missed++;
+        }
+    } else if (!bus.orphan) {
+        if (!can_model_stats.tx_frames++) {
+            can_model_stats.tx_first = sim_now;
+        }
+        can_model_stats.tx_last = sim_now;
+        mailbox_pending[i] = 0;
+        sim_can.TSR |= TSR_RQCP(i) | TSR_TXOK(i) | TSR_TME(i);
+        tsr_update();
+        if (sim_can.BTR & CAN_BTR_LBKM) {
+            fifo_receive(&bus.frame);
+        }
+    }
+    bus_start();
+}
@@ -0,0 +1,365 @@
+/**
+ * Core and HAL of the host build.
+ *
+ * PRIMASK is a variable. Interrupts are taken at the next call into the
+ * simulator after they became pending while PRIMASK is clear. The NVIC is
+ * modelled as on the device: 2 priority bits, so priorities of 4 and up wrap,
+ * 0 is the highest and a handler is preempted by any interrupt of a higher
+ * priority. Of interrupts with the same priority the lowest IRQn goes first.
+ * The CAN and USB interrupts come from their models, the LED timer and SysTick
+ * aren't simulated, HAL_GetTick() follows the virtual time instead.
+ *
+ * Register writes go to the CAN model or, for everything else, to memory. The
+ * clock control bits become ready as soon as they are turned on.
+ */
+#include "sim.h"
+#include "can.h" // Needed for CANx defines
+#include "stm32f0xx_hal.h"
+#include "stm32f0xx_it.h"
+
+CAN_TypeDef sim_can;
+GPIO_TypeDef sim_gpioa;
+GPIO_TypeDef sim_gpiob;
+RCC_TypeDef sim_rcc;
+TIM_TypeDef sim_tim2;
+TIM_TypeDef sim_tim3;
+USB_TypeDef sim_usb;
+CRS_TypeDef sim_crs;
+
+uint32_t SystemCoreClock = 48000000;
+
+#define NVIC_LEVELS     (1u << __NVIC_PRIO_BITS)
+
+/* A simulated interrupt. */
+typedef struct {
+    IRQn_Type irqn;
+    void (*handler)(void);
+    uint8_t (*pending)(void); /*< The model requests the interrupt */
+} Sim_IrqTypeDef;
+
+/* By IRQn, the order the NVIC takes them in at the same priority */
+static const Sim_IrqTypeDef irqs[] = {
+    { CANx_IRQn, CANx_IRQHandler, can_model_irq_pending },
+    { USB_IRQn, USB_IRQHandler, pcd_irq_pending }
+};
+
+static uint32_t primask;
+static uint8_t active = NVIC_LEVELS; /*< Running handler, NVIC_LEVELS if none */
+static uint32_t irq_enabled; /*< NVIC enable bit by IRQn */
+static uint8_t irq_priority[32]; /*< NVIC priority by IRQn */
+
+static uint8_t irq_ready(const Sim_IrqTypeDef *irq) {
+    return (irq_enabled & (1u << irq->irqn)) && irq->pending();
+}
+
+static uint8_t irq_pending(void) {
+    uint8_t i;
+    for (i = 0; i < sizeof(irqs) / sizeof(irqs[0]); i++) {
+        if (irq_ready(&irqs[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @return the pending interrupt that preempts the running code, NULL if none
+ */
+static const Sim_IrqTypeDef *irq_next(void) {
+    const Sim_IrqTypeDef *next = NULL;
+    uint8_t level = active;
+    uint8_t i;
+    for (i = 0; i < sizeof(irqs) / sizeof(irqs[0]); i++) {
+        if (irq_priority[irqs[i].irqn] < level && irq_ready(&irqs[i])) {
+            next = &irqs[i];
+            level = irq_priority[irqs[i].irqn];
+        }
+    }
+    return next;
+}
+
+/* Take the pending interrupts, if they aren't masked. A handler that calls
+ * into the simulator can be preempted from here. */
+static void irq_take(void) {
+    const Sim_IrqTypeDef *irq;
+    uint8_t preempted;
+    while (!primask && (irq = irq_next())) {
+        preempted = active;
+        active = irq_priority[irq->irqn];
+        sim_advance(sim_config.irq_ns);
+        irq->handler();
+        active = preempted;
+    }
+}
+
+/**
+ * Charge the cost of an operation and take the interrupts that became
+ * pending meanwhile.
+ */
+void sim_point(void) {
+    sim_advance(sim_config.op_ns);
+    irq_take();
+}
+
+void __disable_irq(void) {
+    primask = 1;
+    sim_advance(sim_config.op_ns);
+}
+
+void __enable_irq(void) {
+    primask = 0;
+    sim_point();
+}
+
+uint32_t __get_PRIMASK(void) {
+    return primask;
+}
+
+void __set_PRIMASK(uint32_t value) {
+    primask = value;
+    sim_point();
+}
+
+/* Sleep until an interrupt is pending, it is taken once PRIMASK is cleared. */
+void __WFI(void) {
+    while (!irq_pending()) {
+        sim_wait();
+    }
+}
+
+void __NOP(void) {
+    sim_advance(sim_config.op_ns);
+}
+
+/* Only the top __NVIC_PRIO_BITS of the priority byte exist, CMSIS shifts the
+ * priority there and the bits above are lost: 4 becomes 0. */
+void NVIC_SetPriority(IRQn_Type irqn, uint32_t priority) {
+    if (irqn >= 0) {
+        irq_priority[irqn] = priority & (NVIC_LEVELS - 1);
+    }
+}
+
+void NVIC_EnableIRQ(IRQn_Type irqn) {
+    if (irqn >= 0) {
+        irq_enabled |= 1u << irqn;
+    }
+}
+
+void NVIC_DisableIRQ(IRQn_Type irqn) {
+    if (irqn >= 0) {
+        irq_enabled &= ~(1u << irqn);
+    }
+}
+
+/* Only the clocks clock_init() sets up: HSI, or 48MHz from the PLL or HSI48. */
+void SystemCoreClockUpdate(void) {
+    SystemCoreClock = (sim_rcc.CFGR & RCC_CFGR_SWS) == RCC_CFGR_SWS_HSI
+        ? 8000000 : 48000000;
+}
+
+uint32_t SysTick_Config(uint32_t ticks) {
+    (void) ticks;
+    return 0;
+}
+
+void sim_write_reg(volatile uint32_t *reg, uint32_t value) {
+    if ((uintptr_t) reg >= (uintptr_t) &sim_can
+            && (uintptr_t) reg < (uintptr_t) (&sim_can + 1)) {
+        can_model_write(reg, value);
+    } else {
+        *reg = value;
+        if (reg == &sim_rcc.APB1RSTR && (value & RCC_APB1RSTR_CANRST)) {
+            can_model_reset();
+        }
+    }
+    sim_point();
+}
+
+/******************************************************************************
+ * HAL
+ *****************************************************************************/
+
+HAL_StatusTypeDef HAL_Init(void) {
+    return HAL_OK;
+}
+
+uint32_t HAL_GetTick(void) {
+    sim_point();
+    // Oscillators and the PLL are ready once on, the switch is immediate
+    sim_rcc.CR = (sim_rcc.CR & ~(RCC_CR_HSERDY | RCC_CR_PLLRDY))
+        | ((sim_rcc.CR & RCC_CR_HSEON) ? RCC_CR_HSERDY : 0)
+        | ((sim_rcc.CR & RCC_CR_PLLON) ? RCC_CR_PLLRDY : 0);
+    sim_rcc.CR2 = (sim_rcc.CR2 & ~RCC_CR2_HSI48RDY)
+        | ((sim_rcc.CR2 & RCC_CR2_HSI48ON) ? RCC_CR2_HSI48RDY : 0);
+    sim_rcc.CFGR = (sim_rcc.CFGR & ~RCC_CFGR_SWS)
+        | ((sim_rcc.CFGR & RCC_CFGR_SW) << 2);
+    return (uint32_t) (sim_now / SIM_MS);
+}
+
+void HAL_IncTick(void) {}
+
+void HAL_Delay(uint32_t delay) {
+    uint32_t start = HAL_GetTick();
+    while (HAL_GetTick() - start < delay);
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type irqn, uint32_t preempt, uint32_t sub) {
+    (void) sub;
+    NVIC_SetPriority(irqn, preempt);
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type irqn) {
+    NVIC_EnableIRQ(irqn);
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type irqn) {
+    NVIC_DisableIRQ(irqn);
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef *port, GPIO_InitTypeDef *init) {
+    (void) port;
+    (void) init;
+}
+
+void HAL_GPIO_DeInit(GPIO_TypeDef *port, uint32_t pin) {
+    (void) port;
+    (void) pin;
+}
+
+/* Weak as in the HAL, the LEAN build doesn't use the timer handles. */
+__attribute__((weak)) void HAL_TIM_Base_MspInit(TIM_HandleTypeDef *htim) {
+    (void) htim;
+}
+
+__attribute__((weak)) void HAL_TIM_Base_MspDeInit(TIM_HandleTypeDef *htim) {
+    (void) htim;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Init(TIM_HandleTypeDef *htim) {
+    HAL_TIM_Base_MspInit(htim);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_DeInit(TIM_HandleTypeDef *htim) {
+    HAL_TIM_Base_MspDeInit(htim);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef *htim) {
+    (void) htim;
+    return HAL_OK;
+}
+
+void HAL_TIM_IRQHandler(TIM_HandleTypeDef *htim) {
+    (void) htim;
+}
+
+HAL_StatusTypeDef HAL_CAN_ConfigFilter(CAN_HandleTypeDef *hcan,
+        CAN_FilterConfTypeDef *filter) {
+    (void) hcan;
+    (void) filter;
+    return HAL_OK;
+}
+
+/* Weak as in the HAL, the firmware doesn't use the HAL transfers. */
+__attribute__((weak)) void HAL_CAN_TxCpltCallback(CAN_HandleTypeDef *hcan) {
+    (void) hcan;
+}
+
+__attribute__((weak)) void HAL_CAN_RxCpltCallback(CAN_HandleTypeDef *hcan) {
+    (void) hcan;
+}
+
+/* CAN_Transmit_IT() of the HAL. HAL_CAN_Transmit_IT() isn't used, the state
+ * stays ready, so only TMEIE is turned off. RQCP is left set. */
+static void can_transmit_it(CAN_HandleTypeDef *hcan) {
+    __HAL_CAN_DISABLE_IT(hcan, CAN_IT_TME);
+    HAL_CAN_TxCpltCallback(hcan);
+}
+
+/* CAN_Receive_IT() of the HAL for FIFO 0: takes the frame into pRxMsg,
+ * releases it and turns off FMPIE0. */
+static void can_receive_it(CAN_HandleTypeDef *hcan) {
+    CAN_TypeDef *can = hcan->Instance;
+    CanRxMsgTypeDef *msg = hcan->pRxMsg;
+    uint32_t rir = can->sFIFOMailBox[0].RIR;
+    uint32_t rdtr = can->sFIFOMailBox[0].RDTR;
+    uint32_t rdlr = can->sFIFOMailBox[0].RDLR;
+    uint32_t rdhr = can->sFIFOMailBox[0].RDHR;
+    uint8_t i;
+
+    // The HAL writes through the NULL pointer, which would fault on the device
+    if (msg) {
+        msg->IDE = rir & CAN_RI0R_IDE;
+        msg->StdId = (rir >> 21) & 0x7ff;
+        msg->ExtId = (rir >> 3) & 0x1fffffff;
+        msg->RTR = rir & CAN_RI0R_RTR;
+        msg->DLC = rdtr & 0x0f;
+        msg->FMI = (rdtr >> 8) & 0xff;
+        msg->FIFONumber = 0;
+        for (i = 0; i < 4; i++) {
+            msg->Data[i] = (uint8_t) (rdlr >> (8 * i));
+            msg->Data[4 + i] = (uint8_t) (rdhr >> (8 * i));
+        }
+    }
+    WRITE_REG(can->RF0R, CAN_RF0R_RFOM0);
+    __HAL_CAN_DISABLE_IT(hcan, CAN_IT_FMP0);
+    HAL_CAN_RxCpltCallback(hcan);
+}
+
+/* Follows the HAL of STM32Cube F0 V1.7.0: completed transmissions and a
+ * pending frame are taken and their interrupts turned off, then the errors.
+ * The last error code is cleared before HAL_CAN_ErrorCallback(), the rest of
+ * ESR is left. */
+void HAL_CAN_IRQHandler(CAN_HandleTypeDef *hcan) {
+    CAN_TypeDef *can = hcan->Instance;
+    uint32_t ier;
+    uint32_t esr;
+    uint32_t tsr = can->TSR;
+    uint32_t errorcode = HAL_CAN_ERROR_NONE;
+
+    if ((can->IER & CAN_IT_TME) && (
+            (tsr & (CAN_TSR_RQCP0 | CAN_TSR_TXOK0 | CAN_TSR_TME0))
+                == (CAN_TSR_RQCP0 | CAN_TSR_TXOK0 | CAN_TSR_TME0) ||
+            (tsr & (CAN_TSR_RQCP1 | CAN_TSR_TXOK1 | CAN_TSR_TME1))
+                == (CAN_TSR_RQCP1 | CAN_TSR_TXOK1 | CAN_TSR_TME1) ||
+            (tsr & (CAN_TSR_RQCP2 | CAN_TSR_TXOK2 | CAN_TSR_TME2))
+                == (CAN_TSR_RQCP2 | CAN_TSR_TXOK2 | CAN_TSR_TME2))) {
+        can_transmit_it(hcan);
+    }
+    if ((can->IER & CAN_IT_FMP0) && (can->RF0R & CAN_RF0R_FMP0)) {
+        can_receive_it(hcan);
+    }
+
+    ier = can->IER;
+    esr = can->ESR;
+    if (!(ier & CAN_IER_ERRIE)) {
+        return;
+    }
+    if ((esr & CAN_ESR_EWGF) && (ier & CAN_IER_EWGIE)) {
+        errorcode |= HAL_CAN_ERROR_EWG;
+    }
+    if ((esr & CAN_ESR_EPVF) && (ier & CAN_IER_EPVIE)) {
+        errorcode |= HAL_CAN_ERROR_EPV;
+    }
+    if ((esr & CAN_ESR_BOFF) && (ier & CAN_IER_BOFIE)) {
+        errorcode |= HAL_CAN_ERROR_BOF;
+    }
+    if ((esr & CAN_ESR_LEC) && (ier & CAN_IER_LECIE)) {
+        switch ((esr & CAN_ESR_LEC) >> 4) {
+            case 1: errorcode |= HAL_CAN_ERROR_STF; break;
+            case 2: errorcode |= HAL_CAN_ERROR_FOR; break;
+            case 3: errorcode |= HAL_CAN_ERROR_ACK; break;
+            case 4: errorcode |= HAL_CAN_ERROR_BR; break;
+            case 5: errorcode |= HAL_CAN_ERROR_BD; break;
+            case 6: errorcode |= HAL_CAN_ERROR_CRC; break;
+        }
+        can->ESR &= ~CAN_ESR_LEC;
+    }
+    if (errorcode != HAL_CAN_ERROR_NONE) {
+        WRITE_REG(can->MSR, CAN_MSR_ERRI);
+        hcan->ErrorCode = errorcode;
+        HAL_CAN_ErrorCallback(hcan);
+        hcan->ErrorCode = HAL_CAN_ERROR_NONE;
+    }
+}
@@ -0,0 +1,307 @@
+#ifndef _HOST_STM32F0XX_H_
+#define _HOST_STM32F0XX_H_
+
+/* Stand-in for the CMSIS device header in the host build, @see host/sim.c.
+ * Peripherals are plain structs in memory with the layout of the STM32F042
+ * registers, only the registers and bits the firmware uses are defined. The
+ * core functions are implemented by the simulator, they decide when
+ * interrupts are taken. */
+#include <stdint.h>
+
+#define __IO                            volatile
+#define __I                             volatile const
+#define __O                             volatile
+#define __packed                        __attribute__((packed))
+#define __weak                          __attribute__((weak))
+#define __ALIGN_BEGIN
+#define __ALIGN_END                     __attribute__((aligned(4)))
+#define __STATIC_INLINE                 static inline
+#define UNUSED(x)                       ((void)(x))
+
+typedef enum { RESET = 0, SET = !RESET } FlagStatus, ITStatus;
+typedef enum { DISABLE = 0, ENABLE = !DISABLE } FunctionalState;
+
+typedef enum {
+    SysTick_IRQn = -1,
+    TIM2_IRQn = 15,
+    TIM3_IRQn = 16,
+    CEC_CAN_IRQn = 30,
+    USB_IRQn = 31
+} IRQn_Type;
+
+#define __NVIC_PRIO_BITS                2
+
+typedef struct {
+    __IO uint32_t TIR;
+    __IO uint32_t TDTR;
+    __IO uint32_t TDLR;
+    __IO uint32_t TDHR;
+} CAN_TxMailBox_TypeDef;
+
+typedef struct {
+    __IO uint32_t RIR;
+    __IO uint32_t RDTR;
+    __IO uint32_t RDLR;
+    __IO uint32_t RDHR;
+} CAN_FIFOMailBox_TypeDef;
+
+typedef struct {
+    __IO uint32_t FR1;
+    __IO uint32_t FR2;
+} CAN_FilterRegister_TypeDef;
+
+typedef struct {
+    __IO uint32_t MCR;
+    __IO uint32_t MSR;
+    __IO uint32_t TSR;
+    __IO uint32_t RF0R;
+    __IO uint32_t RF1R;
+    __IO uint32_t IER;
+    __IO uint32_t ESR;
+    __IO uint32_t BTR;
+    uint32_t RESERVED0[88];
+    CAN_TxMailBox_TypeDef sTxMailBox[3];
+    CAN_FIFOMailBox_TypeDef sFIFOMailBox[2];
+    uint32_t RESERVED1[12];
+    __IO uint32_t FMR;
+    __IO uint32_t FM1R;
+    uint32_t RESERVED2;
+    __IO uint32_t FS1R;
+    uint32_t RESERVED3;
+    __IO uint32_t FFA1R;
+    uint32_t RESERVED4;
+    __IO uint32_t FA1R;
+    uint32_t RESERVED5[8];
+    CAN_FilterRegister_TypeDef sFilterRegister[28];
+} CAN_TypeDef;
+
+typedef struct {
+    __IO uint32_t MODER;
+    __IO uint32_t OTYPER;
+    __IO uint32_t OSPEEDR;
+    __IO uint32_t PUPDR;
+    __IO uint32_t IDR;
+    __IO uint32_t ODR;
+    __IO uint32_t BSRR;
+    __IO uint32_t LCKR;
+    __IO uint32_t AFR[2];
+    __IO uint32_t BRR;
+} GPIO_TypeDef;
+
+typedef struct {
+    __IO uint32_t CR;
+    __IO uint32_t CFGR;
+    __IO uint32_t CIR;
+    __IO uint32_t APB2RSTR;
+    __IO uint32_t APB1RSTR;
+    __IO uint32_t AHBENR;
+    __IO uint32_t APB2ENR;
+    __IO uint32_t APB1ENR;
+    __IO uint32_t BDCR;
+    __IO uint32_t CSR;
+    __IO uint32_t AHBRSTR;
+    __IO uint32_t CFGR2;
+    __IO uint32_t CFGR3;
+    __IO uint32_t CR2;
+} RCC_TypeDef;
+
+typedef struct {
+    __IO uint32_t CR1;
+    __IO uint32_t CR2;
+    __IO uint32_t SMCR;
+    __IO uint32_t DIER;
+    __IO uint32_t SR;
+    __IO uint32_t EGR;
+    __IO uint32_t CCMR1;
+    __IO uint32_t CCMR2;
+    __IO uint32_t CCER;
+    __IO uint32_t CNT;
+    __IO uint32_t PSC;
+    __IO uint32_t ARR;
+} TIM_TypeDef;
+
+typedef struct {
+    __IO uint32_t EPR[8];
+    uint32_t RESERVED[8];
+    __IO uint32_t CNTR;
+    __IO uint32_t ISTR;
+    __IO uint32_t FNR;
+    __IO uint32_t DADDR;
+    __IO uint32_t BTABLE;
+} USB_TypeDef;
+
+typedef struct {
+    __IO uint32_t CR;
+    __IO uint32_t CFGR;
+    __IO uint32_t ISR;
+    __IO uint32_t ICR;
+} CRS_TypeDef;
+
+extern CAN_TypeDef sim_can;
+extern GPIO_TypeDef sim_gpioa;
+extern GPIO_TypeDef sim_gpiob;
+extern RCC_TypeDef sim_rcc;
+extern TIM_TypeDef sim_tim2;
+extern TIM_TypeDef sim_tim3;
+extern USB_TypeDef sim_usb;
+extern CRS_TypeDef sim_crs;
+
+#define CAN                             (&sim_can)
+#define GPIOA                           (&sim_gpioa)
+#define GPIOB                           (&sim_gpiob)
+#define RCC                             (&sim_rcc)
+#define TIM2                            (&sim_tim2)
+#define TIM3                            (&sim_tim3)
+#define USB                             (&sim_usb)
+#define CRS                             (&sim_crs)
+
+/* Register access. Writes go through the simulator, which gives the CAN
+ * registers their side effects, @see host/can_model.c. */
+void sim_write_reg(volatile uint32_t *reg, uint32_t value);
+
+#define WRITE_REG(REG, VAL)             sim_write_reg(&(REG), (VAL))
+#define READ_REG(REG)                   ((REG))
+#define SET_BIT(REG, BIT)               WRITE_REG((REG), (REG) | (BIT))
+#define CLEAR_BIT(REG, BIT)             WRITE_REG((REG), (REG) & ~(BIT))
+#define READ_BIT(REG, BIT)              ((REG) & (BIT))
+
+/* Core */
+void __disable_irq(void);
+void __enable_irq(void);
+uint32_t __get_PRIMASK(void);
+void __set_PRIMASK(uint32_t primask);
+void __WFI(void);
+void __NOP(void);
+void NVIC_SetPriority(IRQn_Type irqn, uint32_t priority);
+void NVIC_EnableIRQ(IRQn_Type irqn);
+void NVIC_DisableIRQ(IRQn_Type irqn);
+uint32_t SysTick_Config(uint32_t ticks);
+
+extern uint32_t SystemCoreClock;
+void SystemCoreClockUpdate(void);
+
+/* GPIO */
+#define GPIO_MODER_MODER0               0x00000003u
+#define GPIO_MODER_MODER0_0             0x00000001u
+#define GPIO_MODER_MODER0_1             0x00000002u
+#define GPIO_MODER_MODER1               0x0000000cu
+#define GPIO_MODER_MODER1_0             0x00000004u
+#define GPIO_ODR_0                      0x00000001u
+#define GPIO_ODR_1                      0x00000002u
+#define GPIO_AFRH_AFRH0                 0x0000000fu
+
+/* RCC */
+#define RCC_CR_HSEON                    0x00010000u
+#define RCC_CR_HSERDY                   0x00020000u
+#define RCC_CR_CSSON                    0x00080000u
+#define RCC_CR_PLLON                    0x01000000u
+#define RCC_CR_PLLRDY                   0x02000000u
+#define RCC_CR2_HSI48ON                 0x00010000u
+#define RCC_CR2_HSI48RDY                0x00020000u
+#define RCC_CFGR_SW                     0x00000003u
+#define RCC_CFGR_SW_PLL                 0x00000002u
+#define RCC_CFGR_SW_HSI48               0x00000003u
+#define RCC_CFGR_SWS                    0x0000000cu
+#define RCC_CFGR_SWS_HSI                0x00000000u
+#define RCC_CFGR_SWS_PLL                0x00000008u
+#define RCC_CFGR_SWS_HSI48              0x0000000cu
+#define RCC_CFGR_HPRE                   0x000000f0u
+#define RCC_CFGR_HPRE_DIV1              0x00000000u
+#define RCC_CFGR_PPRE                   0x00000700u
+#define RCC_CFGR_PPRE_DIV1              0x00000000u
+#define RCC_CFGR_PLLSRC                 0x00018000u
+#define RCC_CFGR_PLLSRC_HSE_PREDIV      0x00010000u
+#define RCC_CFGR_PLLMUL                 0x003c0000u
+#define RCC_CFGR_PLLMUL3                0x00040000u
+#define RCC_CFGR2_PREDIV                0x0000000fu
+#define RCC_CFGR2_PREDIV_DIV1           0x00000000u
+#define RCC_CFGR3_USBSW                 0x00000080u
+#define RCC_CFGR3_USBSW_HSI48           0x00000000u
+#define RCC_CFGR3_USBSW_PLLCLK          0x00000080u
+#define RCC_AHBENR_GPIOAEN              0x00020000u
+#define RCC_AHBENR_GPIOBEN              0x00040000u
+#define RCC_APB1ENR_TIM2EN              0x00000001u
+#define RCC_APB1ENR_TIM3EN              0x00000002u
+#define RCC_APB1ENR_CANEN               0x02000000u
+#define RCC_APB1ENR_CRSEN               0x08000000u
+#define RCC_APB1RSTR_TIM3RST            0x00000002u
+#define RCC_APB1RSTR_CANRST             0x02000000u
+
+/* CRS */
+#define CRS_CR_CEN                      0x00000020u
+#define CRS_CR_AUTOTRIMEN               0x00000040u
+
+/* TIM */
+#define TIM_CR1_CEN                     0x00000001u
+#define TIM_DIER_UIE                    0x00000001u
+#define TIM_SR_UIF                      0x00000001u
+#define TIM_EGR_UG                      0x00000001u
+
+/* USB */
+#define USB_FNR_FN                      0x000007ffu
+
+/* CAN */
+#define CAN_MCR_INRQ                    0x00000001u
+#define CAN_MCR_SLEEP                   0x00000002u
+#define CAN_MCR_TXFP                    0x00000004u
+#define CAN_MCR_RFLM                    0x00000008u
+#define CAN_MCR_NART                    0x00000010u
+#define CAN_MCR_AWUM                    0x00000020u
+#define CAN_MCR_ABOM                    0x00000040u
+#define CAN_MCR_TTCM                    0x00000080u
+#define CAN_MCR_RESET                   0x00008000u
+#define CAN_MSR_INAK                    0x00000001u
+#define CAN_MSR_SLAK                    0x00000002u
+#define CAN_MSR_ERRI                    0x00000004u
+#define CAN_TSR_RQCP0                   0x00000001u
+#define CAN_TSR_TXOK0                   0x00000002u
+#define CAN_TSR_ALST0                   0x00000004u
+#define CAN_TSR_TERR0                   0x00000008u
+#define CAN_TSR_ABRQ0                   0x00000080u
+#define CAN_TSR_RQCP1                   0x00000100u
+#define CAN_TSR_TXOK1                   0x00000200u
+#define CAN_TSR_ABRQ1                   0x00008000u
+#define CAN_TSR_RQCP2                   0x00010000u
+#define CAN_TSR_TXOK2                   0x00020000u
+#define CAN_TSR_ABRQ2                   0x00800000u
+#define CAN_TSR_CODE                    0x03000000u
+#define CAN_TSR_TME                     0x1c000000u
+#define CAN_TSR_TME0                    0x04000000u
+#define CAN_TSR_TME1                    0x08000000u
+#define CAN_TSR_TME2                    0x10000000u
+#define CAN_RF0R_FMP0                   0x00000003u
+#define CAN_RF0R_FULL0                  0x00000008u
+#define CAN_RF0R_FOVR0                  0x00000010u
+#define CAN_RF0R_RFOM0                  0x00000020u
+#define CAN_IER_TMEIE                   0x00000001u
+#define CAN_IER_FMPIE0                  0x00000002u
+#define CAN_IER_FFIE0                   0x00000004u
+#define CAN_IER_FOVIE0                  0x00000008u
+#define CAN_IER_EWGIE                   0x00000100u
+#define CAN_IER_EPVIE                   0x00000200u
+#define CAN_IER_BOFIE                   0x00000400u
+#define CAN_IER_LECIE                   0x00000800u
+#define CAN_IER_ERRIE                   0x00008000u
+#define CAN_ESR_EWGF                    0x00000001u
+#define CAN_ESR_EPVF                    0x00000002u
+#define CAN_ESR_BOFF                    0x00000004u
+#define CAN_ESR_LEC                     0x00000070u
+#define CAN_ESR_TEC                     0x00ff0000u
+#define CAN_ESR_REC                     0xff000000u
+#define CAN_BTR_BRP                     0x000003ffu
+#define CAN_BTR_TS1                     0x000f0000u
+#define CAN_BTR_TS2                     0x00700000u
+#define CAN_BTR_LBKM                    0x40000000u
+#define CAN_BTR_SILM                    0x80000000u
+#define CAN_TI0R_TXRQ                   0x00000001u
+#define CAN_TI0R_RTR                    0x00000002u
+#define CAN_TI0R_IDE                    0x00000004u
+#define CAN_RI0R_RTR                    0x00000002u
+#define CAN_RI0R_IDE                    0x00000004u
+#define CAN_FMR_FINIT                   0x00000001u
+#define CAN_FM1R_FBM0                   0x00000001u
+#define CAN_FS1R_FSC0                   0x00000001u
+#define CAN_FFA1R_FFA0                  0x00000001u
+#define CAN_FA1R_FACT0                  0x00000001u
+
+#endif
@@ -0,0 +1,275 @@
+#ifndef _HOST_STM32F0XX_HAL_H_
+#define _HOST_STM32F0XX_HAL_H_
+
+/* Stand-in for the STM32Cube HAL in the host build, @see host/sim.c. Only the
+ * types, constants and functions the firmware uses, with the values of
+ * STM32CubeF0. The functions are in host/hal.c and host/pcd.c. */
+#include <stddef.h>
+#include "stm32f0xx.h"
+
+typedef enum {
+    HAL_OK = 0,
+    HAL_ERROR,
+    HAL_BUSY,
+    HAL_TIMEOUT
+} HAL_StatusTypeDef;
+
+typedef enum {
+    HAL_UNLOCKED = 0,
+    HAL_LOCKED
+} HAL_LockTypeDef;
+
+#define HSE_STARTUP_TIMEOUT             100u
+
+HAL_StatusTypeDef HAL_Init(void);
+uint32_t HAL_GetTick(void);
+void HAL_IncTick(void);
+void HAL_Delay(uint32_t delay);
+void HAL_NVIC_SetPriority(IRQn_Type irqn, uint32_t preempt, uint32_t sub);
+void HAL_NVIC_EnableIRQ(IRQn_Type irqn);
+void HAL_NVIC_DisableIRQ(IRQn_Type irqn);
+
+/* RCC */
+#define __HAL_RCC_GPIOA_CLK_ENABLE()    (RCC->AHBENR |= RCC_AHBENR_GPIOAEN)
+#define __HAL_RCC_GPIOB_CLK_ENABLE()    (RCC->AHBENR |= RCC_AHBENR_GPIOBEN)
+#define __HAL_RCC_TIM2_CLK_ENABLE()     (RCC->APB1ENR |= RCC_APB1ENR_TIM2EN)
+#define __HAL_RCC_TIM3_CLK_ENABLE()     (RCC->APB1ENR |= RCC_APB1ENR_TIM3EN)
+#define __HAL_RCC_TIM3_FORCE_RESET()    (RCC->APB1RSTR |= RCC_APB1RSTR_TIM3RST)
+#define __HAL_RCC_TIM3_RELEASE_RESET()  (RCC->APB1RSTR &= ~RCC_APB1RSTR_TIM3RST)
+#define __HAL_RCC_CAN1_CLK_ENABLE()     (RCC->APB1ENR |= RCC_APB1ENR_CANEN)
+#define __HAL_RCC_CAN1_FORCE_RESET()    SET_BIT(RCC->APB1RSTR, RCC_APB1RSTR_CANRST)
+#define __HAL_RCC_CAN1_RELEASE_RESET()  (RCC->APB1RSTR &= ~RCC_APB1RSTR_CANRST)
+#define __HAL_RCC_USB_CLK_ENABLE()      ((void) 0)
+#define __HAL_RCC_USB_CLK_DISABLE()     ((void) 0)
+
+/* GPIO */
+typedef struct {
+    uint32_t Pin;
+    uint32_t Mode;
+    uint32_t Pull;
+    uint32_t Speed;
+    uint32_t Alternate;
+} GPIO_InitTypeDef;
+
+#define GPIO_PIN_0                      0x0001u
+#define GPIO_PIN_1                      0x0002u
+#define GPIO_PIN_8                      0x0100u
+#define GPIO_PIN_9                      0x0200u
+#define GPIO_PIN_11                     0x0800u
+#define GPIO_PIN_12                     0x1000u
+#define GPIO_MODE_OUTPUT_PP             0x00000001u
+#define GPIO_MODE_AF_PP                 0x00000002u
+#define GPIO_NOPULL                     0x00000000u
+#define GPIO_PULLUP                     0x00000001u
+#define GPIO_SPEED_FREQ_LOW             0x00000000u
+#define GPIO_SPEED_FREQ_HIGH            0x00000003u
+#define GPIO_AF2_USB                    0x02u
+#define GPIO_AF4_CAN                    0x04u
+
+void HAL_GPIO_Init(GPIO_TypeDef *port, GPIO_InitTypeDef *init);
+void HAL_GPIO_DeInit(GPIO_TypeDef *port, uint32_t pin);
+
+/* TIM */
+typedef struct {
+    uint32_t Prescaler;
+    uint32_t CounterMode;
+    uint32_t Period;
+    uint32_t ClockDivision;
+    uint32_t RepetitionCounter;
+    uint32_t AutoReloadPreload;
+} TIM_Base_InitTypeDef;
+
+typedef struct {
+    TIM_TypeDef *Instance;
+    TIM_Base_InitTypeDef Init;
+} TIM_HandleTypeDef;
+
+#define TIM_COUNTERMODE_UP              0x00000000u
+#define TIM_CLOCKDIVISION_DIV1          0x00000000u
+#define TIM_AUTORELOAD_PRELOAD_DISABLE  0x00000000u
+
+HAL_StatusTypeDef HAL_TIM_Base_Init(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_Base_DeInit(TIM_HandleTypeDef *htim);
+HAL_StatusTypeDef HAL_TIM_Base_Start_IT(TIM_HandleTypeDef *htim);
+void HAL_TIM_IRQHandler(TIM_HandleTypeDef *htim);
+void HAL_TIM_Base_MspInit(TIM_HandleTypeDef *htim);
+void HAL_TIM_Base_MspDeInit(TIM_HandleTypeDef *htim);
+void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim);
+void HAL_TIM_ErrorCallback(TIM_HandleTypeDef *htim);
+
+/* CAN */
+typedef struct {
+    uint32_t Prescaler;
+    uint32_t Mode;
+    uint32_t SJW;
+    uint32_t BS1;
+    uint32_t BS2;
+    uint32_t TTCM;
+    uint32_t ABOM;
+    uint32_t AWUM;
+    uint32_t NART;
+    uint32_t RFLM;
+    uint32_t TXFP;
+} CAN_InitTypeDef;
+
+typedef struct {
+    uint32_t StdId;
+    uint32_t ExtId;
+    uint32_t IDE;
+    uint32_t RTR;
+    uint32_t DLC;
+    uint8_t Data[8];
+} CanTxMsgTypeDef;
+
+typedef struct {
+    uint32_t StdId;
+    uint32_t ExtId;
+    uint32_t IDE;
+    uint32_t RTR;
+    uint32_t DLC;
+    uint8_t Data[8];
+    uint32_t FMI;
+    uint32_t FIFONumber;
+} CanRxMsgTypeDef;
+
+typedef struct {
+    uint32_t FilterIdHigh;
+    uint32_t FilterIdLow;
+    uint32_t FilterMaskIdHigh;
+    uint32_t FilterMaskIdLow;
+    uint32_t FilterFIFOAssignment;
+    uint32_t FilterNumber;
+    uint32_t FilterMode;
+    uint32_t FilterScale;
+    uint32_t FilterActivation;
+    uint32_t BankNumber;
+} CAN_FilterConfTypeDef;
+
+typedef enum {
+    HAL_CAN_STATE_RESET = 0x00,
+    HAL_CAN_STATE_READY = 0x01
+} HAL_CAN_StateTypeDef;
+
+typedef struct {
+    CAN_TypeDef *Instance;
+    CAN_InitTypeDef Init;
+    CanTxMsgTypeDef *pTxMsg;
+    CanRxMsgTypeDef *pRxMsg;
+    __IO HAL_CAN_StateTypeDef State;
+    HAL_LockTypeDef Lock;
+    __IO uint32_t ErrorCode;
+} CAN_HandleTypeDef;
+
+#define CAN_MODE_NORMAL                 0x00000000u
+#define CAN_MODE_LOOPBACK               CAN_BTR_LBKM
+#define CAN_MODE_SILENT                 CAN_BTR_SILM
+#define CAN_ID_STD                      0x00000000u
+#define CAN_ID_EXT                      0x00000004u
+#define CAN_RTR_DATA                    0x00000000u
+#define CAN_RTR_REMOTE                  0x00000002u
+#define CAN_FIFO0                       0x00u
+#define CAN_FILTERMODE_IDMASK           0x00u
+#define CAN_FILTERSCALE_32BIT           0x01u
+#define CAN_IT_TME                      CAN_IER_TMEIE
+#define CAN_IT_FMP0                     CAN_IER_FMPIE0
+#define CAN_IT_FOV0                     CAN_IER_FOVIE0
+#define CAN_IT_EWG                      CAN_IER_EWGIE
+#define CAN_IT_EPV                      CAN_IER_EPVIE
+#define CAN_IT_BOF                      CAN_IER_BOFIE
+#define CAN_IT_LEC                      CAN_IER_LECIE
+#define CAN_IT_ERR                      CAN_IER_ERRIE
+#define HAL_CAN_ERROR_NONE              0x00000000u
+#define HAL_CAN_ERROR_EWG               0x00000001u
+#define HAL_CAN_ERROR_EPV               0x00000002u
+#define HAL_CAN_ERROR_BOF               0x00000004u
+#define HAL_CAN_ERROR_STF               0x00000008u
+#define HAL_CAN_ERROR_FOR               0x00000010u
+#define HAL_CAN_ERROR_ACK               0x00000020u
+#define HAL_CAN_ERROR_BR                0x00000040u
+#define HAL_CAN_ERROR_BD                0x00000080u
+#define HAL_CAN_ERROR_CRC               0x00000100u
+#define HAL_CAN_ERROR_FOV0              0x00000200u
+
+#define __HAL_CAN_ENABLE_IT(h, it)      ((h)->Instance->IER |= (it))
+#define __HAL_CAN_DISABLE_IT(h, it)     ((h)->Instance->IER &= ~(it))
+
+HAL_StatusTypeDef HAL_CAN_ConfigFilter(CAN_HandleTypeDef *hcan,
+        CAN_FilterConfTypeDef *filter);
+void HAL_CAN_IRQHandler(CAN_HandleTypeDef *hcan);
+void HAL_CAN_MspInit(CAN_HandleTypeDef *hcan);
+void HAL_CAN_MspDeInit(CAN_HandleTypeDef *hcan);
+void HAL_CAN_TxCpltCallback(CAN_HandleTypeDef *hcan);
+void HAL_CAN_RxCpltCallback(CAN_HandleTypeDef *hcan);
+void HAL_CAN_ErrorCallback(CAN_HandleTypeDef *hcan);
+
+/* PCD */
+typedef struct {
+    uint32_t dev_endpoints;
+    uint32_t speed;
+    uint32_t ep0_mps;
+    uint32_t phy_itface;
+    uint32_t Sof_enable;
+    uint32_t low_power_enable;
+    uint32_t lpm_enable;
+    uint32_t battery_charging_enable;
+} PCD_InitTypeDef;
+
+typedef struct {
+    uint8_t num;
+    uint8_t is_in;
+    uint8_t is_stall;
+    uint8_t type;
+    uint16_t pmaadress;
+    uint32_t maxpacket;
+    uint8_t *xfer_buff;
+    uint32_t xfer_len;
+    uint32_t xfer_count;
+} PCD_EPTypeDef;
+
+typedef struct {
+    USB_TypeDef *Instance;
+    PCD_InitTypeDef Init;
+    __IO uint8_t USB_Address;
+    PCD_EPTypeDef IN_ep[8];
+    PCD_EPTypeDef OUT_ep[8];
+    HAL_LockTypeDef Lock;
+    __IO uint32_t State;
+    uint32_t Setup[12];
+    void *pData;
+} PCD_HandleTypeDef;
+
+#define PCD_SPEED_FULL                  1u
+#define PCD_PHY_EMBEDDED                2u
+#define PCD_SNG_BUF                     0u
+
+HAL_StatusTypeDef HAL_PCD_Init(PCD_HandleTypeDef *hpcd);
+HAL_StatusTypeDef HAL_PCD_DeInit(PCD_HandleTypeDef *hpcd);
+HAL_StatusTypeDef HAL_PCD_Start(PCD_HandleTypeDef *hpcd);
+HAL_StatusTypeDef HAL_PCD_Stop(PCD_HandleTypeDef *hpcd);
+void HAL_PCD_IRQHandler(PCD_HandleTypeDef *hpcd);
+HAL_StatusTypeDef HAL_PCDEx_PMAConfig(PCD_HandleTypeDef *hpcd,
+        uint16_t ep_addr, uint16_t ep_kind, uint32_t pmaadress);
+HAL_StatusTypeDef HAL_PCD_SetAddress(PCD_HandleTypeDef *hpcd,
+        uint8_t address);
+HAL_StatusTypeDef HAL_PCD_EP_Open(PCD_HandleTypeDef *hpcd, uint8_t ep_addr,
+        uint16_t ep_mps, uint8_t ep_type);
+HAL_StatusTypeDef HAL_PCD_EP_Close(PCD_HandleTypeDef *hpcd, uint8_t ep_addr);
+HAL_StatusTypeDef HAL_PCD_EP_Receive(PCD_HandleTypeDef *hpcd, uint8_t ep_addr,
+        uint8_t *buf, uint32_t len);
+HAL_StatusTypeDef HAL_PCD_EP_Transmit(PCD_HandleTypeDef *hpcd,
+        uint8_t ep_addr, uint8_t *buf, uint32_t len);
+uint16_t HAL_PCD_EP_GetRxCount(PCD_HandleTypeDef *hpcd, uint8_t ep_addr);
+HAL_StatusTypeDef HAL_PCD_EP_SetStall(PCD_HandleTypeDef *hpcd,
+        uint8_t ep_addr);
+HAL_StatusTypeDef HAL_PCD_EP_ClrStall(PCD_HandleTypeDef *hpcd,
+        uint8_t ep_addr);
+HAL_StatusTypeDef HAL_PCD_EP_Flush(PCD_HandleTypeDef *hpcd, uint8_t ep_addr);
+void HAL_PCD_MspInit(PCD_HandleTypeDef *hpcd);
+void HAL_PCD_MspDeInit(PCD_HandleTypeDef *hpcd);
+void HAL_PCD_SetupStageCallback(PCD_HandleTypeDef *hpcd);
+void HAL_PCD_DataOutStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum);
+void HAL_PCD_DataInStageCallback(PCD_HandleTypeDef *hpcd, uint8_t epnum);
+void HAL_PCD_SOFCallback(PCD_HandleTypeDef *hpcd);
+void HAL_PCD_ResetCallback(PCD_HandleTypeDef *hpcd);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef _HOST_USBD_CTLREQ_H_
+#define _HOST_USBD_CTLREQ_H_
+
+#include "usbd_def.h"
+
+void USBD_CtlError(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
+void USBD_GetString(uint8_t *desc, uint8_t *unicode, uint16_t *len);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef _HOST_USBD_IOREQ_H_
+#define _HOST_USBD_IOREQ_H_
+
+#include "usbd_def.h"
+#include "usbd_core.h"
+
+USBD_StatusTypeDef USBD_CtlSendData(USBD_HandleTypeDef *pdev, uint8_t *buf,
+        uint16_t len);
+USBD_StatusTypeDef USBD_CtlContinueSendData(USBD_HandleTypeDef *pdev,
+        uint8_t *buf, uint16_t len);
+USBD_StatusTypeDef USBD_CtlPrepareRx(USBD_HandleTypeDef *pdev, uint8_t *buf,
+        uint16_t len);
+USBD_StatusTypeDef USBD_CtlContinueRx(USBD_HandleTypeDef *pdev, uint8_t *buf,
+        uint16_t len);
+USBD_StatusTypeDef USBD_CtlSendStatus(USBD_HandleTypeDef *pdev);
+USBD_StatusTypeDef USBD_CtlReceiveStatus(USBD_HandleTypeDef *pdev);
+
+#endif
@@ -0,0 +1,403 @@
+/**
+ * USB peripheral and host of the host build.
+ *
+ * Replaces the HAL PCD driver at its interface to src/usbd_conf.c. The host
+ * resets and configures the device 1ms after HAL_PCD_Start(), then sends a
+ * start-of-frame every 1ms. A transfer on an IN endpoint is read by the host
+ * sim_config.in_ns per packet after it was started, a packet the host sends
+ * reaches an armed OUT endpoint sim_config.out_ns after it was armed or the
+ * packet was queued. While the host is busy (pcd_host_busy()) it does
+ * neither. Completed transfers raise the USB interrupt, HAL_PCD_IRQHandler()
+ * then calls the callbacks like the HAL driver does.
+ *
+ * What the device sends is decoded as 8dev data records, error records and
+ * command replies and passed to sim.c.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+#include "stm32f0xx_hal.h"
+
+#define EPS                 8
+#define PACKET_SIZE         64
+
+// 8dev messages, @see src/usbd_8dev_if.c
+#define DATA_MSG_SIZE       21
+#define DATA_START          0x55
+#define DATA_END            0xaa
+#define DATA_TYPE_FRAME     0
+#define DATA_TYPE_ERROR     3
+#define DATA_FLAG_EXTID     0x01
+#define DATA_FLAG_RTR       0x02
+#define CMD_MSG_SIZE        16
+#define CMD_START           0x11
+#define CMD_END             0x22
+
+typedef struct {
+    uint8_t data[PACKET_SIZE];
+    uint16_t len;
+} Packet_TypeDef;
+
+typedef struct {
+    Packet_TypeDef *packets;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t size;
+} Queue_TypeDef;
+
+static PCD_HandleTypeDef *pcd;
+static uint64_t reset_at = SIM_NEVER;
+static uint64_t setup_at = SIM_NEVER;
+static uint64_t sof_at = SIM_NEVER;
+static uint64_t busy_end;
+
+static uint8_t in_pma[EPS][4 * PACKET_SIZE];
+static uint32_t in_len[EPS];
+static uint64_t in_at[EPS];         /*< Host reads the transfer, if busy */
+static uint8_t in_busy;
+static uint64_t out_at[EPS];        /*< Packet arrives, if scheduled */
+static uint8_t out_scheduled;
+static uint8_t out_armed;
+static Queue_TypeDef host_queue[EPS];
+
+// Pending interrupt sources
+static uint8_t reset_pending;
+static uint8_t setup_pending;
+static uint8_t sof_pending;
+static uint8_t in_done;
+static uint8_t out_done;
+
+static uint64_t after_busy(uint64_t delay) {
+    return (sim_now > busy_end ? sim_now : busy_end) + delay;
+}
+
+static void out_schedule(uint8_t num) {
+    Queue_TypeDef *queue = &host_queue[num];
+    if ((out_armed & (1 << num)) && queue->head != queue->tail
+            && !(out_scheduled & (1 << num))) {
+        out_scheduled |= 1 << num;
+        out_at[num] = after_busy(sim_config.out_ns);
+    }
+}
+
+/* Pass the messages of an IN transfer on to the simulation. */
+static void host_parse(uint8_t num, const uint8_t *data, uint32_t len) {
+    Sim_FrameTypeDef frame;
+    const uint8_t *msg;
+    uint32_t i;
+
+    if (num == (PCD_CMD_IN_EP & 0x7f)) {
+        for (i = 0; i + CMD_MSG_SIZE <= len; i += CMD_MSG_SIZE) {
+            if (data[i] == CMD_START && data[i + CMD_MSG_SIZE - 1] == CMD_END) {
+                sim_host_cmd(&data[i]);
+            }
+        }
+        return;
+    }
+    if (num != (PCD_DATA_IN_EP & 0x7f)) {
+        return;
+    }
+    for (i = 0; i + DATA_MSG_SIZE <= len; i += DATA_MSG_SIZE) {
+        msg = &data[i];
+        if (msg[0] != DATA_START || msg[DATA_MSG_SIZE - 1] != DATA_END) {
+            continue;
+        }
+        // Error code in data[0], number of repeats in data[3]
+        if (msg[1] == DATA_TYPE_ERROR) {
+            sim_host_error(msg[8], msg[11]);
+            continue;
+        } else if (msg[1] != DATA_TYPE_FRAME) {
+            continue;
+        }
+        frame.ext = (msg[2] & DATA_FLAG_EXTID) != 0;
+        frame.rtr = (msg[2] & DATA_FLAG_RTR) != 0;
+        frame.id = (uint32_t) msg[3] << 24 | msg[4] << 16 | msg[5] << 8 | msg[6];
+        // Masked as usb_8dev does, the upper bits can hold a sequence number
+        frame.dlc = msg[7] & 0x0f;
+        memcpy(frame.data, &msg[8], sizeof(frame.data));
+        sim_host_frame(&frame, msg[16] | msg[17] << 8 | msg[18] << 16
+                | (uint32_t) msg[19] << 24);
+    }
+}
+
+/**
+ * Queue a packet for an OUT endpoint.
+ *
+ * @param[in] ep_addr endpoint address
+ * @param[in] data packet
+ * @param[in] len length of the packet, at most 64
+ */
+void pcd_host_send(uint8_t ep_addr, const uint8_t *data, uint16_t len) {
+    Queue_TypeDef *queue = &host_queue[ep_addr & 0x7f];
+    if (queue->head - queue->tail == queue->size) {
+        uint32_t size = queue->size ? 2 * queue->size : 64;
+        Packet_TypeDef *packets = malloc(size * sizeof(*packets));
+        uint32_t i;
+        if (!packets) {
+            abort();
+        }
+        for (i = 0; i < queue->head - queue->tail; i++) {
+            packets[i] = queue->packets[(queue->tail + i) % queue->size];
+        }
+        free(queue->packets);
+        queue->packets = packets;
+        queue->head -= queue->tail;
+        queue->tail = 0;
+        queue->size = size;
+    }
+    memcpy(queue->packets[queue->head % queue->size].data, data, len);
+    queue->packets[queue->head % queue->size].len = len;
+    queue->head++;
+    out_schedule(ep_addr & 0x7f);
+}
+
+/**
+ * The host doesn't read or send anything for a while.
+ *
+ * @param[in] duration time in ns
+ */
+void pcd_host_busy(uint64_t duration) {
+    if (sim_now + duration > busy_end) {
+        busy_end = sim_now + duration;
+    }
+}
+
+/**
+ * @return number of packets the host has queued for an OUT endpoint
+ */
+uint32_t pcd_host_queued(uint8_t ep_addr) {
+    Queue_TypeDef *queue = &host_queue[ep_addr & 0x7f];
+    return queue->head - queue->tail;
+}
+
+uint8_t pcd_irq_pending(void) {
+    return reset_pending || setup_pending || sof_pending || in_done || out_done;
+}
+
+/**
+ * @return time something happens next on the bus
+ */
+uint64_t pcd_next(void) {
+    uint64_t next = reset_at;
+    uint8_t i;
+    if (setup_at < next) next = setup_at;
+    if (sof_at < next) next = sof_at;
+    for (i = 0; i < EPS; i++) {
+        if ((in_busy & (1 << i)) && in_at[i] < next) next = in_at[i];
+        if ((out_scheduled & (1 << i)) && out_at[i] < next) next = out_at[i];
+    }
+    return next;
+}
+
+/**
+ * Run what is due on the bus.
+ */
+void pcd_run(void) {
+    Queue_TypeDef *queue;
+    Packet_TypeDef *packet;
+    PCD_EPTypeDef *ep;
+    uint8_t i;
+
+    if (reset_at <= sim_now) {
+        reset_at = SIM_NEVER;
+        reset_pending = 1;
+    }
+    if (setup_at <= sim_now) {
+        // SET_CONFIGURATION 1
+        static const uint8_t setup[8] = {0x00, 0x09, 0x01, 0x00, 0, 0, 0, 0};
+        setup_at = SIM_NEVER;
+        memcpy(pcd->Setup, setup, sizeof(setup));
+        setup_pending = 1;
+    }
+    if (sof_at <= sim_now) {
+        sof_at += SIM_MS;
+        sim_usb.FNR = (sim_usb.FNR + 1) & USB_FNR_FN;
+        sof_pending = 1;
+    }
+    for (i = 0; i < EPS; i++) {
+        if (!(in_busy & (1 << i)) || in_at[i] > sim_now) {
+            continue;
+        }
+        if (sim_now < busy_end) {
+            in_at[i] = busy_end + sim_config.in_ns;
+            continue;
+        }
+        in_busy &= ~(1 << i);
+        pcd->IN_ep[i].xfer_count = in_len[i];
+        in_done |= 1 << i;
+        host_parse(i, in_pma[i], in_len[i]);
+    }
+    for (i = 0; i < EPS; i++) {
+        if ((out_scheduled & (1 << i)) && out_at[i] <= sim_now) {
+            if (sim_now < busy_end) {
+                out_at[i] = busy_end + sim_config.out_ns;
+                continue;
+            }
+            out_scheduled &= ~(1 << i);
+            queue = &host_queue[i];
+            packet = &queue->packets[queue->tail++ % queue->size];
+            ep = &pcd->OUT_ep[i];
+            ep->xfer_count = packet->len < ep->xfer_len ? packet->len : ep->xfer_len;
+            memcpy(ep->xfer_buff, packet->data, ep->xfer_count);
+            out_armed &= ~(1 << i);
+            out_done |= 1 << i;
+        }
+    }
+}
+
+/******************************************************************************
+ * HAL PCD
+ *****************************************************************************/
+
+HAL_StatusTypeDef HAL_PCD_Init(PCD_HandleTypeDef *hpcd) {
+    pcd = hpcd;
+    HAL_PCD_MspInit(hpcd);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_DeInit(PCD_HandleTypeDef *hpcd) {
+    HAL_PCD_MspDeInit(hpcd);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_Start(PCD_HandleTypeDef *hpcd) {
+    (void) hpcd;
+    reset_at = sim_now + SIM_MS;
+    setup_at = sim_now + 2 * SIM_MS;
+    sof_at = sim_now + SIM_MS;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_Stop(PCD_HandleTypeDef *hpcd) {
+    (void) hpcd;
+    sof_at = SIM_NEVER;
+    return HAL_OK;
+}
+
+void HAL_PCD_IRQHandler(PCD_HandleTypeDef *hpcd) {
+    uint8_t i;
+    if (reset_pending) {
+        reset_pending = 0;
+        HAL_PCD_ResetCallback(hpcd);
+    }
+    if (setup_pending) {
+        setup_pending = 0;
+        HAL_PCD_SetupStageCallback(hpcd);
+    }
+    if (sof_pending) {
+        sof_pending = 0;
+        HAL_PCD_SOFCallback(hpcd);
+    }
+    for (i = 0; i < EPS; i++) {
+        if (out_done & (1 << i)) {
+            out_done &= ~(1 << i);
+            HAL_PCD_DataOutStageCallback(hpcd, i);
+        }
+        if (in_done & (1 << i)) {
+            in_done &= ~(1 << i);
+            HAL_PCD_DataInStageCallback(hpcd, i);
+        }
+    }
+}
+
+HAL_StatusTypeDef HAL_PCDEx_PMAConfig(PCD_HandleTypeDef *hpcd,
+        uint16_t ep_addr, uint16_t ep_kind, uint32_t pmaadress) {
+    (void) ep_kind;
+    if (ep_addr & 0x80) {
+        hpcd->IN_ep[ep_addr & 0x7f].pmaadress = pmaadress;
+    } else {
+        hpcd->OUT_ep[ep_addr].pmaadress = pmaadress;
+    }
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_SetAddress(PCD_HandleTypeDef *hpcd,
+        uint8_t address) {
+    hpcd->USB_Address = address;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Open(PCD_HandleTypeDef *hpcd, uint8_t ep_addr,
+        uint16_t ep_mps, uint8_t ep_type) {
+    PCD_EPTypeDef *ep = (ep_addr & 0x80) ? &hpcd->IN_ep[ep_addr & 0x7f]
+        : &hpcd->OUT_ep[ep_addr];
+    ep->num = ep_addr & 0x7f;
+    ep->is_in = (ep_addr & 0x80) != 0;
+    ep->maxpacket = ep_mps;
+    ep->type = ep_type;
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Close(PCD_HandleTypeDef *hpcd, uint8_t ep_addr) {
+    uint8_t num = ep_addr & 0x7f;
+    (void) hpcd;
+    if (ep_addr & 0x80) {
+        in_busy &= ~(1 << num);
+    } else {
+        out_armed &= ~(1 << num);
+        out_scheduled &= ~(1 << num);
+    }
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Receive(PCD_HandleTypeDef *hpcd, uint8_t ep_addr,
+        uint8_t *buf, uint32_t len) {
+    uint8_t num = ep_addr & 0x7f;
+    PCD_EPTypeDef *ep = &hpcd->OUT_ep[num];
+    ep->xfer_buff = buf;
+    ep->xfer_len = len;
+    ep->xfer_count = 0;
+    out_armed |= 1 << num;
+    out_schedule(num);
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Transmit(PCD_HandleTypeDef *hpcd,
+        uint8_t ep_addr, uint8_t *buf, uint32_t len) {
+    uint8_t num = ep_addr & 0x7f;
+    PCD_EPTypeDef *ep = &hpcd->IN_ep[num];
+    uint32_t packets = len ? (len + PACKET_SIZE - 1) / PACKET_SIZE : 1;
+    if (len > sizeof(in_pma[num])) {
+        len = sizeof(in_pma[num]);
+    }
+    ep->xfer_buff = buf;
+    ep->xfer_len = len;
+    ep->xfer_count = 0;
+    if (len) {
+        memcpy(in_pma[num], buf, len);
+    }
+    in_len[num] = len;
+    in_at[num] = after_busy(packets * sim_config.in_ns);
+    in_busy |= 1 << num;
+    return HAL_OK;
+}
+
+uint16_t HAL_PCD_EP_GetRxCount(PCD_HandleTypeDef *hpcd, uint8_t ep_addr) {
+    return hpcd->OUT_ep[ep_addr & 0x7f].xfer_count;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_SetStall(PCD_HandleTypeDef *hpcd,
+        uint8_t ep_addr) {
+    if (ep_addr & 0x80) {
+        hpcd->IN_ep[ep_addr & 0x7f].is_stall = 1;
+    } else {
+        hpcd->OUT_ep[ep_addr].is_stall = 1;
+    }
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_ClrStall(PCD_HandleTypeDef *hpcd,
+        uint8_t ep_addr) {
+    if (ep_addr & 0x80) {
+        hpcd->IN_ep[ep_addr & 0x7f].is_stall = 0;
+    } else {
+        hpcd->OUT_ep[ep_addr].is_stall = 0;
+    }
+    return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_PCD_EP_Flush(PCD_HandleTypeDef *hpcd, uint8_t ep_addr) {
+    (void) hpcd;
+    (void) ep_addr;
+    return HAL_OK;
+}
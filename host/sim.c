@@ -0,0 +1,857 @@
+/**
+ * @file sim.c
+ *
+ * Host build of the firmware
+ *
+ * Runs the 8dev firmware on Linux against a model of the CAN controller and
+ * bus (can_model.c) and of the USB peripheral and host (pcd.c), in virtual
+ * time. A script says what happens when, one event per line, times in µs:
+ *
+ *     # time    event
+ *     0         open 500000 [silent] [loopback] [oneshot] [berr]
+ *     10000     rx 123#11223344 [count interval]
+ *     10000     send 1f334455#0102 [count interval]
+ *     20000     busy 5000
+ *     30000     error crc [count interval]
+ *     40000     expect state active
+ *     50000     status [count interval]
+ *     900000    close
+ *     1000000   end
+ *
+ * open and close are sent as 8dev commands, the bitrate is also the one of
+ * the bus. rx puts frames of another node on the bus, send gives frames to the
+ * device over USB, both in cansend syntax (8 hex digits are an extended
+ * identifier, R a remote frame). With a count the event repeats every
+ * interval µs, the repetition number is added to the payload as a little
+ * endian counter, or to the identifier if there is no data, so every frame
+ * can be told apart. busy makes the host stop reading and writing USB for a
+ * while. error puts a frame on the bus that is destroyed by a stuff, form or
+ * crc error. expect state checks the CAN state the usb_8dev driver derives
+ * from the error records so far: active, warning or busoff. The simulation
+ * ends at end, or 100ms after the last event, with exit status 1 if an
+ * expectation wasn't met. status sends GET_STATUS, the records and errors the
+ * firmware dropped are taken from the reply.
+ *
+ * Every frame the host receives is matched with the frame in the receive FIFO
+ * it came from, which gives the latency from its end of frame on the bus to
+ * the host reading it. Frames the host never saw were lost, in the FIFO or
+ * in the firmware. The report is plain text, or JSON with -j for tools/bench.py.
+ *
+ * With -s the exit status is also 1 if anything the firmware should have
+ * passed on went missing: frames lost in the firmware, commands without a
+ * reply, or records and errors dropped according to the last status reply.
+ */
+#define _POSIX_C_SOURCE 200809L
+#include <ctype.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+#include "can.h"
+#include "stm32f0xx.h"
+
+// src/main.c, built with main renamed
+int firmware_main(void);
+
+#define SCRIPT_LINE         256
+#define DRAIN_NS            (100 * SIM_MS)
+
+// 8dev commands, @see src/usbd_8dev_if.c
+#define CMD_START           0x11
+#define CMD_END             0x22
+#define CMD_OPEN            2
+#define CMD_CLOSE           3
+#define CMD_GET_STATUS      6
+#define DATA_START          0x55
+#define DATA_END            0xaa
+#define DATA_FLAG_EXTID     0x01
+#define DATA_FLAG_RTR       0x02
+// Clock of the 8dev adapter the host computes the bit timing for
+#define HOST_CLOCK          32000000u
+// Last error codes of ESR
+#define LEC_STUFF           1
+#define LEC_FORM            2
+#define LEC_CRC             6
+// 8dev error codes that aren't protocol errors, usb_8dev takes every protocol
+// error for error warning
+#define ERR_OK              0x00
+#define ERR_FOV             0x01
+#define ERR_EWG             0x02
+#define ERR_EPV             0x03
+#define ERR_BOF             0x04
+// Frame destroyed by error, the lowest priority so it doesn't change the
+// order of the others
+#define ERROR_FRAME_ID      0x7ff
+
+typedef enum {
+    ACTION_OPEN,
+    ACTION_CLOSE,
+    ACTION_RX,
+    ACTION_SEND,
+    ACTION_BUSY,
+    ACTION_ERROR,
+    ACTION_EXPECT,
+    ACTION_STATUS,
+    ACTION_END
+} Action_TypeTypeDef;
+
+/* CAN state as the usb_8dev driver sees it. */
+typedef enum {
+    STATE_ACTIVE,
+    STATE_WARNING,
+    STATE_BUSOFF
+} Host_StateTypeDef;
+
+static const char *const state_names[] = {"active", "warning", "busoff"};
+
+typedef struct {
+    uint64_t at;                /*< Time of the next repetition */
+    Action_TypeTypeDef type;
+    Sim_FrameTypeDef frame;
+    uint32_t count;             /*< Repetitions left */
+    uint32_t index;             /*< Repetitions done */
+    uint64_t interval;
+    uint32_t value;             /*< Bitrate, busy time in µs or state */
+    uint8_t ctrlmode;
+} Action_TypeDef;
+
+typedef struct {
+    uint32_t frames;            /*< Frames received by the host */
+    uint32_t unmatched;         /*< Of those not found on the bus */
+    uint32_t sent;              /*< Frames the host sent */
+    uint32_t cmds;              /*< Commands the host sent */
+    uint32_t cmd_replies;       /*< Replies received */
+    uint32_t cmd_errors;        /*< Commands that failed */
+    uint8_t status;             /*< A status reply was received */
+    uint32_t data_drops;        /*< Records dropped, from the last status */
+    uint32_t err_drops;         /*< Errors dropped, from the last status */
+    uint32_t error_records;     /*< Error records received */
+    uint32_t error_repeats;     /*< Errors they stand for */
+    Host_StateTypeDef state;    /*< CAN state of the driver */
+    uint32_t expect_failed;     /*< Expectations not met */
+    uint64_t first;             /*< Time the first matched frame arrived */
+    uint64_t last;              /*< Time the last matched frame arrived */
+    uint64_t *latency;          /*< Latency of every matched frame */
+    uint32_t latency_size;
+} Host_StatsTypeDef;
+
+Sim_ConfigTypeDef sim_config = {
+    .op_ns = 500,
+    .irq_ns = 2 * SIM_US,
+    .in_ns = 60 * SIM_US,
+    .out_ns = 60 * SIM_US,
+    .end_ns = 0,
+    .verbose = 0
+};
+uint64_t sim_now;
+
+static Action_TypeDef *actions;
+static uint32_t actions_len;
+static uint64_t tim_ns;         /*< Time not counted by TIM2 yet */
+static uint32_t log_cursor;     /*< First FIFO frame not seen by the host */
+static Host_StatsTypeDef host;
+static const char *script_path;
+static uint8_t json;            /*< Report in JSON */
+static uint8_t strict;          /*< Fail if anything went missing */
+
+/******************************************************************************
+ * Script
+ *****************************************************************************/
+
+/* Parse a frame in cansend syntax. @return 0 if OK */
+static uint8_t parse_frame(const char *s, Sim_FrameTypeDef *frame) {
+    const char *hash = strchr(s, '#');
+    char byte[3] = {0};
+    char *end;
+    uint32_t n = 0;
+
+    memset(frame, 0, sizeof(*frame));
+    if (!hash || (hash - s != 3 && hash - s != 8)) {
+        return 1;
+    }
+    frame->ext = hash - s == 8;
+    frame->id = strtoul(s, &end, 16);
+    if (end != hash || frame->id > (frame->ext ? 0x1fffffffu : 0x7ffu)) {
+        return 1;
+    }
+    s = hash + 1;
+    if (*s == 'R' || *s == 'r') {
+        frame->rtr = 1;
+        if (isdigit((unsigned char) s[1])) {
+            frame->dlc = s[1] - '0';
+        }
+        return frame->dlc > 8;
+    }
+    while (*s) {
+        if (*s == '.') {
+            s++;
+            continue;
+        }
+        if (n == 8 || !isxdigit((unsigned char) s[0])
+                || !isxdigit((unsigned char) s[1])) {
+            return 1;
+        }
+        byte[0] = s[0];
+        byte[1] = s[1];
+        frame->data[n++] = strtoul(byte, NULL, 16);
+        s += 2;
+    }
+    frame->dlc = n;
+    return 0;
+}
+
+/* Add a little endian counter to the payload, or to the identifier of a
+ * frame without data. */
+static void add_counter(Sim_FrameTypeDef *frame, uint32_t counter) {
+    uint32_t carry = counter;
+    uint8_t i;
+    if (frame->rtr || !frame->dlc) {
+        frame->id = (frame->id + counter) & (frame->ext ? 0x1fffffffu : 0x7ffu);
+        return;
+    }
+    for (i = 0; i < frame->dlc && !frame->rtr && carry; i++) {
+        carry += frame->data[i];
+        frame->data[i] = carry;
+        carry >>= 8;
+    }
+}
+
+static void script_error(const char *path, uint32_t line, const char *what) {
+    fprintf(stderr, "%s:%u: %s\n", path, line, what);
+    exit(2);
+}
+
+static void script_load(const char *path) {
+    char buf[SCRIPT_LINE];
+    char *argv[8];
+    uint32_t argc;
+    uint32_t line = 0;
+    uint64_t last = 0;
+    Action_TypeDef *action;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        perror(path);
+        exit(2);
+    }
+    while (fgets(buf, sizeof(buf), f)) {
+        line++;
+        for (argc = 0; argc < 8; argc++) {
+            argv[argc] = strtok(argc ? NULL : buf, " \t\r\n");
+            if (!argv[argc]) {
+                break;
+            }
+        }
+        if (!argc || argv[0][0] == '#') {
+            continue;
+        }
+        if (argc < 2) {
+            script_error(path, line, "time and event expected");
+        }
+        actions = realloc(actions, (actions_len + 1) * sizeof(*actions));
+        if (!actions) {
+            abort();
+        }
+        action = &actions[actions_len++];
+        memset(action, 0, sizeof(*action));
+        action->at = strtoull(argv[0], NULL, 10) * SIM_US;
+        action->count = 1;
+        if (action->at > last) {
+            last = action->at;
+        }
+        if (!strcmp(argv[1], "open")) {
+            uint32_t i;
+            action->type = ACTION_OPEN;
+            if (argc < 3 || !(action->value = strtoul(argv[2], NULL, 10))) {
+                script_error(path, line, "open needs a bitrate");
+            }
+            for (i = 3; i < argc; i++) {
+                if (!strcmp(argv[i], "silent")) {
+                    action->ctrlmode |= USB_8DEV_CAN_MODE_SILENT;
+                } else if (!strcmp(argv[i], "loopback")) {
+                    action->ctrlmode |= USB_8DEV_CAN_MODE_LOOPBACK;
+                } else if (!strcmp(argv[i], "oneshot")) {
+                    action->ctrlmode |= USB_8DEV_MODE_ONESHOT;
+                } else if (!strcmp(argv[i], "berr")) {
+                    action->ctrlmode |= USB_8DEV_MODE_BERR_REPORTING;
+                } else {
+                    script_error(path, line, "unknown mode");
+                }
+            }
+        } else if (!strcmp(argv[1], "close")) {
+            action->type = ACTION_CLOSE;
+        } else if (!strcmp(argv[1], "rx") || !strcmp(argv[1], "send")) {
+            action->type = argv[1][0] == 'r' ? ACTION_RX : ACTION_SEND;
+            if (argc < 3 || parse_frame(argv[2], &action->frame)) {
+                script_error(path, line, "frame expected, <id>#<data>");
+            }
+            if (argc >= 5) {
+                action->count = strtoul(argv[3], NULL, 10);
+                action->interval = strtoull(argv[4], NULL, 10) * SIM_US;
+                if (action->count && action->at + (action->count - 1)
+                        * action->interval > last) {
+                    last = action->at + (action->count - 1) * action->interval;
+                }
+            }
+        } else if (!strcmp(argv[1], "error")) {
+            action->type = ACTION_ERROR;
+            action->frame.id = ERROR_FRAME_ID;
+            action->frame.dlc = 8;
+            if (argc < 3) {
+                script_error(path, line, "error needs a type");
+            } else if (!strcmp(argv[2], "stuff")) {
+                action->frame.lec = LEC_STUFF;
+            } else if (!strcmp(argv[2], "form")) {
+                action->frame.lec = LEC_FORM;
+            } else if (!strcmp(argv[2], "crc")) {
+                action->frame.lec = LEC_CRC;
+            } else {
+                script_error(path, line, "unknown error, stuff, form or crc");
+            }
+            if (argc >= 5) {
+                action->count = strtoul(argv[3], NULL, 10);
+                action->interval = strtoull(argv[4], NULL, 10) * SIM_US;
+                if (action->count && action->at + (action->count - 1)
+                        * action->interval > last) {
+                    last = action->at + (action->count - 1) * action->interval;
+                }
+            }
+        } else if (!strcmp(argv[1], "expect")) {
+            action->type = ACTION_EXPECT;
+            if (argc < 4 || strcmp(argv[2], "state")) {
+                script_error(path, line, "expect state <state> expected");
+            }
+            for (action->value = 0; action->value < 3; action->value++) {
+                if (!strcmp(argv[3], state_names[action->value])) {
+                    break;
+                }
+            }
+            if (action->value == 3) {
+                script_error(path, line, "unknown state, active, warning or busoff");
+            }
+        } else if (!strcmp(argv[1], "status")) {
+            action->type = ACTION_STATUS;
+            if (argc >= 4) {
+                action->count = strtoul(argv[2], NULL, 10);
+                action->interval = strtoull(argv[3], NULL, 10) * SIM_US;
+                if (action->count && action->at + (action->count - 1)
+                        * action->interval > last) {
+                    last = action->at + (action->count - 1) * action->interval;
+                }
+            }
+        } else if (!strcmp(argv[1], "busy")) {
+            action->type = ACTION_BUSY;
+            if (argc < 3) {
+                script_error(path, line, "busy needs a duration");
+            }
+            action->value = strtoul(argv[2], NULL, 10);
+        } else if (!strcmp(argv[1], "end")) {
+            action->type = ACTION_END;
+            if (!sim_config.end_ns) {
+                sim_config.end_ns = action->at;
+            }
+        } else {
+            script_error(path, line, "unknown event");
+        }
+    }
+    fclose(f);
+    if (!sim_config.end_ns) {
+        sim_config.end_ns = last + DRAIN_NS;
+    }
+}
+
+/* Send an 8dev command, the bit timing of open is for the 8dev clock. */
+static void send_cmd(const Action_TypeDef *action) {
+    uint8_t cmd[16] = {0};
+    uint32_t tq;
+    uint32_t brp = 0;
+    uint32_t sp;
+
+    cmd[0] = CMD_START;
+    cmd[15] = CMD_END;
+    host.cmds++;
+    if (action->type == ACTION_CLOSE || action->type == ACTION_STATUS) {
+        cmd[2] = action->type == ACTION_CLOSE ? CMD_CLOSE : CMD_GET_STATUS;
+        pcd_host_send(PCD_CMD_OUT_EP, cmd, sizeof(cmd));
+        return;
+    }
+    cmd[2] = CMD_OPEN;
+    for (tq = 16; tq <= 25 && !brp; tq++) {
+        if (HOST_CLOCK % (action->value * tq) == 0) {
+            brp = HOST_CLOCK / (action->value * tq);
+            break;
+        }
+    }
+    for (tq = 15; tq >= 8 && !brp; tq--) {
+        if (HOST_CLOCK % (action->value * tq) == 0) {
+            brp = HOST_CLOCK / (action->value * tq);
+            break;
+        }
+    }
+    if (!brp || brp > 1024) {
+        fprintf(stderr, "no bit timing for %u bit/s\n", action->value);
+        exit(2);
+    }
+    // Sample point at 87.5%
+    sp = (tq * 7 + 4) / 8;
+    cmd[5] = sp - 1;
+    cmd[6] = tq - sp;
+    cmd[7] = 1;
+    cmd[8] = brp >> 8;
+    cmd[9] = brp;
+    cmd[13] = action->ctrlmode;
+    can_model_set_bitrate(action->value);
+    pcd_host_send(PCD_CMD_OUT_EP, cmd, sizeof(cmd));
+}
+
+static void send_frame(const Sim_FrameTypeDef *frame) {
+    uint8_t msg[16] = {0};
+    msg[0] = DATA_START;
+    msg[1] = (frame->ext ? DATA_FLAG_EXTID : 0) | (frame->rtr ? DATA_FLAG_RTR : 0);
+    msg[2] = frame->id >> 24;
+    msg[3] = frame->id >> 16;
+    msg[4] = frame->id >> 8;
+    msg[5] = frame->id;
+    msg[6] = frame->dlc;
+    memcpy(&msg[7], frame->data, sizeof(frame->data));
+    msg[15] = DATA_END;
+    pcd_host_send(PCD_DATA_OUT_EP, msg, sizeof(msg));
+    host.sent++;
+}
+
+static uint64_t script_next(void) {
+    uint64_t next = SIM_NEVER;
+    uint32_t i;
+    for (i = 0; i < actions_len; i++) {
+        if (actions[i].count && actions[i].at < next) {
+            next = actions[i].at;
+        }
+    }
+    return next;
+}
+
+static void script_run(void) {
+    Sim_FrameTypeDef frame;
+    Action_TypeDef *action;
+    uint32_t i;
+
+    for (i = 0; i < actions_len; i++) {
+        action = &actions[i];
+        if (!action->count || action->at > sim_now) {
+            continue;
+        }
+        switch (action->type) {
+            case ACTION_OPEN:
+                host.state = STATE_ACTIVE;
+                send_cmd(action);
+                break;
+            case ACTION_CLOSE:
+            case ACTION_STATUS:
+                send_cmd(action);
+                break;
+            case ACTION_RX:
+            case ACTION_SEND:
+                frame = action->frame;
+                add_counter(&frame, action->index);
+                if (action->type == ACTION_RX) {
+                    can_model_inject(&frame);
+                } else {
+                    send_frame(&frame);
+                }
+                break;
+            case ACTION_BUSY:
+                pcd_host_busy(action->value * SIM_US);
+                break;
+            case ACTION_ERROR:
+                can_model_inject(&action->frame);
+                break;
+            case ACTION_EXPECT:
+                if (host.state != action->value) {
+                    host.expect_failed++;
+                    fprintf(stderr, "%12.3f expected state %s, driver is %s\n",
+                            sim_now / 1e6, state_names[action->value],
+                            state_names[host.state]);
+                }
+                break;
+            case ACTION_END:
+                break;
+        }
+        action->index++;
+        action->count--;
+        action->at += action->interval;
+    }
+}
+
+/******************************************************************************
+ * Time
+ *****************************************************************************/
+
+static uint64_t next_event(void) {
+    uint64_t next = script_next();
+    uint64_t t = can_model_next();
+    if (t < next) next = t;
+    t = pcd_next();
+    if (t < next) next = t;
+    return next;
+}
+
+/* Move the clock, TIM2 counts µs like the timebase sets it up. */
+static void move_to(uint64_t t) {
+    if (t >= sim_config.end_ns) {
+        t = sim_config.end_ns;
+    }
+    if (sim_tim2.CR1 & TIM_CR1_CEN) {
+        tim_ns += t - sim_now;
+        sim_tim2.CNT += tim_ns / SIM_US;
+        tim_ns %= SIM_US;
+    }
+    sim_now = t;
+    if (t == sim_config.end_ns) {
+        sim_report();
+        exit(host.expect_failed || (strict && sim_missing()) ? 1 : 0);
+    }
+}
+
+/**
+ * Let time pass, running the events that are due in order.
+ *
+ * @param[in] ns time in ns
+ */
+void sim_advance(uint64_t ns) {
+    uint64_t target = sim_now + ns;
+    uint64_t next;
+
+    while ((next = next_event()) <= target) {
+        move_to(next > sim_now ? next : sim_now);
+        script_run();
+        can_model_run();
+        pcd_run();
+    }
+    move_to(target);
+    can_model_sync();
+}
+
+/**
+ * Sleep until the next event, the end of the simulation if there is none.
+ */
+void sim_wait(void) {
+    uint64_t next = next_event();
+    if (next == SIM_NEVER) {
+        next = sim_config.end_ns;
+    }
+    sim_advance(next > sim_now ? next - sim_now : 0);
+}
+
+/******************************************************************************
+ * Host
+ *****************************************************************************/
+
+static uint8_t frame_equal(const Sim_FrameTypeDef *a, const Sim_FrameTypeDef *b) {
+    return a->id == b->id && a->ext == b->ext && a->rtr == b->rtr
+        && a->dlc == b->dlc && (a->rtr
+                || !memcmp(a->data, b->data, a->dlc > 8 ? 8 : a->dlc));
+}
+
+static void print_frame(const char *what, const Sim_FrameTypeDef *frame) {
+    uint8_t i;
+    fprintf(stderr, "%12.3f %-6s %0*X#", sim_now / 1e6, what,
+            frame->ext ? 8 : 3, frame->id);
+    if (frame->rtr) {
+        fprintf(stderr, "R");
+    }
+    for (i = 0; i < frame->dlc && i < 8 && !frame->rtr; i++) {
+        fprintf(stderr, "%02X", frame->data[i]);
+    }
+    fprintf(stderr, "\n");
+}
+
+/**
+ * The host received a frame, find it in the FIFO log.
+ *
+ * @param[in] frame frame received
+ * @param[in] timestamp timestamp of the device in µs
+ */
+void sim_host_frame(const Sim_FrameTypeDef *frame, uint32_t timestamp) {
+    uint32_t i;
+
+    (void) timestamp;
+    host.frames++;
+    if (sim_config.verbose) {
+        print_frame("host", frame);
+    }
+    for (i = log_cursor; i < can_model_log_len; i++) {
+        if (!can_model_log[i].matched && frame_equal(frame, &can_model_log[i].frame)) {
+            break;
+        }
+    }
+    if (i == can_model_log_len) {
+        host.unmatched++;
+        return;
+    }
+    can_model_log[i].matched = 1;
+    log_cursor = i + 1;
+    if (host.frames - host.unmatched == 1) {
+        host.first = sim_now;
+    }
+    host.last = sim_now;
+    if (host.frames - host.unmatched > host.latency_size) {
+        host.latency_size = host.latency_size ? 2 * host.latency_size : 1024;
+        host.latency = realloc(host.latency,
+                host.latency_size * sizeof(*host.latency));
+        if (!host.latency) {
+            abort();
+        }
+    }
+    host.latency[host.frames - host.unmatched - 1] = sim_now - can_model_log[i].end;
+}
+
+/**
+ * The host received a command reply.
+ *
+ * @param[in] rsp reply, 16 bytes
+ */
+void sim_host_cmd(const uint8_t *rsp) {
+    // The status reply is 3 records, page number in opt2
+    if (rsp[2] == CMD_GET_STATUS && rsp[4] == 2) {
+        host.status = 1;
+        host.data_drops = (uint32_t) rsp[5] << 24 | rsp[6] << 16 | rsp[7] << 8
+            | rsp[8];
+        host.err_drops = rsp[14];
+    }
+    if (rsp[2] == CMD_GET_STATUS && rsp[4] != 0) {
+        return;
+    }
+    host.cmd_replies++;
+    if (rsp[3]) {
+        host.cmd_errors++;
+    }
+    if (sim_config.verbose) {
+        fprintf(stderr, "%12.3f cmd    %u %s\n", sim_now / 1e6, rsp[2],
+                rsp[3] ? "error" : "ok");
+    }
+}
+
+/**
+ * The host received an error record.
+ *
+ * @param[in] code 8dev error code
+ * @param[in] count number of errors it stands for, 0 counts as 1
+ */
+void sim_host_error(uint8_t code, uint8_t count) {
+    host.error_records++;
+    host.error_repeats += count ? count : 1;
+    // As usb_8dev_rx_err_msg(), warning and passive don't change the state
+    if (code == ERR_OK) {
+        host.state = STATE_ACTIVE;
+    } else if (code == ERR_BOF) {
+        host.state = STATE_BUSOFF;
+    } else if (code != ERR_FOV && code != ERR_EWG && code != ERR_EPV) {
+        host.state = STATE_WARNING;
+    }
+    if (sim_config.verbose) {
+        fprintf(stderr, "%12.3f error  0x%02x x%u\n", sim_now / 1e6, code,
+                count ? count : 1);
+    }
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Frames per second from the first to the last of n frames. */
+static double frame_rate(uint32_t n, uint64_t first, uint64_t last) {
+    return n > 1 && last > first ? (n - 1) * 1e9 / (last - first) : 0.0;
+}
+
+/* Latency in µs at percentile p of the sorted latencies. */
+static double latency_us(uint32_t matched, uint32_t p) {
+    return host.latency[(uint64_t) (matched - 1) * p / 100] / 1e3;
+}
+
+static void report_text(uint32_t matched, uint32_t lost, double avg) {
+    printf("simulated time      %12.3f ms\n", sim_now / 1e6);
+    printf("bus load            %12.1f %%\n", sim_now
+            ? 100.0 * can_model_stats.busy_ns / sim_now : 0.0);
+    printf("frames on bus       %12u\n", can_model_stats.bus_frames);
+    printf("  not listening     %12u\n", can_model_stats.missed);
+    printf("  into FIFO         %12u\n", can_model_stats.fifo_frames);
+    printf("  FIFO overrun      %12u\n", can_model_stats.fifo_lost);
+    printf("  to host           %12u\n", matched);
+    printf("  lost in firmware  %12u\n", lost);
+    printf("  not from bus      %12u\n", host.unmatched);
+    printf("  to host frames/s  %12.0f\n",
+            frame_rate(matched, host.first, host.last));
+    if (matched) {
+        printf("latency µs          min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f\n",
+                latency_us(matched, 0), avg, latency_us(matched, 50),
+                latency_us(matched, 99), latency_us(matched, 100));
+    }
+    printf("frames from host    %12u\n", host.sent);
+    printf("  sent on bus       %12u\n", can_model_stats.tx_frames);
+    printf("  still queued      %12u\n", pcd_host_queued(PCD_DATA_OUT_EP));
+    printf("  sent frames/s     %12.0f\n", frame_rate(can_model_stats.tx_frames,
+                can_model_stats.tx_first, can_model_stats.tx_last));
+    printf("errors on bus       %12u\n", can_model_stats.errors);
+    printf("  records to host   %12u\n", host.error_records);
+    printf("  errors reported   %12u\n", host.error_repeats);
+    printf("  driver state      %12s\n", state_names[host.state]);
+    printf("commands            %12u\n", host.cmds);
+    printf("  unanswered        %12u\n", host.cmds - host.cmd_replies);
+    printf("  failed            %12u\n", host.cmd_errors);
+    printf("expectations failed %12u\n", host.expect_failed);
+    printf("firmware rx_frames %u tx_frames %u rx_overruns %u"
+            " rx_latency_max %u µs txq_max %u\n", can_stats.rx_frames,
+            can_stats.tx_frames, can_stats.rx_overruns,
+            can_stats.rx_latency_max, can_stats.txq_max);
+    if (host.status) {
+        printf("firmware records_dropped %u errors_dropped %u\n",
+                host.data_drops, host.err_drops);
+    }
+}
+
+static void report_json(uint32_t matched, uint32_t lost, double avg) {
+    char name[SCRIPT_LINE];
+    char *dot;
+
+    // Name of the scenario is the script file name without extension
+    snprintf(name, sizeof(name), "%s", script_path);
+    snprintf(name, sizeof(name), "%s", basename(name));
+    if ((dot = strrchr(name, '.'))) {
+        *dot = 0;
+    }
+    printf("{\"scenario\": \"%s\", \"sim_ms\": %.3f, \"bus_load_pct\": %.1f,\n",
+            name, sim_now / 1e6,
+            sim_now ? 100.0 * can_model_stats.busy_ns / sim_now : 0.0);
+    printf(" \"rx\": {\"bus_frames\": %u, \"missed\": %u, \"fifo_frames\": %u,"
+            " \"fifo_overrun\": %u, \"to_host\": %u, \"lost_in_firmware\": %u,"
+            " \"unmatched\": %u, \"bus_fps\": %.0f, \"host_fps\": %.0f,\n",
+            can_model_stats.bus_frames, can_model_stats.missed,
+            can_model_stats.fifo_frames, can_model_stats.fifo_lost, matched,
+            lost, host.unmatched, frame_rate(can_model_stats.fifo_frames,
+                can_model_log_len ? can_model_log[0].end : 0,
+                can_model_log_len ? can_model_log[can_model_log_len - 1].end : 0),
+            frame_rate(matched, host.first, host.last));
+    if (matched) {
+        printf("  \"latency_us\": {\"min\": %.1f, \"avg\": %.1f, \"p50\": %.1f,"
+                " \"p99\": %.1f, \"max\": %.1f}},\n", latency_us(matched, 0),
+                avg, latency_us(matched, 50), latency_us(matched, 99),
+                latency_us(matched, 100));
+    } else {
+        printf("  \"latency_us\": null},\n");
+    }
+    printf(" \"tx\": {\"from_host\": %u, \"on_bus\": %u, \"queued\": %u,"
+            " \"fps\": %.0f},\n", host.sent, can_model_stats.tx_frames,
+            pcd_host_queued(PCD_DATA_OUT_EP),
+            frame_rate(can_model_stats.tx_frames, can_model_stats.tx_first,
+                can_model_stats.tx_last));
+    printf(" \"errors\": {\"on_bus\": %u, \"records\": %u, \"reported\": %u,"
+            " \"driver_state\": \"%s\"}, \"commands_failed\": %u,"
+            " \"commands_unanswered\": %u, \"expect_failed\": %u,\n",
+            can_model_stats.errors, host.error_records, host.error_repeats,
+            state_names[host.state], host.cmd_errors,
+            host.cmds - host.cmd_replies, host.expect_failed);
+    printf(" \"firmware\": {\"rx_frames\": %u, \"tx_frames\": %u,"
+            " \"rx_overruns\": %u, \"rx_latency_max_us\": %u, \"txq_max\": %u,",
+            can_stats.rx_frames, can_stats.tx_frames, can_stats.rx_overruns,
+            can_stats.rx_latency_max, can_stats.txq_max);
+    if (host.status) {
+        printf(" \"records_dropped\": %u, \"errors_dropped\": %u}}\n",
+                host.data_drops, host.err_drops);
+    } else {
+        printf(" \"records_dropped\": null, \"errors_dropped\": null}}\n");
+    }
+}
+
+/* Frames received into the FIFO the host never saw. */
+static uint32_t lost_in_firmware(void) {
+    return can_model_stats.fifo_frames - can_model_stats.fifo_lost
+        - (host.frames - host.unmatched);
+}
+
+/**
+ * Check that nothing the firmware should have passed on went missing, the
+ * reasons are printed.
+ *
+ * @return number of kinds of things missing
+ */
+uint32_t sim_missing(void) {
+    uint32_t missing = 0;
+    if (lost_in_firmware()) {
+        fprintf(stderr, "%u frame(s) lost in the firmware\n", lost_in_firmware());
+        missing++;
+    }
+    if (host.unmatched) {
+        fprintf(stderr, "%u frame(s) not from the bus\n", host.unmatched);
+        missing++;
+    }
+    if (host.cmds != host.cmd_replies) {
+        fprintf(stderr, "%u command(s) without reply\n",
+                host.cmds - host.cmd_replies);
+        missing++;
+    }
+    if (host.data_drops || host.err_drops) {
+        fprintf(stderr, "%u record(s) and %u error(s) dropped by the firmware\n",
+                host.data_drops, host.err_drops);
+        missing++;
+    }
+    return missing;
+}
+
+/**
+ * Print what happened.
+ */
+void sim_report(void) {
+    uint32_t matched = host.frames - host.unmatched;
+    uint32_t lost = lost_in_firmware();
+    uint64_t sum = 0;
+    uint32_t i;
+
+    if (matched) {
+        qsort(host.latency, matched, sizeof(*host.latency), compare_u64);
+        for (i = 0; i < matched; i++) {
+            sum += host.latency[i];
+        }
+    }
+    if (json) {
+        report_json(matched, lost, matched ? sum / 1e3 / matched : 0.0);
+    } else {
+        report_text(matched, lost, matched ? sum / 1e3 / matched : 0.0);
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-v] [-j] [-s] [-c op_ns] [-i irq_ns] [-I in_us]"
+            " [-O out_us] [-t end_ms] script\n", name);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    uint64_t end = 0;
+
+    while ((opt = getopt(argc, argv, "vjsc:i:I:O:t:")) != -1) {
+        switch (opt) {
+            case 'v': sim_config.verbose = 1; break;
+            case 'j': json = 1; break;
+            case 's': strict = 1; break;
+            case 'c': sim_config.op_ns = strtoull(optarg, NULL, 10); break;
+            case 'i': sim_config.irq_ns = strtoull(optarg, NULL, 10); break;
+            case 'I': sim_config.in_ns = strtoull(optarg, NULL, 10) * SIM_US; break;
+            case 'O': sim_config.out_ns = strtoull(optarg, NULL, 10) * SIM_US; break;
+            case 't': end = strtoull(optarg, NULL, 10) * SIM_MS; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    sim_config.end_ns = end;
+    script_path = argv[optind];
+    script_load(script_path);
+    can_model_reset();
+    return firmware_main();
+}
@@ -0,0 +1,98 @@
+#ifndef _SIM_H_
+#define _SIM_H_
+
+/* Simulator of the host build, @see sim.c.
+ *
+ * Time is virtual, in ns. It only moves when the firmware calls into the
+ * simulator: register writes, critical sections and HAL_GetTick() cost
+ * sim_config.op_ns each, taking an interrupt costs sim_config.irq_ns and
+ * __WFI() skips ahead to the next event. Every part that has something to do
+ * at a later time (the bus, USB, the script) tells when with its next
+ * function, sim_advance() runs them in time order. */
+#include <stdint.h>
+
+#define SIM_NEVER           UINT64_MAX
+#define SIM_US              1000ull
+#define SIM_MS              1000000ull
+
+typedef struct {
+    uint64_t op_ns;         /*< Cost of a register write or critical section */
+    uint64_t irq_ns;        /*< Cost of interrupt entry and exit */
+    uint64_t in_ns;         /*< Time until the host reads an IN packet */
+    uint64_t out_ns;        /*< Time until an OUT packet reaches the device */
+    uint64_t end_ns;        /*< Time the simulation stops */
+    uint8_t verbose;        /*< Print every frame and packet */
+} Sim_ConfigTypeDef;
+
+typedef struct {
+    uint32_t id;            /*< 11 or 29 bit identifier */
+    uint8_t ext;            /*< Extended identifier */
+    uint8_t rtr;            /*< Remote frame */
+    uint8_t dlc;
+    uint8_t data[8];
+    uint8_t lec;            /*< Error that destroys the frame, 0 if none */
+} Sim_FrameTypeDef;
+
+extern Sim_ConfigTypeDef sim_config;
+extern uint64_t sim_now;
+
+/* sim.c */
+void sim_advance(uint64_t ns);
+void sim_wait(void);
+void sim_host_frame(const Sim_FrameTypeDef *frame, uint32_t timestamp);
+void sim_host_cmd(const uint8_t *rsp);
+void sim_host_error(uint8_t code, uint8_t count);
+void sim_report(void);
+uint32_t sim_missing(void);
+
+/* hal.c, the core and the peripherals without a model */
+void sim_point(void);
+
+/* can_model.c, bxCAN and the bus */
+typedef struct {
+    uint32_t bus_frames;        /*< Frames of other nodes on the bus */
+    uint32_t fifo_frames;       /*< Of those put in the receive FIFO */
+    uint32_t fifo_lost;         /*< Overwritten in a full FIFO */
+    uint32_t missed;            /*< Sent while the controller didn't listen */
+    uint32_t errors;            /*< Frames destroyed by an error */
+    uint32_t tx_frames;         /*< Frames sent from the transmit mailboxes */
+    uint64_t tx_first;          /*< End of the first frame sent */
+    uint64_t tx_last;           /*< End of the last frame sent */
+    uint64_t busy_ns;           /*< Time the bus carried a frame */
+} Can_ModelStatsTypeDef;
+
+typedef struct {
+    Sim_FrameTypeDef frame;
+    uint64_t end;               /*< End of frame on the bus */
+    uint8_t lost;               /*< Overwritten in the FIFO */
+    uint8_t matched;            /*< Seen by the host */
+} Can_LogTypeDef;
+
+extern Can_ModelStatsTypeDef can_model_stats;
+extern Can_LogTypeDef *can_model_log;
+extern uint32_t can_model_log_len;
+
+void can_model_reset(void);
+void can_model_write(volatile uint32_t *reg, uint32_t value);
+void can_model_sync(void);
+uint8_t can_model_irq_pending(void);
+void can_model_set_bitrate(uint32_t bitrate);
+void can_model_inject(const Sim_FrameTypeDef *frame);
+uint64_t can_model_next(void);
+void can_model_run(void);
+uint32_t can_model_frame_bits(const Sim_FrameTypeDef *frame);
+
+/* pcd.c, the USB peripheral and the host */
+#define PCD_DATA_IN_EP      0x81
+#define PCD_DATA_OUT_EP     0x02
+#define PCD_CMD_IN_EP       0x83
+#define PCD_CMD_OUT_EP      0x04
+
+uint8_t pcd_irq_pending(void);
+void pcd_host_send(uint8_t ep_addr, const uint8_t *data, uint16_t len);
+void pcd_host_busy(uint64_t duration);
+uint32_t pcd_host_queued(uint8_t ep_addr);
+uint64_t pcd_next(void);
+void pcd_run(void);
+
+#endif
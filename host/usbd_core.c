@@ -0,0 +1,230 @@
+/**
+ * USB device core of the host build.
+ *
+ * Stands in for the core of the STM32Cube USB device library, which isn't
+ * part of the repository. Only what the simulated host does is handled:
+ * reset, SET_CONFIGURATION, class and vendor requests, and the class
+ * endpoints. Descriptors are never requested.
+ */
+#include "usbd_core.h"
+
+USBD_StatusTypeDef USBD_Init(USBD_HandleTypeDef *pdev,
+        USBD_DescriptorsTypeDef *pdesc, uint8_t id) {
+    pdev->pClass = NULL;
+    pdev->pDesc = pdesc;
+    pdev->dev_state = USBD_STATE_DEFAULT;
+    pdev->id = id;
+    USBD_LL_Init(pdev);
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_DeInit(USBD_HandleTypeDef *pdev) {
+    pdev->dev_state = USBD_STATE_DEFAULT;
+    if (pdev->pClass) {
+        pdev->pClass->DeInit(pdev, pdev->dev_config);
+    }
+    USBD_LL_Stop(pdev);
+    USBD_LL_DeInit(pdev);
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_Start(USBD_HandleTypeDef *pdev) {
+    return USBD_LL_Start(pdev);
+}
+
+USBD_StatusTypeDef USBD_Stop(USBD_HandleTypeDef *pdev) {
+    if (pdev->pClass) {
+        pdev->pClass->DeInit(pdev, pdev->dev_config);
+    }
+    return USBD_LL_Stop(pdev);
+}
+
+USBD_StatusTypeDef USBD_RegisterClass(USBD_HandleTypeDef *pdev,
+        USBD_ClassTypeDef *pclass) {
+    if (!pclass) {
+        return USBD_FAIL;
+    }
+    pdev->pClass = pclass;
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_SetupStage(USBD_HandleTypeDef *pdev,
+        uint8_t *psetup) {
+    USBD_SetupReqTypedef *req = &pdev->request;
+
+    req->bmRequest = psetup[0];
+    req->bRequest = psetup[1];
+    req->wValue = SWAPBYTE(psetup + 2);
+    req->wIndex = SWAPBYTE(psetup + 4);
+    req->wLength = SWAPBYTE(psetup + 6);
+    pdev->ep0_state = USBD_EP0_SETUP;
+
+    if ((req->bmRequest & USB_REQ_TYPE_MASK) != USB_REQ_TYPE_STANDARD) {
+        if (pdev->dev_state == USBD_STATE_CONFIGURED) {
+            pdev->pClass->Setup(pdev, req);
+        } else {
+            USBD_CtlError(pdev, req);
+        }
+    } else if (req->bRequest == USB_REQ_SET_CONFIGURATION
+            && (req->bmRequest & USB_REQ_RECIPIENT_MASK)
+            == USB_REQ_RECIPIENT_DEVICE) {
+        if (req->wValue && pdev->dev_state != USBD_STATE_CONFIGURED) {
+            pdev->dev_config = req->wValue;
+            pdev->dev_state = USBD_STATE_CONFIGURED;
+            pdev->pClass->Init(pdev, req->wValue);
+        }
+        USBD_CtlSendStatus(pdev);
+    } else {
+        USBD_CtlError(pdev, req);
+    }
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_DataOutStage(USBD_HandleTypeDef *pdev,
+        uint8_t epnum, uint8_t *pdata) {
+    (void) pdata;
+    if (pdev->dev_state != USBD_STATE_CONFIGURED) {
+        return USBD_OK;
+    }
+    if (epnum == 0) {
+        pdev->ep0_state = USBD_EP0_IDLE;
+        if (pdev->pClass->EP0_RxReady) {
+            pdev->pClass->EP0_RxReady(pdev);
+        }
+    } else if (pdev->pClass->DataOut) {
+        pdev->pClass->DataOut(pdev, epnum);
+    }
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_DataInStage(USBD_HandleTypeDef *pdev,
+        uint8_t epnum, uint8_t *pdata) {
+    (void) pdata;
+    if (pdev->dev_state != USBD_STATE_CONFIGURED) {
+        return USBD_OK;
+    }
+    if (epnum == 0) {
+        if (pdev->ep0_state == USBD_EP0_DATA_IN && pdev->pClass->EP0_TxSent) {
+            pdev->pClass->EP0_TxSent(pdev);
+        }
+        pdev->ep0_state = USBD_EP0_IDLE;
+    } else if (pdev->pClass->DataIn) {
+        pdev->pClass->DataIn(pdev, epnum);
+    }
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_Reset(USBD_HandleTypeDef *pdev) {
+    USBD_LL_OpenEP(pdev, 0x00, USBD_EP_TYPE_CTRL, USB_MAX_EP0_SIZE);
+    USBD_LL_OpenEP(pdev, 0x80, USBD_EP_TYPE_CTRL, USB_MAX_EP0_SIZE);
+    if (pdev->dev_state == USBD_STATE_CONFIGURED && pdev->pClass) {
+        pdev->pClass->DeInit(pdev, pdev->dev_config);
+    }
+    pdev->dev_state = USBD_STATE_DEFAULT;
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_SetSpeed(USBD_HandleTypeDef *pdev,
+        USBD_SpeedTypeDef speed) {
+    pdev->dev_speed = speed;
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_Suspend(USBD_HandleTypeDef *pdev) {
+    pdev->dev_old_state = pdev->dev_state;
+    pdev->dev_state = USBD_STATE_SUSPENDED;
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_Resume(USBD_HandleTypeDef *pdev) {
+    pdev->dev_state = pdev->dev_old_state;
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_SOF(USBD_HandleTypeDef *pdev) {
+    if (pdev->dev_state == USBD_STATE_CONFIGURED && pdev->pClass->SOF) {
+        pdev->pClass->SOF(pdev);
+    }
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_IsoINIncomplete(USBD_HandleTypeDef *pdev,
+        uint8_t epnum) {
+    (void) pdev;
+    (void) epnum;
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_IsoOUTIncomplete(USBD_HandleTypeDef *pdev,
+        uint8_t epnum) {
+    (void) pdev;
+    (void) epnum;
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_DevConnected(USBD_HandleTypeDef *pdev) {
+    (void) pdev;
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_LL_DevDisconnected(USBD_HandleTypeDef *pdev) {
+    pdev->dev_state = USBD_STATE_DEFAULT;
+    return USBD_OK;
+}
+
+USBD_StatusTypeDef USBD_CtlSendData(USBD_HandleTypeDef *pdev, uint8_t *buf,
+        uint16_t len) {
+    pdev->ep0_state = USBD_EP0_DATA_IN;
+    return USBD_LL_Transmit(pdev, 0x00, buf, len);
+}
+
+USBD_StatusTypeDef USBD_CtlContinueSendData(USBD_HandleTypeDef *pdev,
+        uint8_t *buf, uint16_t len) {
+    return USBD_LL_Transmit(pdev, 0x00, buf, len);
+}
+
+USBD_StatusTypeDef USBD_CtlPrepareRx(USBD_HandleTypeDef *pdev, uint8_t *buf,
+        uint16_t len) {
+    pdev->ep0_state = USBD_EP0_DATA_OUT;
+    return USBD_LL_PrepareReceive(pdev, 0, buf, len);
+}
+
+USBD_StatusTypeDef USBD_CtlContinueRx(USBD_HandleTypeDef *pdev, uint8_t *buf,
+        uint16_t len) {
+    return USBD_LL_PrepareReceive(pdev, 0, buf, len);
+}
+
+USBD_StatusTypeDef USBD_CtlSendStatus(USBD_HandleTypeDef *pdev) {
+    pdev->ep0_state = USBD_EP0_STATUS_IN;
+    return USBD_LL_Transmit(pdev, 0x00, NULL, 0);
+}
+
+USBD_StatusTypeDef USBD_CtlReceiveStatus(USBD_HandleTypeDef *pdev) {
+    pdev->ep0_state = USBD_EP0_STATUS_OUT;
+    return USBD_LL_PrepareReceive(pdev, 0, NULL, 0);
+}
+
+void USBD_CtlError(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req) {
+    (void) req;
+    USBD_LL_StallEP(pdev, 0x80);
+    USBD_LL_StallEP(pdev, 0x00);
+}
+
+void USBD_GetString(uint8_t *desc, uint8_t *unicode, uint16_t *len) {
+    uint8_t idx = 0;
+    uint8_t n = 0;
+
+    if (!desc) {
+        return;
+    }
+    while (desc[n]) {
+        n++;
+    }
+    *len = 2 * n + 2;
+    unicode[idx++] = *len;
+    unicode[idx++] = USB_DESC_TYPE_STRING;
+    while (*desc) {
+        unicode[idx++] = *desc++;
+        unicode[idx++] = 0;
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef _BITTIMING_H_
+#define _BITTIMING_H_
+
+#include <stdint.h>
+#include "can.h"
+
+// Clock the usb_8dev driver computes bit timings for
+#define BITTIMING_HOST_CLOCK    32000000
+// Clock of the CAN controller, PCLK
+#define BITTIMING_CAN_CLOCK     48000000
+
+// bxCAN bit timing limits (in tq, brp in PCLK cycles)
+#define BITTIMING_TS1_MAX       16
+#define BITTIMING_TS2_MAX       8
+#define BITTIMING_SJW_MAX       4
+#define BITTIMING_BRP_MAX       1024
+#define BITTIMING_TQ_MIN        8
+#define BITTIMING_TQ_MAX        (1 + BITTIMING_TS1_MAX + BITTIMING_TS2_MAX)
+
+// Largest difference (in ppm) between a requested bitrate without an exact
+// solution and the standard bitrate used instead
+#define BITTIMING_TOLERANCE     5000
+
+uint8_t bittiming_from_host(uint8_t ts1, uint8_t ts2, uint8_t sjw,
+        uint16_t brp, Can_BitTimingTypeDef *bt);
+uint8_t bittiming_split(uint32_t cycles, uint16_t sample_point,
+        Can_BitTimingTypeDef *bt);
+uint8_t bittiming_to_host(uint32_t cycles, uint16_t sample_point,
+        Can_BitTimingTypeDef *bt);
+uint32_t bittiming_standard(uint8_t index);
+
+#endif
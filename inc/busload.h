@@ -0,0 +1,36 @@
+#ifndef _BUSLOAD_H_
+#define _BUSLOAD_H_
+
+#include <stdint.h>
+
+// Frame types, @see busload.c. Remote frames are counted as RTR whatever their
+// identifier.
+#define BUSLOAD_STD             0   /* Standard data frame */
+#define BUSLOAD_EXT             1   /* Extended data frame */
+#define BUSLOAD_RTR             2   /* Remote frame */
+#define BUSLOAD_ERR             3   /* Error frame */
+#define BUSLOAD_TYPES           4
+
+// Bits of an error frame: error flag, delimiter and intermission. Flags of
+// other nodes that overlap it make it up to 6 bits longer.
+#define BUSLOAD_ERROR_BITS      (6 + 8 + 3)
+// Longest window (in ms)
+#define BUSLOAD_WINDOW_MAX      2550
+
+/* Bus load measurement, @see busload_read(). */
+typedef struct busload_stats {
+    uint16_t load;      /* Bus load of the last complete window (in ‰) */
+    uint16_t peak;      /* Highest load since the last reset (in ‰) */
+    uint16_t window;    /* Window (in ms), 0 if not measuring */
+    uint32_t bitrate;   /* Bitrate (in bit/s) the load is relative to */
+    uint32_t frames[BUSLOAD_TYPES]; /* Frames seen by type, free running */
+} Busload_StatsTypeDef;
+
+void busload_start(uint16_t window);
+void busload_bitrate(uint32_t bitrate);
+void busload_frame(uint32_t ir, uint32_t dtr, uint32_t dlr, uint32_t dhr,
+        uint32_t now);
+void busload_error(uint32_t now);
+void busload_read(Busload_StatsTypeDef *stats, uint8_t reset);
+
+#endif
@@ -2,6 +2,7 @@
 #define _CAN_H_
 
 #include <stdint.h>
+#include "config.h"
 #include "stm32f0xx_hal.h"
 
 // Definition for CANx clock resources
@@ -24,6 +25,55 @@
 #define CANx_IRQn                       CEC_CAN_IRQn
 #define CANx_IRQHandler                 CEC_CAN_IRQHandler
 
+// Longest time (in ms) the controller may take to enter or leave
+// initialization mode
+#define CAN_MODE_TIMEOUT                10
+// Returned by can_open() and can_close() while they are in progress
+#define CAN_BUSY                        0xff
+
+// Protocol errors identical to the last reported one within this interval (in
+// µs) are counted and reported together, @see can_lec_error()
+#define CAN_LEC_COALESCE_INTERVAL       10000
+// More protocol errors than CAN_LEC_RATE_MAX within CAN_LEC_RATE_WINDOW (in
+// µs) mask the last error code interrupt for CAN_LEC_MASK_TIME (in µs)
+#define CAN_LEC_RATE_MAX                16
+#define CAN_LEC_RATE_WINDOW             10000
+#define CAN_LEC_MASK_TIME               100000
+
+// Bus-off recovery. CAN_BUSOFF_MANUAL waits for the host to close and open
+// again. CAN_BUSOFF_ABOM lets the controller rejoin by itself after 128 x 11
+// recessive bits. CAN_BUSOFF_BACKOFF does the same from software, the first
+// time right away and after CAN_BACKOFF_MIN doubling up to CAN_BACKOFF_MAX
+// (in ms) for every bus-off in a row.
+#define CAN_BUSOFF_MANUAL               0
+#define CAN_BUSOFF_ABOM                 1
+#define CAN_BUSOFF_BACKOFF              2
+#ifndef CAN_BUSOFF_RECOVERY
+#define CAN_BUSOFF_RECOVERY             CAN_BUSOFF_BACKOFF
+#endif
+#define CAN_BACKOFF_MIN                 10
+#define CAN_BACKOFF_MAX                 1000
+
+// Automatic bitrate detection, @see can_autobaud(). Time (in ms) spent at
+// every candidate, unless the host asks for another time.
+#define CAN_AUTOBAUD_DWELL              50
+// Frames received without errors that end the detection early
+#define CAN_AUTOBAUD_FRAMES             4
+
+// CAN control modes for can_open_req(), same as the 8dev open command
+//#define CAN_CTRLMODE_NORMAL             0x00
+#define USB_8DEV_CAN_MODE_SILENT        0x01
+#define USB_8DEV_CAN_MODE_LOOPBACK      0x02
+#define USB_8DEV_MODE_ONESHOT           0x04
+// Report protocol errors (last error code), only state changes otherwise
+#define USB_8DEV_MODE_BERR_REPORTING    0x10
+
+// Not supported
+//#define CAN_CTRLMODE_3_SAMPLES          0x04
+//#define CAN_CTRLMODE_FD                 0x20
+//#define CAN_CTRLMODE_PRESUME_ACK        0x40
+//#define CAN_CTRLMODE_FD_NON_ISO         0x80
+
 
 /* Note: if the synchronization jump width (sjw), bit segment 1 (bs1) or bit
  * segment 2 (bs2) received from device driver is equal to x, the value x-1 is
@@ -37,14 +87,53 @@ typedef struct can_bittiming {
     uint16_t brp;   /* Bit-rate prescaler */
 } Can_BitTimingTypeDef;
 
+/* Counters of the CAN core, free running. */
+typedef struct can_stats {
+    uint32_t rx_frames;     /* Frames received */
+    uint32_t tx_frames;     /* Frames sent successfully */
+    uint16_t rx_overruns;   /* Receive FIFO overruns, frames were lost */
+    uint16_t rx_latency_max;    /* Longest time (in µs) a received frame
+                                   waited for can_rx(), saturates */
+    uint8_t txq_max;        /* High-water mark of the TX queue */
+} Can_StatsTypeDef;
+
+/* Result of the automatic bitrate detection. */
+typedef struct can_autobaud {
+    uint32_t cycles;        /* Bit time in CAN clock cycles, 0 if none found */
+    uint16_t sample_point;  /* Sample point (in ‰) */
+    uint8_t frames;         /* Frames received at it, saturates */
+    uint8_t errors;         /* Protocol errors seen at it, saturates */
+} Can_AutobaudTypeDef;
+
 extern CAN_HandleTypeDef can_handle;
+extern Can_StatsTypeDef can_stats;
+extern Can_AutobaudTypeDef can_autobaud_result;
 
 uint8_t can_init();
 void can_open_req(Can_BitTimingTypeDef* can_bittiming, uint8_t ctrlmode);
 uint8_t can_open();
 uint8_t can_close();
+void can_autobaud_req(uint8_t dwell, uint8_t sample_points);
+uint8_t can_autobaud();
+uint8_t can_tx_enqueue(CanTxMsgTypeDef *msg, uint32_t tag);
+uint8_t can_tx_free();
 uint8_t can_tx();
-uint8_t can_rx();
+void can_tx_irq_handler();
+void can_rx_irq_handler();
+void can_err_irq_handler();
+uint8_t can_rx(uint32_t *timestamp);
 uint8_t can_msg_pending();
+uint8_t can_lec_error(uint32_t code, uint32_t now);
+uint16_t can_lec_flush(uint32_t code, uint32_t now, uint32_t *last,
+        uint32_t *when);
+uint8_t can_lec_poll();
+uint8_t can_busoff_poll();
+
+/* Called when frames left the TX queue, possibly from interrupt context. To be
+ * implemented by the user of the TX queue. */
+void can_tx_dequeue_callback();
+void can_tx_cplt_callback(uint32_t tag);
+/* Called from the main thread when the controller recovered from bus-off. */
+void can_busoff_recovered_callback();
 
 #endif
@@ -0,0 +1,60 @@
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+/* Sizes of all queues and tables that take RAM. Every queue is a ring indexed
+ * by free running uint8_t counters, so its size must be a power of 2 of at
+ * most 128. The checks below fail at compile time, whether the whole fits in
+ * RAM is checked by the linker, @see STM32F042x6xx_FLASH.ld. `make budget`
+ * shows what every part of the firmware takes. */
+
+// Number of frames the TX queue can hold
+#define CAN_TX_QUEUE_SIZE               8
+// Number of received frames waiting for the main loop
+#define CAN_RX_QUEUE_SIZE               16
+
+// Number of records that can wait to be sent on the data IN endpoint
+#define USB_8DEV_TX_QUEUE_SIZE          16
+// Number of commands the host can have outstanding
+#define USB_8DEV_CMD_QUEUE_SIZE         4
+// Number of CAN errors waiting for the main loop. An error interrupt can queue
+// three.
+#define USB_8DEV_ERR_QUEUE_SIZE         8
+// Number of previous payloads kept for XOR coding of the compact stream format
+#define USB_8DEV_XOR_CACHE_SIZE         8
+
+// Number of frames that can wait to be sent on the data IN endpoint
+#define USB_GS_TX_QUEUE_SIZE            16
+// Number of TX echoes that can wait, must hold all echo IDs the host uses
+#define USB_GS_ECHO_QUEUE_SIZE          16
+
+// Number of trace records kept, the oldest are overwritten
+#define TRACE_SIZE                      32
+
+/* Fails to compile unless cond holds. C99 has no _Static_assert. */
+#define CONFIG_ASSERT(name, cond) \
+    typedef char config_assert_##name[(cond) ? 1 : -1]
+#define CONFIG_RING_SIZE(n)         ((n) && !((n) & ((n) - 1)) && (n) <= 128)
+
+CONFIG_ASSERT(can_tx_queue, CONFIG_RING_SIZE(CAN_TX_QUEUE_SIZE));
+CONFIG_ASSERT(can_rx_queue, CONFIG_RING_SIZE(CAN_RX_QUEUE_SIZE));
+CONFIG_ASSERT(usb_8dev_tx_queue, CONFIG_RING_SIZE(USB_8DEV_TX_QUEUE_SIZE));
+CONFIG_ASSERT(usb_8dev_cmd_queue, CONFIG_RING_SIZE(USB_8DEV_CMD_QUEUE_SIZE));
+CONFIG_ASSERT(usb_8dev_err_queue, CONFIG_RING_SIZE(USB_8DEV_ERR_QUEUE_SIZE));
+CONFIG_ASSERT(usb_8dev_xor_cache, CONFIG_RING_SIZE(USB_8DEV_XOR_CACHE_SIZE));
+CONFIG_ASSERT(usb_gs_tx_queue, CONFIG_RING_SIZE(USB_GS_TX_QUEUE_SIZE));
+CONFIG_ASSERT(usb_gs_echo_queue, CONFIG_RING_SIZE(USB_GS_ECHO_QUEUE_SIZE));
+CONFIG_ASSERT(trace_size, CONFIG_RING_SIZE(TRACE_SIZE));
+// An error interrupt queues earlier repeats, a protocol error and the state
+CONFIG_ASSERT(usb_8dev_err_queue_min, USB_8DEV_ERR_QUEUE_SIZE >= 3);
+
+/* Functions on the frame path are copied to RAM by the startup code when built
+ * with `make RAMFUNCS=1`, @see README.md. Code in RAM runs without the flash
+ * wait state but takes RAM away from the queues. Calls between flash and RAM
+ * are out of range of a BL and go through a veneer the linker adds. */
+#ifdef RAMFUNCS
+#define RAMFUNC __attribute__((section(".ramfunc"), noinline))
+#else
+#define RAMFUNC
+#endif
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef _HIST_H_
+#define _HIST_H_
+
+#include <stdint.h>
+
+// Histograms, @see hist.c
+#define HIST_RX_TO_USB          0   /* CAN RX interrupt to USB IN packet */
+#define HIST_USB_TO_TX          1   /* USB OUT packet to transmit mailbox */
+#define HIST_HANDLER            2   /* Main loop event handler run time */
+#define HIST_COUNT              3
+
+// Number of buckets, bucket 0 counts 0µs, bucket n [2^(n-1), 2^n)µs and the
+// last bucket everything from 2^(HIST_BUCKETS-2)µs
+#define HIST_BUCKETS            15
+
+void hist_add(uint8_t hist, uint32_t us);
+void hist_read(uint8_t hist, uint16_t *buckets, uint8_t reset);
+
+#endif
@@ -25,5 +25,7 @@ void led_on(uint8_t led);
 void led_off(uint8_t led);
 void led_toggle(uint8_t led);
 void led_blink(uint8_t led);
+void led_hold(uint8_t led);
+void led_tim_irq_handler();
 
 #endif
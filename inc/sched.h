@@ -0,0 +1,34 @@
+#ifndef _SCHED_H_
+#define _SCHED_H_
+
+#include <stdint.h>
+
+// Events in priority order, the lowest number is handled first
+#define SCHED_CAN_RX        0   /* Received frames to pass on to USB */
+#define SCHED_CAN_ERR       1   /* CAN error to pass on to USB */
+#define SCHED_CAN_TX        2   /* Frames queued for idle mailboxes */
+#define SCHED_CMD           3   /* Commands received */
+#define SCHED_CAN_OPEN      4   /* Open CAN and reply to the command */
+#define SCHED_CAN_CLOSE     5   /* Close CAN and reply to the command */
+#define SCHED_CAN_AUTOBAUD  6   /* Detect the bitrate and reply */
+#define SCHED_EVENTS        7
+
+typedef void (*Sched_HandlerTypeDef)(void);
+
+extern volatile uint8_t sched_events[SCHED_EVENTS];
+
+void sched_run(const Sched_HandlerTypeDef handlers[SCHED_EVENTS]);
+
+/**
+ * Post an event, safe from any context.
+ *
+ * Events don't count, posting an event that is pending already has no effect.
+ *
+ * @param[in] event SCHED_CAN_RX etc.
+ */
+static inline void sched_post(uint8_t event) {
+    // A byte store can't be torn, unlike a read-modify-write of a bitmask
+    sched_events[event] = 1;
+}
+
+#endif
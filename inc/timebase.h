@@ -0,0 +1,47 @@
+#ifndef _TIMEBASE_H_
+#define _TIMEBASE_H_
+
+#include <stdint.h>
+#include "stm32f0xx_hal.h"
+
+// Definition for the timebase timer, must be a 32-bit timer
+#define TIMEBASE_TIM                    TIM2
+#define TIMEBASE_CLK_ENABLE             __HAL_RCC_TIM2_CLK_ENABLE
+
+// USB frames the drift is measured over
+#define TIMEBASE_DRIFT_WINDOW           1024
+// Phase error (in µs) at a SOF that is considered an outlier
+#define TIMEBASE_OUTLIER_LIMIT          100
+// Consecutive outliers after which the timebase is re-anchored
+#define TIMEBASE_OUTLIER_MAX            8
+// Largest filtered phase error (in µs) during a drift window to be locked
+#define TIMEBASE_LOCK_LIMIT             4
+
+// Timebase synchronization states
+#define TIMEBASE_FREE_RUNNING           0   /* No SOF seen yet */
+#define TIMEBASE_LOCKING                1   /* Following SOF, not settled */
+#define TIMEBASE_LOCKED                 2   /* Within TIMEBASE_LOCK_LIMIT */
+
+/* Synchronization of the timebase to the USB start-of-frame. */
+typedef struct timebase_sync {
+    int16_t drift;      /* Local clock against SOF in ppm, positive is fast */
+    int16_t phase;      /* Filtered phase error at SOF (in µs) */
+    uint8_t state;      /* TIMEBASE_FREE_RUNNING, _LOCKING or _LOCKED */
+} Timebase_SyncTypeDef;
+
+extern volatile Timebase_SyncTypeDef timebase_sync;
+
+void timebase_init();
+void timebase_sof();
+uint16_t timebase_reset();
+
+/**
+ * Get the current time.
+ *
+ * @return free-running time in µs, wraps after about 71 minutes
+ */
+static inline uint32_t timebase_now() {
+    return TIMEBASE_TIM->CNT;
+}
+
+#endif
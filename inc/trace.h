@@ -0,0 +1,35 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include "config.h"
+
+// Trace events, the begin and end of a span have the same id, the end is
+// or'ed with TRACE_END
+#define TRACE_USB_IRQ           0x01    /* USB interrupt */
+#define TRACE_CAN_IRQ           0x02    /* CAN interrupt */
+#define TRACE_HANDLER           0x03    /* Main loop handler, arg is event */
+#define TRACE_CAN_RXQ           0x10    /* CAN RX queue, arg is depth */
+#define TRACE_CAN_TXQ           0x11    /* CAN TX queue, arg is depth */
+#define TRACE_USB_TXQ           0x12    /* Data IN queue, arg is depth */
+#define TRACE_CMDQ              0x13    /* Command queue, arg is depth */
+#define TRACE_END               0x80
+
+/* Trace record, as sent to the host. */
+typedef struct trace_record {
+    uint32_t timestamp;     /* timebase_now() */
+    uint16_t arg;
+    uint8_t event;          /* TRACE_USB_IRQ etc. */
+} Trace_RecordTypeDef;
+
+#ifdef TRACE
+void trace(uint8_t event, uint16_t arg);
+#define TRACE_EVENT(event, arg)         trace((event), (arg))
+#else
+#define TRACE_EVENT(event, arg)
+#endif
+
+uint8_t trace_read(uint8_t index, Trace_RecordTypeDef *record);
+void trace_freeze(uint8_t freeze);
+
+#endif
@@ -1,6 +1,22 @@
 #ifndef _USBD_H_
 #define _USBD_H_
 
+/* The USB personality is selected at build time, @see Makefile. Both
+ * implement the same functions for the main loop. */
+#ifdef USBD_GS_USB
+#include "usbd_gs_if.h"
+#define usbd_process_cmds()         /* configured with control requests */
+#define usbd_send_cmd_rsp           usbd_gs_send_cmd_rsp
+#define usbd_transmit_can_frame     usbd_gs_transmit_can_frame
+#define usbd_transmit_can_error     usbd_gs_transmit_can_error
+#else
+#include "usbd_8dev_if.h"
+#define usbd_process_cmds           usbd_8dev_process_cmds
+#define usbd_send_cmd_rsp           usbd_8dev_send_cmd_rsp
+#define usbd_transmit_can_frame     usbd_8dev_transmit_can_frame
+#define usbd_transmit_can_error     usbd_8dev_transmit_can_error
+#endif
+
 void usb_init();
 
 #endif
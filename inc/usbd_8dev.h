@@ -20,6 +20,8 @@ typedef struct _usbd_8dev_itf {
     uint8_t (*deinit)(void);
     uint8_t (*receive_command)(uint8_t *pbuf, uint8_t *len);
     uint8_t (*receive_data)(uint8_t *pbuf, uint8_t *len);
+    uint8_t (*data_transmitted)(void);
+    uint8_t (*cmd_transmitted)(void);
 } USBD_8DEV_ItfTypeDef;
 
 extern USBD_ClassTypeDef usbd_8dev;
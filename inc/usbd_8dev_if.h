@@ -1,13 +1,19 @@
 #ifndef _USBD_8DEV_IF_H_
 #define _USBD_8DEV_IF_H_
 
+#include "config.h"
 #include "usbd_8dev.h"
 
+// Number of messages in a USB_8DEV_GET_STATUS reply
+#define USB_8DEV_STATUS_PAGES   3
+
 extern USBD_8DEV_ItfTypeDef usbd_8dev_fops;
 
+void usbd_8dev_process_cmds();
 void usbd_8dev_send_cmd_rsp(uint8_t error);
-void usbd_8dev_transmit_can_frame();
+void usbd_8dev_transmit_can_frame(uint32_t timestamp);
 void usbd_8dev_transmit_can_error();
+void usbd_8dev_transmit_queued();
 void usbd_8dev_receive();
 
 #endif
@@ -60,7 +60,9 @@
 /* Common Config */
 #define USBD_MAX_NUM_INTERFACES               1
 #define USBD_MAX_NUM_CONFIGURATION            1
-#define USBD_MAX_STR_DESC_SIZ                 0x100
+/* Buffer for the string descriptors built at run time, holds strings of up
+   to 31 characters, @see usbd_desc.c */
+#define USBD_MAX_STR_DESC_SIZ                 0x40
 #define USBD_SUPPORT_USER_STRING              0 
 #define USBD_SELF_POWERED                     1
 #define USBD_DEBUG_LEVEL                      0
@@ -68,16 +70,8 @@
 /* Exported macro ------------------------------------------------------------*/
 /* Memory management macros */   
 
-/* For footprint reasons and since only one allocation is handled in the CDC class 
-   driver, the malloc/free is changed into a static allocation method */
-
-void *USBD_static_malloc(uint32_t size);
-void USBD_static_free(void *p);
-
-#define MAX_STATIC_ALLOC_SIZE     140 /*CDC Class Driver Structure size*/
-
-#define USBD_malloc               (uint32_t *)USBD_static_malloc
-#define USBD_free                 USBD_static_free
+/* The class drivers keep their data in a static variable, there is only one
+   device, so there is no allocation */
 #define USBD_memset               /* Not used */
 #define USBD_memcpy               /* Not used */
 
@@ -108,6 +102,9 @@ void USBD_static_free(void *p);
 #endif
 
 /* Exported functions ------------------------------------------------------- */
+/* usbd_conf.h comes before the handle typedef in usbd_def.h */
+struct _USBD_HandleTypeDef;
+void USBD_LL_StallStatus(struct _USBD_HandleTypeDef *pdev);
 
 #endif /* __USBD_CONF_H */
 
@@ -0,0 +1,34 @@
+#ifndef _USBD_GS_H_
+#define _USBD_GS_H_
+
+#include "usbd_def.h"
+
+// Same endpoints as the gs_usb device driver expects
+#define USBD_GS_DATA_IN_EP      0x81  /* EP1 for data IN */
+#define USBD_GS_DATA_OUT_EP     0x02  /* EP2 for data OUT */
+
+#define USBD_GS_FS_MAX_PACKET_SIZE          64  /* Endpoint max packet size (bytes) */
+#define USBD_GS_DATA_FS_IN_PACKET_SIZE      USBD_GS_FS_MAX_PACKET_SIZE
+#define USBD_GS_DATA_FS_OUT_PACKET_SIZE     USBD_GS_FS_MAX_PACKET_SIZE
+
+// Largest vendor request data stage (bit timing constants)
+#define USBD_GS_CTRL_BUF_SIZE   40
+
+typedef struct _usbd_gs_itf {
+    uint8_t (*init)(void);
+    uint8_t (*deinit)(void);
+    uint8_t (*control_out)(uint8_t request, uint8_t *pbuf, uint16_t len);
+    uint16_t (*control_in)(uint8_t request, uint8_t *pbuf, uint16_t len);
+    uint8_t (*receive_data)(uint8_t *pbuf, uint8_t *len);
+    uint8_t (*data_transmitted)(void);
+} USBD_GS_ItfTypeDef;
+
+extern USBD_ClassTypeDef usbd_gs;
+
+uint8_t usbd_gs_registerinterface(USBD_HandleTypeDef *pdev, USBD_GS_ItfTypeDef *fops);
+uint8_t usbd_gs_set_data_txbuf(USBD_HandleTypeDef *pdev, uint8_t *pbuff, uint16_t len);
+uint8_t usbd_gs_set_data_rxbuf(USBD_HandleTypeDef *pdev, uint8_t *pbuff);
+uint8_t usbd_gs_transmit_data_packet(USBD_HandleTypeDef *pdev);
+uint8_t usbd_gs_receive_data_packet(USBD_HandleTypeDef *pdev);
+
+#endif
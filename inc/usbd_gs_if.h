@@ -0,0 +1,15 @@
+#ifndef _USBD_GS_IF_H_
+#define _USBD_GS_IF_H_
+
+#include "config.h"
+#include "usbd_gs.h"
+
+extern USBD_GS_ItfTypeDef usbd_gs_fops;
+
+void usbd_gs_send_cmd_rsp(uint8_t error);
+void usbd_gs_transmit_can_frame(uint32_t timestamp);
+void usbd_gs_transmit_can_error();
+void usbd_gs_transmit_queued();
+void usbd_gs_receive();
+
+#endif
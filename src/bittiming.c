@@ -0,0 +1,202 @@
+/**
+ * Bit timing conversion.
+ *
+ * The usb_8dev driver computes the bit timing for a 32MHz clock, the
+ * controller runs at 48MHz. Scaling the prescaler by 1.5 truncates odd
+ * prescalers to a wrong bitrate, so the timing is computed again: the bit time
+ * in CAN clock cycles is split into a prescaler and a number of tq, with the
+ * sample point as close as possible to the requested one. A bit time the CAN
+ * clock can't make exactly is matched to the closest standard bitrate, or
+ * rejected. Integer only, there is no FPU.
+ *
+ * The standard bitrates are also the candidates of the automatic bitrate
+ * detection, @see can_autobaud.
+ */
+#include "bittiming.h"
+
+// CAN clock cycles per host clock cycle as a fraction
+#define CLOCK_NUM   (BITTIMING_CAN_CLOCK / 16000000)
+#define CLOCK_DEN   (BITTIMING_HOST_CLOCK / 16000000)
+
+/* Bit times of the standard bitrates in CAN clock cycles. */
+static const uint16_t standard_bits[] = {
+    BITTIMING_CAN_CLOCK / 1000000,
+    BITTIMING_CAN_CLOCK / 800000,
+    BITTIMING_CAN_CLOCK / 500000,
+    BITTIMING_CAN_CLOCK / 250000,
+    BITTIMING_CAN_CLOCK / 125000,
+    BITTIMING_CAN_CLOCK / 100000,
+    BITTIMING_CAN_CLOCK / 83333,
+    BITTIMING_CAN_CLOCK / 50000,
+    BITTIMING_CAN_CLOCK / 33333,
+    BITTIMING_CAN_CLOCK / 20000,
+    BITTIMING_CAN_CLOCK / 10000
+};
+
+/* Closest standard bit time within BITTIMING_TOLERANCE. @param scaled bit time
+ * in CAN clock cycles times CLOCK_DEN @return bit time in CAN clock cycles,
+ * 0 if none is close enough */
+static uint32_t standard_bit_time(uint32_t scaled) {
+    uint32_t best = 0;
+    uint32_t best_diff = 0;
+    uint32_t bits;
+    uint32_t diff;
+    uint8_t i;
+    for (i = 0; i < sizeof(standard_bits) / sizeof(standard_bits[0]); i++) {
+        bits = standard_bits[i] * CLOCK_DEN;
+        diff = scaled > bits ? scaled - bits : bits - scaled;
+        if (diff * (1000000 / BITTIMING_TOLERANCE) <= bits
+                && (!best || diff < best_diff)) {
+            best = standard_bits[i];
+            best_diff = diff;
+        }
+    }
+    return best;
+}
+
+/* Split a bit time into a prescaler and tq with the sample point closest to
+ * sp_num / sp_den, more tq if equally close. @return number of tq, 0 if the
+ * bit time can't be split */
+static uint32_t split(uint32_t cycles, uint32_t sp_num, uint32_t sp_den,
+        uint32_t *sample) {
+    uint32_t best_tq = 0;
+    uint32_t best_err = 0;
+    uint32_t tq;
+    uint32_t sp;
+    uint32_t err;
+
+    for (tq = BITTIMING_TQ_MAX; cycles && tq >= BITTIMING_TQ_MIN; tq--) {
+        if (cycles % tq || cycles / tq > BITTIMING_BRP_MAX) {
+            continue;
+        }
+        // Sample point in tq, rounded and kept within the segment limits
+        sp = (sp_num * tq + sp_den / 2) / sp_den;
+        if (sp > 1 + BITTIMING_TS1_MAX) {
+            sp = 1 + BITTIMING_TS1_MAX;
+        }
+        if (sp >= tq) {
+            sp = tq - 1;
+        }
+        if (tq - sp > BITTIMING_TS2_MAX) {
+            sp = tq - BITTIMING_TS2_MAX;
+        }
+        // Time segment 1 is at least 1 tq after the sync segment
+        if (sp < 2) {
+            sp = 2;
+        }
+        if (tq - sp > BITTIMING_TS2_MAX) {
+            continue;
+        }
+        // Distance to the requested sample point is err / (sp_den * tq)
+        err = sp * sp_den > sp_num * tq ? sp * sp_den - sp_num * tq
+            : sp_num * tq - sp * sp_den;
+        if (!best_tq || err * best_tq < best_err * tq) {
+            best_tq = tq;
+            *sample = sp;
+            best_err = err;
+        }
+    }
+    return best_tq;
+}
+
+/* Fill in bt for a split bit time, sjw in tq. */
+static void set_timing(Can_BitTimingTypeDef *bt, uint32_t cycles, uint32_t tq,
+        uint32_t sp, uint32_t sjw) {
+    bt->brp = cycles / tq;
+    bt->ts1 = sp - 2;
+    bt->ts2 = tq - sp - 1;
+    if (sjw > tq - sp) {
+        sjw = tq - sp;
+    }
+    if (sjw > BITTIMING_SJW_MAX) {
+        sjw = BITTIMING_SJW_MAX;
+    }
+    bt->sjw = sjw ? sjw - 1 : 0;
+}
+
+/**
+ * Compute the controller bit timing for a bit timing of the usb_8dev driver.
+ *
+ * Of the ways to split the bit time the one with the sample point closest to
+ * the requested one is used, the one with more tq if they are equally close.
+ * The SJW is kept at the same time and limited to time segment 2.
+ *
+ * @param ts1 time segment 1 (prop + phase segment 1) in host tq
+ * @param ts2 time segment 2 in host tq
+ * @param sjw synchronization jump width in host tq
+ * @param brp prescaler for BITTIMING_HOST_CLOCK
+ * @param[out] bt bit timing for can_open_req()
+ * @return 0 if OK, 1 if the segments are out of range or the bitrate can't be
+ * made
+ */
+uint8_t bittiming_from_host(uint8_t ts1, uint8_t ts2, uint8_t sjw,
+        uint16_t brp, Can_BitTimingTypeDef *bt) {
+    uint32_t host_tq = 1 + ts1 + ts2;
+    uint32_t cycles = (uint32_t) brp * host_tq * CLOCK_NUM;
+    uint32_t tq;
+    uint32_t sp;
+
+    if (!ts1 || !ts2 || !sjw || !brp || ts1 > BITTIMING_TS1_MAX
+            || ts2 > BITTIMING_TS2_MAX) {
+        return 1;
+    }
+    if (cycles % CLOCK_DEN) {
+        cycles = standard_bit_time(cycles);
+    } else {
+        cycles /= CLOCK_DEN;
+    }
+    tq = split(cycles, 1 + ts1, host_tq, &sp);
+    if (!tq) {
+        return 1;
+    }
+    set_timing(bt, cycles, tq, sp, (sjw * tq + host_tq / 2) / host_tq);
+    return 0;
+}
+
+/**
+ * Compute a bit timing with the largest SJW.
+ *
+ * @param cycles bit time in CAN clock cycles
+ * @param sample_point in ‰
+ * @param[out] bt bit timing for can_open_req()
+ * @return 0 if OK, 1 if the bit time can't be split
+ */
+uint8_t bittiming_split(uint32_t cycles, uint16_t sample_point,
+        Can_BitTimingTypeDef *bt) {
+    uint32_t sp;
+    uint32_t tq = split(cycles, sample_point, 1000, &sp);
+    if (!tq) {
+        return 1;
+    }
+    set_timing(bt, cycles, tq, sp, BITTIMING_SJW_MAX);
+    return 0;
+}
+
+/**
+ * Compute the bit timing the usb_8dev driver would send for a bit time.
+ *
+ * @param cycles bit time in CAN clock cycles
+ * @param sample_point in ‰
+ * @param[out] bt bit timing for BITTIMING_HOST_CLOCK
+ * @return 0 if OK, 1 if the host clock can't make it exactly
+ */
+uint8_t bittiming_to_host(uint32_t cycles, uint16_t sample_point,
+        Can_BitTimingTypeDef *bt) {
+    if ((cycles * CLOCK_DEN) % CLOCK_NUM) {
+        return 1;
+    }
+    return bittiming_split(cycles * CLOCK_DEN / CLOCK_NUM, sample_point, bt);
+}
+
+/**
+ * Get a standard bitrate.
+ *
+ * @param index 0 for the fastest
+ * @return bit time in CAN clock cycles, 0 past the last one
+ */
+uint32_t bittiming_standard(uint8_t index) {
+    if (index >= sizeof(standard_bits) / sizeof(standard_bits[0])) {
+        return 0;
+    }
+    return standard_bits[index];
+}
@@ -0,0 +1,246 @@
+/**
+ * Bus load and frame mix.
+ *
+ * The controller doesn't tell how long a frame was on the wire, so it is
+ * computed from the identifier and payload: the bits of the frame are run
+ * through the CRC and the bit stuffing of the controller that sent it, the
+ * stuff bits depend on both. The bits of every received and sent frame and of
+ * every error frame are added up over a window and compared with what the
+ * bitrate could carry in it. Frames are also counted by type.
+ *
+ * Computing the length takes about 100 bit steps per frame, so it is only
+ * done while the host asked for it, @see busload_start. Frames are added from
+ * the main loop (received) and the CAN interrupt (sent), errors from the CAN
+ * interrupt and the host reads from the USB interrupt, so adding is done with
+ * interrupts disabled. The window only moves on when a frame is added or the
+ * load is read, an idle window is a load of 0.
+ *
+ * Error frames are only seen while protocol errors interrupt, that is while
+ * the host wants them reported, @see can_lec_error.
+ */
+#include <string.h>
+#include "busload.h"
+#include "stm32f0xx.h"
+#include "timebase.h"
+
+// Bits after the CRC sequence that are never stuffed: CRC delimiter, ACK slot
+// and delimiter, end of frame and intermission
+#define BUSLOAD_FIXED_BITS      (1 + 2 + 7 + 3)
+// CAN CRC-15 polynomial
+#define BUSLOAD_CRC_POLY        0x4599
+
+/* Bits of a frame as they are sent. */
+typedef struct busload_stream {
+    uint16_t crc;       /* CRC of the bits so far */
+    uint8_t bits;       /* Bits before stuffing */
+    uint8_t stuffed;    /* Stuff bits */
+    uint8_t last;       /* Last bit on the wire */
+    uint8_t run;        /* Number of identical bits in a row */
+} Busload_StreamTypeDef;
+
+static Busload_StatsTypeDef stats;
+static uint32_t window_us; /*< Window (in µs), 0 if not measuring. */
+static uint32_t window_start; /*< timebase_now() when the window started. */
+static uint32_t window_bits; /*< Bits in the window so far. */
+
+/* Send the lower n bits of value, most significant first. @param crc 1 to
+ * include them in the CRC */
+static void put_bits(Busload_StreamTypeDef *s, uint32_t value, uint8_t n,
+        uint8_t crc) {
+    uint8_t bit;
+    uint8_t msb;
+    while (n--) {
+        bit = (value >> n) & 1;
+        if (crc) {
+            msb = s->crc >> 14;
+            s->crc = (s->crc << 1) & 0x7fff;
+            if (bit ^ msb) {
+                s->crc ^= BUSLOAD_CRC_POLY;
+            }
+        }
+        s->bits++;
+        if (bit == s->last) {
+            s->run++;
+        } else {
+            s->last = bit;
+            s->run = 1;
+        }
+        // The stuff bit of the opposite level starts the next run
+        if (s->run == 5) {
+            s->stuffed++;
+            s->last = !bit;
+            s->run = 1;
+        }
+    }
+}
+
+/* Length on the wire of a frame in mailbox register format. @return bits from
+ * start of frame up to and including the intermission */
+static uint32_t frame_bits(uint32_t ir, uint32_t dtr, uint32_t dlr,
+        uint32_t dhr) {
+    // The bus is idle (recessive) before start of frame
+    Busload_StreamTypeDef s = {0, 0, 0, 1, 0};
+    uint8_t rtr = (ir & CAN_RI0R_RTR) != 0;
+    uint8_t dlc = dtr & 0x0f;
+    uint8_t bytes = rtr ? 0 : dlc > 8 ? 8 : dlc;
+    uint8_t i;
+
+    put_bits(&s, 0, 1, 1);
+    put_bits(&s, ir >> 21, 11, 1);
+    if (ir & CAN_RI0R_IDE) {
+        // SRR and IDE recessive, identifier extension, RTR, r1 and r0
+        put_bits(&s, 3, 2, 1);
+        put_bits(&s, ir >> 3, 18, 1);
+        put_bits(&s, rtr << 2, 3, 1);
+    } else {
+        // RTR, IDE and r0
+        put_bits(&s, rtr << 2, 3, 1);
+    }
+    put_bits(&s, dlc, 4, 1);
+    for (i = 0; i < bytes; i++) {
+        put_bits(&s, (i < 4 ? dlr : dhr) >> (8 * (i % 4)), 8, 1);
+    }
+    put_bits(&s, s.crc, 15, 0);
+    return s.bits + s.stuffed + BUSLOAD_FIXED_BITS;
+}
+
+/* Bits in a window as ‰ of the bitrate. */
+static uint16_t load_of(uint32_t bits) {
+    // At most 1000 x BUSLOAD_WINDOW_MAX bits, so bits x 1000 doesn't overflow
+    uint32_t capacity = stats.bitrate / 1000 * stats.window;
+    if (!capacity) {
+        return 0;
+    }
+    if (bits > capacity) {
+        bits = capacity;
+    }
+    return bits * 1000 / capacity;
+}
+
+/* Move on to the window now is in. Must be called with interrupts disabled. */
+static void roll(uint32_t now) {
+    uint32_t elapsed = now - window_start;
+    // Received frames are added after the fact, they may be older
+    if ((int32_t) elapsed < 0 || elapsed < window_us) {
+        return;
+    }
+    // Nothing was added in the last complete window if it isn't this one
+    stats.load = elapsed < 2 * window_us ? load_of(window_bits) : 0;
+    if (stats.load > stats.peak) {
+        stats.peak = stats.load;
+    }
+    window_start += elapsed - elapsed % window_us;
+    window_bits = 0;
+}
+
+/**
+ * Start or stop measuring.
+ *
+ * Changing the window starts a new one, the counters and peak are kept.
+ * Nothing changes if it is the same window.
+ *
+ * @param window length (in ms) of the window the load is averaged over,
+ * limited to BUSLOAD_WINDOW_MAX, 0 to stop
+ */
+void busload_start(uint16_t window) {
+    uint32_t primask;
+    if (window > BUSLOAD_WINDOW_MAX) {
+        window = BUSLOAD_WINDOW_MAX;
+    }
+    if (window == stats.window) {
+        return;
+    }
+    primask = __get_PRIMASK();
+    __disable_irq();
+    stats.window = window;
+    stats.load = 0;
+    window_us = window * 1000;
+    window_start = timebase_now();
+    window_bits = 0;
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Set the bitrate the load is relative to, called when CAN is opened.
+ *
+ * @param bitrate in bit/s
+ */
+void busload_bitrate(uint32_t bitrate) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    stats.bitrate = bitrate;
+    window_start = timebase_now();
+    window_bits = 0;
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Count a frame that was received or sent.
+ *
+ * @param ir identifier register, RIR and TIR have the same layout
+ * @param dtr data length and time register
+ * @param dlr data low register
+ * @param dhr data high register
+ * @param now timebase_now() of the frame
+ */
+void busload_frame(uint32_t ir, uint32_t dtr, uint32_t dlr, uint32_t dhr,
+        uint32_t now) {
+    uint32_t bits;
+    uint8_t type;
+    uint32_t primask;
+    if (!window_us) {
+        return;
+    }
+    bits = frame_bits(ir, dtr, dlr, dhr);
+    if (ir & CAN_RI0R_RTR) {
+        type = BUSLOAD_RTR;
+    } else if (ir & CAN_RI0R_IDE) {
+        type = BUSLOAD_EXT;
+    } else {
+        type = BUSLOAD_STD;
+    }
+    primask = __get_PRIMASK();
+    __disable_irq();
+    roll(now);
+    window_bits += bits;
+    stats.frames[type]++;
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Count an error frame.
+ *
+ * @param now timebase_now() of the error
+ */
+void busload_error(uint32_t now) {
+    uint32_t primask;
+    if (!window_us) {
+        return;
+    }
+    primask = __get_PRIMASK();
+    __disable_irq();
+    roll(now);
+    window_bits += BUSLOAD_ERROR_BITS;
+    stats.frames[BUSLOAD_ERR]++;
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Get a copy of the measurement.
+ *
+ * @param[out] out load of the last complete window, peak and counters
+ * @param[in] reset clear the peak and counters after copying them
+ */
+void busload_read(Busload_StatsTypeDef *out, uint8_t reset) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (window_us) {
+        roll(timebase_now());
+    }
+    memcpy(out, &stats, sizeof(stats));
+    if (reset) {
+        stats.peak = stats.load;
+        memset(stats.frames, 0, sizeof(stats.frames));
+    }
+    __set_PRIMASK(primask);
+}
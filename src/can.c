@@ -1,27 +1,112 @@
+#include "bittiming.h"
+#include "busload.h"
 #include "can.h"
+#include "hist.h"
 #include "led.h"
+#include "sched.h"
 #include "stm32f0xx_hal.h"
+#include "timebase.h"
+#include "trace.h"
 
-// CAN control modes
-//#define CAN_CTRLMODE_NORMAL             0x00
-#define USB_8DEV_CAN_MODE_SILENT        0x01
-#define USB_8DEV_CAN_MODE_LOOPBACK      0x02
-#define USB_8DEV_MODE_ONESHOT           0x04
+/* Writes to registers that act on the value written, such as write 1 to clear
+ * flags and transmit or release requests, use WRITE_REG(). It is a plain store
+ * on the device, the host build models the controller behind it, @see
+ * host/can_model.c. */
 
-// Not supported
-//#define CAN_CTRLMODE_3_SAMPLES          0x04
-//#define CAN_CTRLMODE_BERR_REPORTING     0x10
-//#define CAN_CTRLMODE_FD                 0x20
-//#define CAN_CTRLMODE_PRESUME_ACK        0x40
-//#define CAN_CTRLMODE_FD_NON_ISO         0x80
+// Mask of the request completed flags of all transmit mailboxes
+#define CAN_TSR_RQCP    (CAN_TSR_RQCP0 | CAN_TSR_RQCP1 | CAN_TSR_RQCP2)
+// Mask of the abort request bits of all transmit mailboxes
+#define CAN_TSR_ABRQ    (CAN_TSR_ABRQ0 | CAN_TSR_ABRQ1 | CAN_TSR_ABRQ2)
+
+// Steps of can_open() and can_close()
+#define CAN_STEP_IDLE   0   /* Nothing in progress */
+#define CAN_STEP_INIT   1   /* Open, waiting for initialization mode */
+#define CAN_STEP_START  2   /* Open, waiting to leave initialization mode */
+#define CAN_STEP_STOP   3   /* Close, waiting for initialization mode */
+#define CAN_STEP_BAUD_INIT 4    /* Auto-baud, waiting for initialization mode */
+#define CAN_STEP_BAUD_LISTEN 5  /* Auto-baud, listening at a candidate */
+
+// Steps of can_busoff_poll()
+#define CAN_RECOVERY_IDLE   0   /* Not bus-off */
+#define CAN_RECOVERY_WAIT   1   /* Bus-off, backing off */
+#define CAN_RECOVERY_INIT   2   /* Waiting for initialization mode */
+#define CAN_RECOVERY_JOIN   3   /* Waiting for 128 x 11 recessive bits */
+
+/* Frame in the TX queue, stored in transmit mailbox register format so it can
+ * be loaded into a mailbox without any conversion. */
+typedef struct can_txframe {
+    uint32_t tir;
+    uint32_t tdtr;
+    uint32_t tdlr;
+    uint32_t tdhr;
+    uint32_t tag;   // passed to can_tx_cplt_callback()
+    uint32_t queued; // timebase_now() when the frame was queued
+} Can_TxFrameTypeDef;
+
+/* Frame in the RX queue, in receive FIFO mailbox register format. */
+typedef struct can_rxframe {
+    uint32_t rir;
+    uint32_t rdtr;
+    uint32_t rdlr;
+    uint32_t rdhr;
+    uint32_t timestamp; // timebase_now() when the frame was pending
+} Can_RxFrameTypeDef;
 
 CAN_HandleTypeDef can_handle;
+Can_StatsTypeDef can_stats;
+Can_AutobaudTypeDef can_autobaud_result;
 
 static uint8_t enabled; /*< Indicates if CAN interface in enabled. */
-static CAN_FilterConfTypeDef sFilterConfig;
+static uint8_t step; /*< Step of the open or close in progress. */
+static uint32_t step_start; /*< HAL_GetTick() when the step started. */
+static uint8_t berr_reporting; /*< Host wants protocol errors reported. */
+static uint8_t recovery; /*< Step of the bus-off recovery. */
+static uint32_t recovery_start; /*< HAL_GetTick() when the step started. */
+static uint32_t recovery_delay; /*< Back-off (in ms) before the next restart. */
+static uint32_t recovery_tx_frames; /*< can_stats.tx_frames at the last one. */
+
+/* Automatic bitrate detection, @see can_autobaud */
+static const uint16_t autobaud_sample_points[] = {875, 750};
+static uint8_t autobaud_dwell; /*< Time (in ms) at every candidate. */
+static uint8_t autobaud_sps; /*< Number of sample points tried. */
+static uint8_t autobaud_index; /*< Candidate being tried. */
+static uint8_t autobaud_frames; /*< Frames received at the candidate. */
+static uint8_t autobaud_errors; /*< Protocol errors at the candidate. */
+
+/* Protocol error storm protection, only used in the CAN interrupt or with
+ * interrupts disabled. @see can_lec_error */
+static uint8_t lec_masked; /*< LEC interrupt masked because of the rate. */
+static uint32_t lec_masked_at; /*< timebase_now() when it was masked. */
+static uint32_t lec_window; /*< Start of the rate window. */
+static uint8_t lec_window_count; /*< Protocol errors in the rate window. */
+static uint32_t lec_code; /*< Last reported protocol error. */
+static uint32_t lec_reported; /*< timebase_now() when it was reported. */
+static uint16_t lec_repeats; /*< Repeats of it that weren't reported yet. */
+static uint32_t lec_repeated; /*< timebase_now() of the last repeat. */
+
+/* TX queue. The head is only written by the producer (USB interrupt) and the
+ * tail only by the consumer (can_tx()), so no locking is needed between them.
+ * Both are free running, the number of queued frames is head - tail. */
+static Can_TxFrameTypeDef txq[CAN_TX_QUEUE_SIZE];
+static volatile uint8_t txq_head;
+static volatile uint8_t txq_tail;
+static uint32_t mailbox_tag[3]; /*< Tag of the frame in each mailbox. */
+static uint8_t mailbox_seq[3]; /*< Load order of the frame in each mailbox. */
+static uint8_t load_seq; /*< Sequence number of the next frame loaded. */
+/* RX queue, the head is only written by the RX interrupt and the tail only by
+ * can_rx(). */
+static Can_RxFrameTypeDef rxq[CAN_RX_QUEUE_SIZE];
+static volatile uint8_t rxq_head;
+static volatile uint8_t rxq_tail;
 
 static void can_interrupts_enable();
 static void can_interrupts_disable();
+static uint8_t can_configure();
+static uint8_t can_filter();
+static void can_step(uint8_t next);
+static uint8_t can_step_expired();
+static uint8_t can_open_fail(uint8_t error);
+static uint8_t can_autobaud_done(uint8_t error);
 
 /**
  * Initialize CAN interface.
@@ -51,23 +136,27 @@ void can_open_req(Can_BitTimingTypeDef* can_bittiming, uint8_t ctrlmode) {
      * tbs2 = tq.(TS2+1)
      * baud = 1/(tsjw+tbs1+tbs2) = 1/(tq.((SJW+1)+(TS1+1)+(TS2+1)))
      */
-    static CanTxMsgTypeDef TxMessage;
     static CanRxMsgTypeDef RxMessage;
 
     // Configure the CAN peripheral
     can_handle.Instance = CANx;
-    can_handle.pTxMsg = &TxMessage;
     can_handle.pRxMsg = &RxMessage;
 
     can_handle.Init.TTCM = DISABLE;
-    can_handle.Init.ABOM = DISABLE;
+    // Software recovery restarts the controller when it is bus-off, it
+    // mustn't do so itself
+    can_handle.Init.ABOM = CAN_BUSOFF_RECOVERY == CAN_BUSOFF_ABOM
+        ? ENABLE : DISABLE;
     can_handle.Init.AWUM = DISABLE;
     can_handle.Init.NART = DISABLE;
     if (ctrlmode & USB_8DEV_MODE_ONESHOT) {
         can_handle.Init.NART = ENABLE;
     }
+    berr_reporting = (ctrlmode & USB_8DEV_MODE_BERR_REPORTING) != 0;
     can_handle.Init.RFLM = DISABLE;
-    can_handle.Init.TXFP = DISABLE;
+    // Multiple mailboxes are used, transmit in the order the host sent the
+    // frames instead of by identifier
+    can_handle.Init.TXFP = ENABLE;
     can_handle.Init.Mode = CAN_MODE_NORMAL;
     if (ctrlmode & USB_8DEV_CAN_MODE_SILENT) {
         can_handle.Init.Mode |= CAN_MODE_SILENT;
@@ -81,80 +170,490 @@ void can_open_req(Can_BitTimingTypeDef* can_bittiming, uint8_t ctrlmode) {
     can_handle.Init.BS1 = can_bittiming->ts1 << 4*4;
     can_handle.Init.BS2 = can_bittiming->ts2 << 5*4;
     can_handle.Init.Prescaler = can_bittiming->brp;
-
-    // Configure the CAN Filter, needed to receive CAN data
-    sFilterConfig.FilterNumber = 0;
-    sFilterConfig.FilterMode = CAN_FILTERMODE_IDMASK;
-    sFilterConfig.FilterScale = CAN_FILTERSCALE_32BIT;
-    sFilterConfig.FilterIdHigh = 0x0000;
-    sFilterConfig.FilterIdLow = 0x0000;
-    sFilterConfig.FilterMaskIdHigh = 0x0000;
-    sFilterConfig.FilterMaskIdLow = 0x0000;
-    sFilterConfig.FilterFIFOAssignment = CAN_FIFO0;
-    sFilterConfig.FilterActivation = ENABLE;
-    sFilterConfig.BankNumber = 14;
+    busload_bitrate(BITTIMING_CAN_CLOCK / (can_bittiming->brp
+                * (3 + can_bittiming->ts1 + can_bittiming->ts2)));
 }
 
 /**
- * Open the CAN interface.
+ * Open the CAN interface, or change its configuration if it is open already.
  *
- * Initialize and configure the filters for the CAN interface.
+ * Doesn't block, it has to be called until it no longer returns CAN_BUSY. The
+ * controller needs 11 recessive bits to join the bus, every step waits at most
+ * CAN_MODE_TIMEOUT. Returns CAN_BUSY without doing anything while a close is in
+ * progress.
  *
- * @return 0 if OK
+ * @return 0 if OK, CAN_BUSY if in progress, 1 if initialization mode couldn't
+ * be entered, 2 if the filter couldn't be set up, 3 if the bus couldn't be
+ * joined
  */
 uint8_t can_open() {
-    if (HAL_CAN_Init(&can_handle)) {
-        return 1;
+    switch (step) {
+        case CAN_STEP_IDLE:
+            if (enabled) {
+                // Stop receiving while the configuration changes
+                can_interrupts_disable();
+                enabled = 0;
+            } else {
+                // Clocks, pins and interrupt
+                HAL_CAN_MspInit(&can_handle);
+            }
+            CANx->MCR = (CANx->MCR & ~CAN_MCR_SLEEP) | CAN_MCR_INRQ;
+            recovery = CAN_RECOVERY_IDLE;
+            recovery_delay = 0;
+            can_step(CAN_STEP_INIT);
+            return CAN_BUSY;
+        case CAN_STEP_INIT:
+            if ((CANx->MSR & (CAN_MSR_INAK | CAN_MSR_SLAK)) != CAN_MSR_INAK) {
+                return can_step_expired() ? can_open_fail(1) : CAN_BUSY;
+            }
+            if (can_configure()) {
+                return can_open_fail(2);
+            }
+            CANx->MCR &= ~CAN_MCR_INRQ;
+            can_step(CAN_STEP_START);
+            return CAN_BUSY;
+        case CAN_STEP_START:
+            if (CANx->MSR & CAN_MSR_INAK) {
+                return can_step_expired() ? can_open_fail(3) : CAN_BUSY;
+            }
+            can_step(CAN_STEP_IDLE);
+            can_handle.State = HAL_CAN_STATE_READY;
+            rxq_tail = rxq_head;
+            can_interrupts_enable();
+            enabled = 1;
+            return 0;
+        default:
+            return CAN_BUSY;
     }
-    if (HAL_CAN_ConfigFilter(&can_handle, &sFilterConfig)) {
-        return 2;
-    }
-    /*if (HAL_CAN_Receive_IT(&can_handle, CAN_FIFO0)) {*/
-        /*return 3;*/
-    /*}*/
-    can_interrupts_enable();
-    enabled = 1;
-    return 0;
 }
 
 /**
  * Close the CAN interface
+ *
+ * Doesn't block, it has to be called until it no longer returns CAN_BUSY.
+ * Pending transmissions are aborted, a frame that is on the bus is finished
+ * first, waiting at most CAN_MODE_TIMEOUT. Returns CAN_BUSY without doing
+ * anything while an open is in progress.
+ *
+ * @return 0 if OK, CAN_BUSY if in progress, 1 if the controller was reset
+ * without finishing the frame on the bus
  */
 uint8_t can_close() {
-    can_interrupts_disable();
-    if (HAL_CAN_DeInit(&can_handle)) {
+    switch (step) {
+        case CAN_STEP_IDLE:
+            if (!enabled) {
+                HAL_CAN_MspDeInit(&can_handle);
+                return 0;
+            }
+            can_interrupts_disable();
+            enabled = 0;
+            recovery = CAN_RECOVERY_IDLE;
+            // Drop the frames that didn't make it to a mailbox
+            txq_tail = txq_head;
+            can_tx_dequeue_callback();
+            WRITE_REG(CANx->TSR, CAN_TSR_ABRQ);
+            CANx->MCR |= CAN_MCR_INRQ;
+            can_step(CAN_STEP_STOP);
+            return CAN_BUSY;
+        case CAN_STEP_STOP:
+            if (!(CANx->MSR & CAN_MSR_INAK) && !can_step_expired()) {
+                return CAN_BUSY;
+            }
+            can_step(CAN_STEP_IDLE);
+            HAL_CAN_MspDeInit(&can_handle);
+            can_handle.State = HAL_CAN_STATE_RESET;
+            return (CANx->MSR & CAN_MSR_INAK) ? 0 : 1;
+        default:
+            return CAN_BUSY;
+    }
+}
+
+/**
+ * Set up an automatic bitrate detection, @see can_autobaud.
+ *
+ * @param dwell time (in ms) to listen at every candidate, 0 for
+ * CAN_AUTOBAUD_DWELL
+ * @param sample_points 2 to try a sample point of 75% as well as 87.5%
+ */
+void can_autobaud_req(uint8_t dwell, uint8_t sample_points) {
+    autobaud_dwell = dwell ? dwell : CAN_AUTOBAUD_DWELL;
+    autobaud_sps = sample_points >= 2 ? 2 : 1;
+}
+
+/**
+ * Detect the bitrate of the bus.
+ *
+ * Tries the standard bitrates, fastest first, in silent mode so nothing is
+ * ever sent, not even an ACK or an error frame. At every candidate the
+ * received frames and protocol errors are counted for the dwell time, the
+ * candidate with the most frames over errors wins. A candidate that receives
+ * CAN_AUTOBAUD_FRAMES without any error ends the detection right away. The
+ * result is in can_autobaud_result.
+ *
+ * Doesn't block, it has to be called until it no longer returns CAN_BUSY. CAN
+ * must be closed, the registers are polled.
+ *
+ * @return 0 if a bitrate was found, CAN_BUSY if in progress, 1 if CAN is open,
+ * 2 if initialization mode couldn't be entered, 3 if no bitrate received
+ * more frames than errors
+ */
+uint8_t can_autobaud() {
+    Can_BitTimingTypeDef bt;
+    Can_AutobaudTypeDef *result = &can_autobaud_result;
+    uint32_t lec;
+
+    switch (step) {
+        case CAN_STEP_IDLE:
+            if (enabled) {
+                return 1;
+            }
+            HAL_CAN_MspInit(&can_handle);
+            result->cycles = 0;
+            result->frames = 0;
+            result->errors = 0;
+            autobaud_index = 0;
+            CANx->MCR = (CANx->MCR & ~CAN_MCR_SLEEP) | CAN_MCR_INRQ;
+            can_step(CAN_STEP_BAUD_INIT);
+            return CAN_BUSY;
+        case CAN_STEP_BAUD_INIT:
+            if ((CANx->MSR & (CAN_MSR_INAK | CAN_MSR_SLAK)) != CAN_MSR_INAK) {
+                return can_step_expired() ? can_autobaud_done(2) : CAN_BUSY;
+            }
+            bittiming_split(bittiming_standard(autobaud_index / autobaud_sps),
+                    autobaud_sample_points[autobaud_index % autobaud_sps], &bt);
+            can_open_req(&bt, USB_8DEV_CAN_MODE_SILENT);
+            if (can_configure()) {
+                return can_autobaud_done(2);
+            }
+            // Hardware never sets LEC to 7, anything else is a new error
+            CANx->ESR = CAN_ESR_LEC;
+            autobaud_frames = 0;
+            autobaud_errors = 0;
+            CANx->MCR &= ~CAN_MCR_INRQ;
+            can_step(CAN_STEP_BAUD_LISTEN);
+            return CAN_BUSY;
+        case CAN_STEP_BAUD_LISTEN:
+            // One at a time, FMP0 only drops once the release is done
+            if (CANx->RF0R & CAN_RF0R_FMP0) {
+                WRITE_REG(CANx->RF0R, CAN_RF0R_RFOM0);
+                if (autobaud_frames < 0xff) {
+                    autobaud_frames++;
+                }
+            }
+            lec = CANx->ESR & CAN_ESR_LEC;
+            if (lec && lec != CAN_ESR_LEC) {
+                CANx->ESR = CAN_ESR_LEC;
+                if (autobaud_errors < 0xff) {
+                    autobaud_errors++;
+                }
+            }
+            if ((autobaud_frames < CAN_AUTOBAUD_FRAMES || autobaud_errors)
+                    && HAL_GetTick() - step_start < autobaud_dwell) {
+                return CAN_BUSY;
+            }
+            if (autobaud_frames > autobaud_errors && autobaud_frames
+                    - autobaud_errors > result->frames - result->errors) {
+                result->cycles = bittiming_standard(autobaud_index / autobaud_sps);
+                result->sample_point =
+                    autobaud_sample_points[autobaud_index % autobaud_sps];
+                result->frames = autobaud_frames;
+                result->errors = autobaud_errors;
+            }
+            if (autobaud_frames >= CAN_AUTOBAUD_FRAMES && !autobaud_errors) {
+                return can_autobaud_done(0);
+            }
+            if (!bittiming_standard(++autobaud_index / autobaud_sps)) {
+                return can_autobaud_done(result->cycles ? 0 : 3);
+            }
+            CANx->MCR |= CAN_MCR_INRQ;
+            can_step(CAN_STEP_BAUD_INIT);
+            return CAN_BUSY;
+        default:
+            return CAN_BUSY;
+    }
+}
+
+/**
+ * Queue a CAN frame for transmission.
+ *
+ * Only the producer side of the TX queue, it must not be called from more
+ * than one context. The frame is sent by a later call to can_tx().
+ *
+ * @param[in] msg CAN frame to transmit.
+ * @param[in] tag passed to can_tx_cplt_callback() once the frame is sent.
+ * @return 0 if OK, 1 if CAN is closed, 2 if the queue is full
+ */
+uint8_t can_tx_enqueue(CanTxMsgTypeDef *msg, uint32_t tag) {
+    Can_TxFrameTypeDef *frame;
+    if (!enabled) {
         return 1;
     }
-    enabled = 0;
+    if (can_tx_free() == 0) {
+        return 2;
+    }
+    frame = &txq[txq_head & (CAN_TX_QUEUE_SIZE - 1)];
+    // CAN_ID_EXT and CAN_RTR_REMOTE are the IDE and RTR bits of TIR
+    if (msg->IDE == CAN_ID_EXT) {
+        frame->tir = (msg->ExtId << 3) | CAN_ID_EXT;
+    } else {
+        frame->tir = msg->StdId << 21;
+    }
+    frame->tir |= msg->RTR;
+    frame->tdtr = msg->DLC & 0x0f;
+    frame->tdlr = ((uint32_t) msg->Data[3] << 24) | ((uint32_t) msg->Data[2] << 16) |
+        ((uint32_t) msg->Data[1] << 8) | msg->Data[0];
+    frame->tdhr = ((uint32_t) msg->Data[7] << 24) | ((uint32_t) msg->Data[6] << 16) |
+        ((uint32_t) msg->Data[5] << 8) | msg->Data[4];
+    frame->tag = tag;
+    frame->queued = timebase_now();
+    txq_head++;
+    TRACE_EVENT(TRACE_CAN_TXQ, (uint8_t) (txq_head - txq_tail));
+    if ((uint8_t) (txq_head - txq_tail) > can_stats.txq_max) {
+        can_stats.txq_max = txq_head - txq_tail;
+    }
     return 0;
 }
 
 /**
- * Transmit data over CAN.
+ * Number of frames that can still be queued with can_tx_enqueue().
+ */
+uint8_t can_tx_free() {
+    return CAN_TX_QUEUE_SIZE - (uint8_t) (txq_head - txq_tail);
+}
+
+/**
+ * Transmit queued frames over CAN.
+ *
+ * Moves as many frames from the TX queue to the transmit mailboxes as there
+ * are empty mailboxes. Doesn't block, the remaining frames are loaded from the
+ * transmit mailbox empty interrupt. Can be called from the main thread and
+ * from interrupt context.
  *
- * @param[in] timeout Time in ms to attempt transmit.
- * @return 0 if success
+ * @return Number of frames loaded into a mailbox.
  */
-uint8_t can_tx(uint32_t timeout) {
-    // If a timeout occurs, the CAN frame is already in the transmit mailbox
-    // and the CAN controller will still attempt to send it even after the
-    // timeout
-    //occurs.
-    return HAL_CAN_Transmit(&can_handle, timeout);
+RAMFUNC uint8_t can_tx() {
+    CAN_TxMailBox_TypeDef *mailbox;
+    Can_TxFrameTypeDef *frame;
+    uint8_t code;
+    uint8_t loaded = 0;
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    while (enabled && txq_tail != txq_head && (CANx->TSR & CAN_TSR_TME)) {
+        // CODE holds the number of the next empty mailbox
+        code = (CANx->TSR & CAN_TSR_CODE) >> 24;
+        mailbox = &CANx->sTxMailBox[code];
+        frame = &txq[txq_tail & (CAN_TX_QUEUE_SIZE - 1)];
+        mailbox_tag[code] = frame->tag;
+        mailbox_seq[code] = load_seq++;
+        mailbox->TDTR = frame->tdtr;
+        mailbox->TDLR = frame->tdlr;
+        mailbox->TDHR = frame->tdhr;
+        WRITE_REG(mailbox->TIR, frame->tir | CAN_TI0R_TXRQ);
+        hist_add(HIST_USB_TO_TX, timebase_now() - frame->queued);
+        txq_tail++;
+        loaded++;
+        TRACE_EVENT(TRACE_CAN_TXQ, (uint8_t) (txq_head - txq_tail));
+    }
+    __set_PRIMASK(primask);
+
+    if (loaded) {
+        can_tx_dequeue_callback();
+    }
+    return loaded;
+}
+
+/**
+ * Handle the transmit mailbox empty interrupt.
+ *
+ * Must be called from CANx_IRQHandler, which leaves the request completed
+ * flags to it alone.
+ */
+RAMFUNC void can_tx_irq_handler() {
+    uint32_t tsr = CANx->TSR;
+    uint32_t done = tsr & CAN_TSR_RQCP;
+    CAN_TxMailBox_TypeDef *mailbox;
+    uint8_t i;
+    uint8_t j;
+    if (done) {
+        WRITE_REG(CANx->TSR, done);
+        // TXFP sends the mailboxes in the order they were loaded, which isn't
+        // their number order. Several can complete before this runs, report
+        // them oldest first so echoes keep the order of the frames.
+        while (done) {
+            i = 3;
+            for (j = 0; j < 3; j++) {
+                if ((done & (CAN_TSR_RQCP0 << (8 * j))) && (i == 3
+                        || (uint8_t) (load_seq - mailbox_seq[j])
+                        > (uint8_t) (load_seq - mailbox_seq[i]))) {
+                    i = j;
+                }
+            }
+            done &= ~(CAN_TSR_RQCP0 << (8 * i));
+            if (tsr & (CAN_TSR_TXOK0 << (8 * i))) {
+                can_stats.tx_frames++;
+                // The mailbox still holds the frame until it is reloaded
+                mailbox = &CANx->sTxMailBox[i];
+                busload_frame(mailbox->TIR, mailbox->TDTR, mailbox->TDLR,
+                        mailbox->TDHR, timebase_now());
+            }
+            can_tx_cplt_callback(mailbox_tag[i]);
+        }
+        can_tx();
+    }
+}
+
+/**
+ * Called from interrupt context when a transmit request completed, whether the
+ * frame was sent or not.
+ *
+ * @param[in] tag of the frame, @see can_tx_enqueue
+ */
+__weak void can_tx_cplt_callback(uint32_t tag) {
+    UNUSED(tag);
+}
+
+/**
+ * Handle the FIFO 0 message pending interrupt.
+ *
+ * Moves the pending frames to the RX queue together with the time they were
+ * pending, so frames get the time they arrived instead of the time the main
+ * loop got to them. Must be called from CANx_IRQHandler, which leaves FIFO 0
+ * to it alone.
+ *
+ * When the RX queue is full the interrupt is disabled and the remaining frames
+ * wait in the FIFO, can_rx() enables it again.
+ */
+RAMFUNC void can_rx_irq_handler() {
+    uint32_t now = timebase_now();
+    Can_RxFrameTypeDef *frame;
+    if (!(CANx->IER & CAN_IER_FMPIE0)) {
+        return;
+    }
+    // Frames arrived faster than they were read, a new frame was lost
+    if (CANx->RF0R & CAN_RF0R_FOVR0) {
+        WRITE_REG(CANx->RF0R, CAN_RF0R_FOVR0);
+        can_stats.rx_overruns++;
+    }
+    while (CANx->RF0R & CAN_RF0R_FMP0) {
+        if ((uint8_t) (rxq_head - rxq_tail) == CAN_RX_QUEUE_SIZE) {
+            CANx->IER &= ~CAN_IER_FMPIE0;
+            break;
+        }
+        frame = &rxq[rxq_head & (CAN_RX_QUEUE_SIZE - 1)];
+        frame->rir = CANx->sFIFOMailBox[0].RIR;
+        frame->rdtr = CANx->sFIFOMailBox[0].RDTR;
+        frame->rdlr = CANx->sFIFOMailBox[0].RDLR;
+        frame->rdhr = CANx->sFIFOMailBox[0].RDHR;
+        frame->timestamp = now;
+        // Release the mailbox, FMP0 is only updated once this is done
+        WRITE_REG(CANx->RF0R, CAN_RF0R_RFOM0);
+        while (CANx->RF0R & CAN_RF0R_RFOM0);
+        rxq_head++;
+        can_stats.rx_frames++;
+        TRACE_EVENT(TRACE_CAN_RXQ, (uint8_t) (rxq_head - rxq_tail));
+        sched_post(SCHED_CAN_RX);
+    }
+}
+
+/**
+ * Handle the error interrupt, in place of HAL_CAN_IRQHandler().
+ *
+ * Collects the errors in can_handle.ErrorCode like HAL does and passes them
+ * to HAL_CAN_ErrorCallback(). Must be called from CANx_IRQHandler after the TX
+ * and RX handlers.
+ */
+void can_err_irq_handler() {
+    uint32_t ier = CANx->IER;
+    uint32_t esr = CANx->ESR;
+    uint32_t errorcode = HAL_CAN_ERROR_NONE;
+    if (!(ier & CAN_IER_ERRIE)) {
+        return;
+    }
+    if ((esr & CAN_ESR_EWGF) && (ier & CAN_IER_EWGIE)) {
+        errorcode |= HAL_CAN_ERROR_EWG;
+    }
+    if ((esr & CAN_ESR_EPVF) && (ier & CAN_IER_EPVIE)) {
+        errorcode |= HAL_CAN_ERROR_EPV;
+    }
+    if ((esr & CAN_ESR_BOFF) && (ier & CAN_IER_BOFIE)) {
+        errorcode |= HAL_CAN_ERROR_BOF;
+    }
+    if ((esr & CAN_ESR_LEC) && (ier & CAN_IER_LECIE)) {
+        switch ((esr & CAN_ESR_LEC) >> 4) {
+            case 1: errorcode |= HAL_CAN_ERROR_STF; break;
+            case 2: errorcode |= HAL_CAN_ERROR_FOR; break;
+            case 3: errorcode |= HAL_CAN_ERROR_ACK; break;
+            case 4: errorcode |= HAL_CAN_ERROR_BR; break;
+            case 5: errorcode |= HAL_CAN_ERROR_BD; break;
+            case 6: errorcode |= HAL_CAN_ERROR_CRC; break;
+        }
+        // Only the LEC bits are writable
+        CANx->ESR = 0;
+    }
+    if (errorcode != HAL_CAN_ERROR_NONE) {
+        WRITE_REG(CANx->MSR, CAN_MSR_ERRI);
+        can_handle.ErrorCode = errorcode;
+        HAL_CAN_ErrorCallback(&can_handle);
+        can_handle.ErrorCode = HAL_CAN_ERROR_NONE;
+    }
 }
 
 /**
  * Receive data over CAN.
  *
- * @param[in] timeout Time in ms to attempt receive.
- * @return 0 if success
+ * Takes the oldest frame from the RX queue and puts it in can_handle.pRxMsg.
+ *
+ * @param[out] timestamp time in µs the frame arrived, @see timebase_now
+ * @return 0 if success, 1 if no frame was received
  */
-uint8_t can_rx(uint32_t timeout) {
-    return HAL_CAN_Receive(&can_handle, CAN_FIFO0, timeout);
+RAMFUNC uint8_t can_rx(uint32_t *timestamp) {
+    CanRxMsgTypeDef *msg = can_handle.pRxMsg;
+    Can_RxFrameTypeDef *frame;
+    uint32_t primask;
+    uint32_t latency;
+    uint8_t i;
+    if (rxq_tail == rxq_head) {
+        return 1;
+    }
+    frame = &rxq[rxq_tail & (CAN_RX_QUEUE_SIZE - 1)];
+    // CAN_ID_EXT and CAN_RTR_REMOTE are the IDE and RTR bits of RIR
+    msg->IDE = frame->rir & CAN_ID_EXT;
+    if (msg->IDE == CAN_ID_EXT) {
+        msg->ExtId = frame->rir >> 3;
+    } else {
+        msg->StdId = frame->rir >> 21;
+    }
+    msg->RTR = frame->rir & CAN_RTR_REMOTE;
+    msg->DLC = frame->rdtr & 0x0f;
+    msg->FMI = (frame->rdtr >> 8) & 0xff;
+    msg->FIFONumber = CAN_FIFO0;
+    for (i = 0; i < 4; i++) {
+        msg->Data[i] = frame->rdlr >> (8 * i);
+        msg->Data[i + 4] = frame->rdhr >> (8 * i);
+    }
+    *timestamp = frame->timestamp;
+    busload_frame(frame->rir, frame->rdtr, frame->rdlr, frame->rdhr,
+            frame->timestamp);
+    rxq_tail++;
+    TRACE_EVENT(TRACE_CAN_RXQ, (uint8_t) (rxq_head - rxq_tail));
+    latency = timebase_now() - *timestamp;
+    if (latency > can_stats.rx_latency_max) {
+        can_stats.rx_latency_max = latency > 0xffff ? 0xffff : latency;
+    }
+
+    // The interrupt stopped reading the FIFO if the queue was full
+    primask = __get_PRIMASK();
+    __disable_irq();
+    if (enabled) {
+        __HAL_CAN_ENABLE_IT(&can_handle, CAN_IT_FMP0);
+    }
+    __set_PRIMASK(primask);
+    return 0;
 }
 
 /**
- * Check if there are CAN messages pending in receive FIFO.
+ * Check if there are received CAN messages waiting for can_rx().
  *
  * @return Number of messages pending.
  */
@@ -162,11 +661,174 @@ uint8_t can_msg_pending() {
     if (!enabled) {
         return 0;
     } else {
-        return __HAL_CAN_MSG_PENDING(&can_handle, CAN_FIFO0);
+        return rxq_head - rxq_tail;
+    }
+}
+
+/**
+ * Rate limit a protocol error, called from the CAN error interrupt.
+ *
+ * On a bus with the wrong bitrate or termination every frame is an error, the
+ * interrupts would starve everything else. An error identical to the last
+ * reported one within CAN_LEC_COALESCE_INTERVAL is only counted, call
+ * can_lec_flush() first to get those counts reported. More than
+ * CAN_LEC_RATE_MAX errors in CAN_LEC_RATE_WINDOW mask the last error code
+ * interrupt, can_lec_poll() unmasks it again after CAN_LEC_MASK_TIME.
+ *
+ * @param code identifies the error, non-zero
+ * @param now timebase_now() of the error
+ * @return 1 if the error is to be reported, 0 if it was counted
+ */
+uint8_t can_lec_error(uint32_t code, uint32_t now) {
+    busload_error(now);
+    if (now - lec_window > CAN_LEC_RATE_WINDOW) {
+        lec_window = now;
+        lec_window_count = 0;
+    }
+    if (++lec_window_count > CAN_LEC_RATE_MAX && !lec_masked) {
+        CANx->IER &= ~CAN_IER_LECIE;
+        lec_masked = 1;
+        lec_masked_at = now;
+    }
+    if (code == lec_code && now - lec_reported < CAN_LEC_COALESCE_INTERVAL) {
+        if (lec_repeats < 0xffff) {
+            lec_repeats++;
+        }
+        lec_repeated = now;
+        return 0;
+    }
+    lec_code = code;
+    lec_reported = now;
+    return 1;
+}
+
+/**
+ * Take the counted repeats of the last reported protocol error once they are
+ * due, that is when the coalescing interval ended or a different error is
+ * about to be reported.
+ *
+ * Called from the CAN error interrupt before can_lec_error(), or with
+ * interrupts disabled.
+ *
+ * @param code error about to be reported, 0 if none
+ * @param now current time
+ * @param[out] last the repeated error
+ * @param[out] when time of its last repeat
+ * @return number of repeats, 0 if none are due
+ */
+uint16_t can_lec_flush(uint32_t code, uint32_t now, uint32_t *last,
+        uint32_t *when) {
+    uint16_t repeats = lec_repeats;
+    if (!repeats || ((!code || code == lec_code)
+                && now - lec_reported < CAN_LEC_COALESCE_INTERVAL)) {
+        return 0;
+    }
+    *last = lec_code;
+    *when = lec_repeated;
+    lec_repeats = 0;
+    // The next one starts a new interval
+    lec_code = 0;
+    return repeats;
+}
+
+/**
+ * Unmask the last error code interrupt once CAN_LEC_MASK_TIME passed.
+ *
+ * @return 1 while errors are masked or counted, it has to be called again
+ */
+uint8_t can_lec_poll() {
+    uint32_t now = timebase_now();
+    uint8_t busy;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (lec_masked && now - lec_masked_at >= CAN_LEC_MASK_TIME) {
+        lec_masked = 0;
+        lec_window = now;
+        lec_window_count = 0;
+        CANx->IER |= CAN_IER_LECIE;
     }
+    busy = lec_masked || lec_repeats;
+    __set_PRIMASK(primask);
+    return busy;
 }
 
+/**
+ * Recover from bus-off, called from the main loop after error interrupts.
+ *
+ * @see CAN_BUSOFF_RECOVERY. With CAN_BUSOFF_BACKOFF a bus-off is in a row
+ * when no frame was sent since the previous recovery. Calls
+ * can_busoff_recovered_callback() when the controller rejoined the bus.
+ *
+ * @return 1 while recovering, it has to be called again
+ */
+uint8_t can_busoff_poll() {
+    if (CAN_BUSOFF_RECOVERY == CAN_BUSOFF_MANUAL || !enabled) {
+        return 0;
+    }
+    switch (recovery) {
+        case CAN_RECOVERY_IDLE:
+            if (!(CANx->ESR & CAN_ESR_BOFF)) {
+                return 0;
+            }
+            if (CAN_BUSOFF_RECOVERY == CAN_BUSOFF_ABOM) {
+                recovery = CAN_RECOVERY_JOIN;
+                return 1;
+            }
+            if (can_stats.tx_frames != recovery_tx_frames) {
+                recovery_delay = 0;
+            }
+            recovery = CAN_RECOVERY_WAIT;
+            recovery_start = HAL_GetTick();
+            return 1;
+        case CAN_RECOVERY_WAIT:
+            if (HAL_GetTick() - recovery_start < recovery_delay) {
+                return 1;
+            }
+            // Leaving initialization mode starts the recovery sequence
+            CANx->MCR |= CAN_MCR_INRQ;
+            recovery = CAN_RECOVERY_INIT;
+            recovery_start = HAL_GetTick();
+            return 1;
+        case CAN_RECOVERY_INIT:
+            if (!(CANx->MSR & CAN_MSR_INAK)
+                    && HAL_GetTick() - recovery_start <= CAN_MODE_TIMEOUT) {
+                return 1;
+            }
+            CANx->MCR &= ~CAN_MCR_INRQ;
+            recovery = CAN_RECOVERY_JOIN;
+            return 1;
+        case CAN_RECOVERY_JOIN:
+            // The controller doesn't monitor the bus in initialization mode,
+            // the recovery sequence only runs after leaving it
+            if (CANx->ESR & CAN_ESR_BOFF) {
+                return 1;
+            }
+            recovery = CAN_RECOVERY_IDLE;
+            recovery_delay = recovery_delay ? recovery_delay * 2
+                : CAN_BACKOFF_MIN;
+            if (recovery_delay > CAN_BACKOFF_MAX) {
+                recovery_delay = CAN_BACKOFF_MAX;
+            }
+            recovery_tx_frames = can_stats.tx_frames;
+            can_busoff_recovered_callback();
+            return 0;
+        default:
+            return 0;
+    }
+}
+
+/* IER is also written by can_rx_irq_handler(), so it is only changed with
+ * interrupts disabled. */
 static void can_interrupts_enable() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    /* Enable transmit mailbox empty interrupt */
+    __HAL_CAN_ENABLE_IT(&can_handle, CAN_IT_TME);
+
+    /* Enable FIFO0 message pending interrupt */
+    __HAL_CAN_ENABLE_IT(&can_handle, CAN_IT_FMP0);
+
     /* Enable FIFO0 overrun interrupt */
     // TODO not easily handled by HAL
     //__HAL_CAN_ENABLE_IT(&can_handle, CAN_IT_FOV0);
@@ -180,14 +842,32 @@ static void can_interrupts_enable() {
     /* Enable bus-off interrupt */
     __HAL_CAN_ENABLE_IT(&can_handle, CAN_IT_BOF);
 
-    /* Enable last error code interrupt */
-    __HAL_CAN_ENABLE_IT(&can_handle, CAN_IT_LEC);
+    /* Enable last error code interrupt, every bit error fires it so only if
+     * the host asked for them */
+    lec_masked = 0;
+    lec_window_count = 0;
+    lec_code = 0;
+    lec_repeats = 0;
+    if (berr_reporting) {
+        __HAL_CAN_ENABLE_IT(&can_handle, CAN_IT_LEC);
+    }
 
     /* Enable error interrupt */
     __HAL_CAN_ENABLE_IT(&can_handle, CAN_IT_ERR);
+
+    __set_PRIMASK(primask);
 }
 
 static void can_interrupts_disable() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+
+    /* Disable transmit mailbox empty interrupt */
+    __HAL_CAN_DISABLE_IT(&can_handle, CAN_IT_TME);
+
+    /* Disable FIFO0 message pending interrupt */
+    __HAL_CAN_DISABLE_IT(&can_handle, CAN_IT_FMP0);
+
     /* Disable FIFO0 overrun interrupt */
     //__HAL_CAN_ENABLE_IT(&can_handle, CAN_IT_FOV0);
 
@@ -202,7 +882,86 @@ static void can_interrupts_disable() {
 
     /* Disable last error code interrupt */
     __HAL_CAN_DISABLE_IT(&can_handle, CAN_IT_LEC);
+    lec_masked = 0;
+    lec_repeats = 0;
 
     /* Disable error interrupt */
     __HAL_CAN_DISABLE_IT(&can_handle, CAN_IT_ERR);
+
+    __set_PRIMASK(primask);
+}
+
+/* Apply can_handle.Init and the filter, in initialization mode. Same as
+ * HAL_CAN_Init() does, without its busy waiting. */
+static uint8_t can_configure() {
+    CAN_InitTypeDef *init = &can_handle.Init;
+    uint32_t mcr = CANx->MCR & ~(CAN_MCR_TTCM | CAN_MCR_ABOM | CAN_MCR_AWUM
+            | CAN_MCR_NART | CAN_MCR_RFLM | CAN_MCR_TXFP);
+    if (init->TTCM == ENABLE) mcr |= CAN_MCR_TTCM;
+    if (init->ABOM == ENABLE) mcr |= CAN_MCR_ABOM;
+    if (init->AWUM == ENABLE) mcr |= CAN_MCR_AWUM;
+    if (init->NART == ENABLE) mcr |= CAN_MCR_NART;
+    if (init->RFLM == ENABLE) mcr |= CAN_MCR_RFLM;
+    if (init->TXFP == ENABLE) mcr |= CAN_MCR_TXFP;
+    CANx->MCR = mcr;
+    CANx->BTR = init->Mode | init->SJW | init->BS1 | init->BS2
+        | (init->Prescaler - 1);
+    return can_filter();
+}
+
+#ifdef LEAN
+/* Accept every frame into FIFO 0: filter bank 0, 32-bit identifier and mask,
+ * mask 0. @return 0 */
+static uint8_t can_filter() {
+    CANx->FMR |= CAN_FMR_FINIT;
+    CANx->FA1R &= ~CAN_FA1R_FACT0;
+    CANx->FS1R |= CAN_FS1R_FSC0;
+    CANx->FM1R &= ~CAN_FM1R_FBM0;
+    CANx->FFA1R &= ~CAN_FFA1R_FFA0;
+    CANx->sFilterRegister[0].FR1 = 0;
+    CANx->sFilterRegister[0].FR2 = 0;
+    CANx->FA1R |= CAN_FA1R_FACT0;
+    CANx->FMR &= ~CAN_FMR_FINIT;
+    return 0;
+}
+#else
+/* Accept every frame into FIFO 0. @return 0 if OK */
+static uint8_t can_filter() {
+    CAN_FilterConfTypeDef filter;
+    filter.FilterNumber = 0;
+    filter.FilterMode = CAN_FILTERMODE_IDMASK;
+    filter.FilterScale = CAN_FILTERSCALE_32BIT;
+    filter.FilterIdHigh = 0x0000;
+    filter.FilterIdLow = 0x0000;
+    filter.FilterMaskIdHigh = 0x0000;
+    filter.FilterMaskIdLow = 0x0000;
+    filter.FilterFIFOAssignment = CAN_FIFO0;
+    filter.FilterActivation = ENABLE;
+    filter.BankNumber = 14;
+    return HAL_CAN_ConfigFilter(&can_handle, &filter) != HAL_OK;
+}
+#endif
+
+static void can_step(uint8_t next) {
+    step = next;
+    step_start = HAL_GetTick();
+}
+
+static uint8_t can_step_expired() {
+    return HAL_GetTick() - step_start > CAN_MODE_TIMEOUT;
+}
+
+/* Give up opening, leave the controller in reset like a closed one. */
+static uint8_t can_open_fail(uint8_t error) {
+    can_step(CAN_STEP_IDLE);
+    HAL_CAN_MspDeInit(&can_handle);
+    can_handle.State = HAL_CAN_STATE_RESET;
+    return error;
+}
+
+/* End the bitrate detection, the controller is reset. */
+static uint8_t can_autobaud_done(uint8_t error) {
+    can_step(CAN_STEP_IDLE);
+    HAL_CAN_MspDeInit(&can_handle);
+    return error;
 }
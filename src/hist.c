@@ -0,0 +1,53 @@
+/**
+ * Latency histograms.
+ *
+ * Durations measured with the timebase are counted in log2 buckets, that is
+ * enough to see whether frames sit in the adapter for µs or ms and it keeps
+ * the histograms small. Counters saturate instead of wrapping. The host reads
+ * and resets them, @see USB_8DEV_GET_STATISTICS. That happens from the USB
+ * interrupt, so counting is done with interrupts disabled.
+ */
+#include <string.h>
+#include "hist.h"
+#include "stm32f0xx.h"
+
+static uint16_t hists[HIST_COUNT][HIST_BUCKETS];
+
+/**
+ * Count a duration.
+ *
+ * @param[in] hist histogram, HIST_RX_TO_USB etc.
+ * @param[in] us duration in µs
+ */
+void hist_add(uint8_t hist, uint32_t us) {
+    uint8_t bucket = 0;
+    uint32_t primask;
+    // The Cortex-M0 has no CLZ, most durations are short anyway
+    while (us && bucket < HIST_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    primask = __get_PRIMASK();
+    __disable_irq();
+    if (hists[hist][bucket] != 0xffff) {
+        hists[hist][bucket]++;
+    }
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Get a copy of a histogram.
+ *
+ * @param[in] hist histogram, HIST_RX_TO_USB etc.
+ * @param[out] buckets HIST_BUCKETS counters
+ * @param[in] reset clear the histogram after copying it
+ */
+void hist_read(uint8_t hist, uint16_t *buckets, uint8_t reset) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    memcpy(buckets, hists[hist], sizeof(hists[hist]));
+    if (reset) {
+        memset(hists[hist], 0, sizeof(hists[hist]));
+    }
+    __set_PRIMASK(primask);
+}
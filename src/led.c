@@ -3,14 +3,19 @@
 
 #define BLINK_PERIOD    500  /*< Blink period in ms. */
 
+#ifndef LEAN
 TIM_HandleTypeDef tim_handle;
+#endif
 
 static volatile uint8_t blink; /*< Led that is blinking. */
+static uint8_t held; /*< Leds kept on, @see led_hold(). */
 
-static void tim_config();
 static void tim_start();
 static void tim_stop();
+#ifndef LEAN
+static void tim_config();
 static void error_handler();
+#endif
 
 void led_init() {
     // Enable the AHB clock for Port B
@@ -21,20 +26,37 @@ void led_init() {
     GPIOB->MODER = (GPIOB->MODER & ~GPIO_MODER_MODER1) | GPIO_MODER_MODER1_0;
 
     blink = 0;
+    held = 0;
 }
 
+/* The LEDs are set and reset through BSRR and BRR, unlike a read-modify-write
+ * of ODR these only change the given LED. They are written from the blink
+ * interrupt and from USB interrupts (error_handler()). */
 void led_on(uint8_t led) {
     if (blink == led) tim_stop();
-    GPIOB->ODR |= led;
+    GPIOB->BSRR = led;
 }
 
 void led_off(uint8_t led) {
     if (blink == led) tim_stop();
-    GPIOB->ODR &= ~led;
+    GPIOB->BRR = led & ~held;
 }
 
 void led_toggle(uint8_t led) {
-    GPIOB->ODR ^= led;
+    if ((GPIOB->ODR & led) && !(held & led)) {
+        GPIOB->BRR = led;
+    } else {
+        GPIOB->BSRR = led;
+    }
+}
+
+/**
+ * Turn a LED on for good, for a condition that lasts until reset. Turning it
+ * off or blinking it leaves it on.
+ */
+void led_hold(uint8_t led) {
+    held |= led;
+    led_on(led);
 }
 
 void led_blink(uint8_t led) {
@@ -43,6 +65,39 @@ void led_blink(uint8_t led) {
     tim_start();
 }
 
+#ifdef LEAN
+/* TIMx counts ms and overflows every BLINK_PERIOD. */
+static void tim_start() {
+    TIMx_CLK_ENABLE();
+    TIMx->PSC = SystemCoreClock / 1000 - 1;
+    TIMx->ARR = BLINK_PERIOD - 1;
+    // Load the prescaler now instead of at the first overflow, the update
+    // this causes isn't a blink
+    TIMx->EGR = TIM_EGR_UG;
+    TIMx->SR = 0;
+    TIMx->DIER = TIM_DIER_UIE;
+    TIMx->CR1 = TIM_CR1_CEN;
+    NVIC_SetPriority(TIMx_IRQn, 1); // Below CAN and above USB
+    NVIC_EnableIRQ(TIMx_IRQn);
+}
+
+static void tim_stop() {
+    NVIC_DisableIRQ(TIMx_IRQn);
+    TIMx_FORCE_RESET();
+    TIMx_RELEASE_RESET();
+    blink = 0;
+}
+
+/**
+ * Handle the TIMx interrupt, in place of HAL_TIM_IRQHandler().
+ */
+void led_tim_irq_handler() {
+    if (TIMx->SR & TIM_SR_UIF) {
+        TIMx->SR = ~TIM_SR_UIF;
+        led_toggle(blink);
+    }
+}
+#else
 void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim) {
     UNUSED(htim);
     led_toggle(blink);
@@ -72,7 +127,7 @@ static void tim_config() {
     tim_handle.Instance = TIMx;
 
     tim_handle.Init.Period = BLINK_PERIOD - 1;
-    tim_handle.Init.Prescaler = 48000 - 1;
+    tim_handle.Init.Prescaler = SystemCoreClock / 1000 - 1;
     tim_handle.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
     tim_handle.Init.CounterMode = TIM_COUNTERMODE_UP;
     tim_handle.Init.AutoReloadPreload = TIM_AUTORELOAD_PRELOAD_DISABLE;
@@ -84,3 +139,4 @@ static void tim_config() {
 static void error_handler() {
     led_on(LED_RED);
 }
+#endif
@@ -3,38 +3,58 @@
  *
  * Main program
  *
- * The general structure of the program is that interrupt handlers set a flag
- * @see requests.h indicating a request. The main program then checks what has
- * been requested and handles it. For example, when a command to open CAN is
- * received over USB, the interrupt handler sets a flag REQ_CAN_OPEN indicating
- * that the CAN should be started. The main loop then checks these flags, sees
- * a request that CAN should be opened, and opens CAN. There are multiple
- * advantages to this approach.
+ * The general structure of the program is that interrupt handlers post an
+ * event @see sched.h. The main program then runs the handler of each event,
+ * highest priority first. For example, when a command to open CAN is received
+ * over USB, the interrupt handler posts SCHED_CAN_OPEN indicating that the CAN
+ * should be started. The scheduler sees the event and runs its handler, which
+ * opens CAN. There are multiple advantages to this approach.
  *  1. Keeps interrupt service routines short.
- *  2. Clarity since the workings of the whole program are in the main loop as
- *  opposed to being scattered around different interrupt service routines.
- *  3. The main thread schedules when to handle a request instead of each ISR
- *  living a life of its own.
+ *  2. Clarity since the workings of the whole program are in the handlers
+ *  below as opposed to being scattered around different interrupt service
+ *  routines.
+ *  3. The main thread schedules when to handle an event instead of each ISR
+ *  living a life of its own. Received frames are always handled first.
  * Aside from these advantages, there really isn't any other choice since HAL
  * functions can only be called from the main thread since HAL can be locked
  * otherwise.
  *
  * Since FS USB (12Mbit/s) is a lot faster than CAN (max 1Mbit/s), data can be
- * sent to the host over USB at any time. Data can only be received over USB
- * when the previous packet has been handled. This is to prevent the device
- * from being flooded with incoming data. In addition, this guarantees that CAN
- * and USB data won't be corrupted since it will only receive new data once the
- * previous data has been handled.
+ * sent to the host over USB at any time. Data received over USB is put in a
+ * CAN TX queue, and new data is only accepted while the queue has room for
+ * it. This prevents the device from being flooded with incoming data while
+ * still allowing multiple frames to be in flight. The transmit mailboxes are
+ * refilled from the queue by the TX interrupt, the main loop only has to start
+ * transmission when the mailboxes were idle. In the other direction the RX
+ * interrupt moves received frames to a queue with the time they arrived, the
+ * main loop passes them on to USB.
  */
 #include "can.h"
 #include "led.h"
-#include "requests.h"
+#include "sched.h"
 #include "stm32f0xx.h"
+#include "timebase.h"
 #include "usbd.h"
-#include "usbd_8dev_if.h"
 
-void clock_init() {
-    // TODO For robust implementation, add time-out management in while loops
+// Time-outs (in ms) of the clock start-up, SysTick runs from HSI until the
+// system clock is switched
+#define CLOCK_HSE_TIMEOUT   HSE_STARTUP_TIMEOUT
+#define CLOCK_TIMEOUT       10
+
+/* Wait until the masked register equals value. @return 0 if OK, 1 on time-out */
+static uint8_t clock_wait(__IO uint32_t *reg, uint32_t mask, uint32_t value,
+        uint32_t timeout) {
+    uint32_t start = HAL_GetTick();
+    while ((*reg & mask) != value) {
+        if (HAL_GetTick() - start > timeout) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Run from HSE through the PLL. @return 0 if OK */
+static uint8_t clock_init_hse() {
     // Derived from p940 A.3.2 PLL configuration modification code example
 
     // CSS automatically disables HSE (and PLL) and switches to HSI if failure
@@ -42,19 +62,25 @@ void clock_init() {
     // Turn on external crystal
     RCC->CR |= RCC_CR_CSSON | RCC_CR_HSEON;
     // Wait for crystal to be stable
-    while ((RCC->CR & RCC_CR_HSERDY) == 0);
+    if (clock_wait(&RCC->CR, RCC_CR_HSERDY, RCC_CR_HSERDY, CLOCK_HSE_TIMEOUT)) {
+        return 1;
+    }
 
     // Test if PLL is used as System clock
     if ((RCC->CFGR & RCC_CFGR_SWS) == RCC_CFGR_SWS_PLL) {
         // Select HSI as system clock
         RCC->CFGR &= ~RCC_CFGR_SW;
         // Wait for HSI switched
-        while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_HSI);
+        if (clock_wait(&RCC->CFGR, RCC_CFGR_SWS, RCC_CFGR_SWS_HSI, CLOCK_TIMEOUT)) {
+            return 1;
+        }
     }
     // Disable the PLL
     RCC->CR &= ~RCC_CR_PLLON;
     // Wait until PLLRDY is cleared
-    while((RCC->CR & RCC_CR_PLLRDY) != 0);
+    if (clock_wait(&RCC->CR, RCC_CR_PLLRDY, 0, CLOCK_TIMEOUT)) {
+        return 1;
+    }
     // Change the desired parameters
     // Set the PLL multiplier to 3 (48Mhz)
     RCC->CFGR = (RCC->CFGR & (~RCC_CFGR_PLLMUL)) | (RCC_CFGR_PLLMUL3);
@@ -65,78 +91,170 @@ void clock_init() {
     // Enable the PLL
     RCC->CR |= RCC_CR_PLLON;
     // Wait until PLLRDY is set
-    while((RCC->CR & RCC_CR_PLLRDY) == 0);
+    if (clock_wait(&RCC->CR, RCC_CR_PLLRDY, RCC_CR_PLLRDY, CLOCK_TIMEOUT)) {
+        return 1;
+    }
     // Select PLL as system clock
     RCC->CFGR |= RCC_CFGR_SW_PLL;
     // Wait until the PLL is switched on
-    while ((RCC->CFGR & RCC_CFGR_SWS) != RCC_CFGR_SWS_PLL);
+    if (clock_wait(&RCC->CFGR, RCC_CFGR_SWS, RCC_CFGR_SWS_PLL, CLOCK_TIMEOUT)) {
+        return 1;
+    }
+    // Set the USB clock source to PLL
+    RCC->CFGR3 = (RCC->CFGR3 & (~RCC_CFGR3_USBSW)) | (RCC_CFGR3_USBSW_PLLCLK);
+    return 0;
+}
+
+/* Run from the internal 48MHz oscillator, trimmed to USB SOF by the CRS.
+ * @return 0 if OK */
+static uint8_t clock_init_hsi48() {
+    // Back to HSI in case the HSE attempt got as far as selecting the PLL
+    RCC->CFGR &= ~RCC_CFGR_SW;
+    RCC->CR &= ~(RCC_CR_CSSON | RCC_CR_HSEON | RCC_CR_PLLON);
+    RCC->CR2 |= RCC_CR2_HSI48ON;
+    if (clock_wait(&RCC->CR2, RCC_CR2_HSI48RDY, RCC_CR2_HSI48RDY, CLOCK_TIMEOUT)) {
+        return 1;
+    }
+    RCC->CFGR = (RCC->CFGR & ~RCC_CFGR_SW) | RCC_CFGR_SW_HSI48;
+    if (clock_wait(&RCC->CFGR, RCC_CFGR_SWS, RCC_CFGR_SWS_HSI48, CLOCK_TIMEOUT)) {
+        return 1;
+    }
+    RCC->CFGR3 = (RCC->CFGR3 & (~RCC_CFGR3_USBSW)) | (RCC_CFGR3_USBSW_HSI48);
+    // The CRS synchronizes to USB SOF by default
+    RCC->APB1ENR |= RCC_APB1ENR_CRSEN;
+    CRS->CR |= CRS_CR_AUTOTRIMEN | CRS_CR_CEN;
+    return 0;
+}
+
+/**
+ * Set up a 48MHz system clock.
+ *
+ * Uses the crystal if it starts, the internal 48MHz oscillator otherwise.
+ * Every wait has a time-out so a bad crystal can't hang the device.
+ *
+ * SystemCoreClock is updated, SysTick and the timers are set up from it so
+ * they keep time on every clock.
+ *
+ * @return 0 if running from HSE, 1 from HSI48, 2 still from HSI (8MHz), USB
+ * won't work then
+ */
+uint8_t clock_init() {
+    uint8_t source = 0;
+    if (clock_init_hse()) {
+        source = clock_init_hsi48() ? 2 : 1;
+    }
 
     // Set PCLK (APB) to SYSCLK/1
     RCC->CFGR = (RCC->CFGR & (~RCC_CFGR_PPRE)) | (RCC_CFGR_PPRE_DIV1);
     // Set HCLK (AHB) to SYSCLK/1
     RCC->CFGR = (RCC->CFGR & (~RCC_CFGR_HPRE)) | (RCC_CFGR_HPRE_DIV1);
-    // Set the USB clock source to PLL
-    RCC->CFGR3 = (RCC->CFGR3 & (~RCC_CFGR3_USBSW)) | (RCC_CFGR3_USBSW_PLLCLK);
 
-    // Set systick to 1ms (HCLK = PLL = 48MHz)
-    SysTick_Config(48000000/1000);
+    // Set systick to 1ms
+    SystemCoreClockUpdate();
+    SysTick_Config(SystemCoreClock / 1000);
     NVIC_SetPriority(SysTick_IRQn, 0);
+    return source;
+}
+
+/* Pass all received frames on to USB. */
+static void handle_can_rx() {
+    uint32_t timestamp;
+    while (can_rx(&timestamp) == 0) {
+        usbd_transmit_can_frame(timestamp);
+    }
 }
 
+/* Posted again while protocol errors are coalesced or their interrupt is
+ * masked, to report the count and unmask it in time, and while recovering from
+ * bus-off. */
+static void handle_can_err() {
+    uint8_t busy;
+    usbd_transmit_can_error();
+    busy = can_lec_poll();
+    busy |= can_busoff_poll();
+    if (busy) {
+        sched_post(SCHED_CAN_ERR);
+    }
+}
+
+static void handle_can_tx() {
+    can_tx();
+}
+
+static void handle_cmd() {
+    usbd_process_cmds();
+}
+
+/* Open and close take several steps, the event is posted again until they
+ * are done so other events are handled in between. */
+static void handle_can_open() {
+    uint8_t error = can_open();
+    if (error == CAN_BUSY) {
+        sched_post(SCHED_CAN_OPEN);
+        return;
+    }
+    usbd_send_cmd_rsp(error);
+    if (error) {
+        // CAN stays closed, the green LED keeps blinking
+        led_on(LED_RED);
+    } else {
+        led_on(LED_GREEN);
+        led_off(LED_RED);
+    }
+}
+
+static void handle_can_close() {
+    uint8_t error = can_close();
+    if (error == CAN_BUSY) {
+        sched_post(SCHED_CAN_CLOSE);
+        return;
+    }
+    usbd_send_cmd_rsp(error);
+    led_blink(LED_GREEN);
+    led_off(LED_RED);
+}
+
+static void handle_can_autobaud() {
+    uint8_t error = can_autobaud();
+    if (error == CAN_BUSY) {
+        sched_post(SCHED_CAN_AUTOBAUD);
+        return;
+    }
+    usbd_send_cmd_rsp(error);
+}
+
+/* Handlers indexed by event, @see sched.h for the priorities. */
+static const Sched_HandlerTypeDef handlers[SCHED_EVENTS] = {
+    handle_can_rx,
+    handle_can_err,
+    handle_can_tx,
+    handle_cmd,
+    handle_can_open,
+    handle_can_close,
+    handle_can_autobaud
+};
+
 /**
  * Monitors CAN traffic and relays it to USB interface and vise versa.
  *
- * @see usbd_8dev_if.c for more details on how this works.
+ * @see usbd_8dev_if.c or usbd_gs_if.c for more details on how this works.
  */
 int main(void) {
+    uint8_t clock_source;
+
     HAL_Init();
-    clock_init();
+    clock_source = clock_init();
+    timebase_init();
     usb_init();
     can_init();
     led_init();
 
     led_blink(LED_GREEN);
-
-    requests = 0;
-    //TODO 1) make all calls on main thread non blocking, 2) handle CAN errors
-    while (1) {
-        if (requests & REQ_VER) {
-            usbd_8dev_send_cmd_rsp(0);
-            requests &= ~REQ_VER;
-        }
-        if (requests & REQ_CAN_OPEN) {
-            usbd_8dev_send_cmd_rsp(can_open());
-            led_on(LED_GREEN);
-            led_off(LED_RED);
-            requests &= ~REQ_CAN_OPEN;
-        }
-        if (requests & REQ_CAN_CLOSE) {
-            usbd_8dev_send_cmd_rsp(can_close());
-            led_blink(LED_GREEN);
-            led_off(LED_RED);
-            requests &= ~REQ_CAN_CLOSE;
-        }
-        if (requests & REQ_CAN_TX) {
-            if (can_tx(10)) {
-                // Will occur when there is a timeout or there are still
-                // pending messages from last attempt
-                // TODO Maybe add buffer or cancel pending when timeout or
-                // error occurs?
-                //led_on(LED_RED);
-            }
-            usbd_8dev_receive();
-            requests &= ~REQ_CAN_TX;
-        }
-        if (requests & REQ_CAN_ERR) {
-            usbd_8dev_transmit_can_error();
-            requests &= ~REQ_CAN_ERR;
-        }
-        if (can_msg_pending()) {
-            if (can_rx(3)) {
-                led_on(LED_RED);
-            } else {
-                usbd_8dev_transmit_can_frame();
-            }
-        }
+    if (clock_source) {
+        // Running without the crystal, not cleared by a successful open or
+        // close
+        led_hold(LED_RED);
     }
+
+    sched_run(handlers);
 }
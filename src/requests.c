@@ -1,3 +0,0 @@
-#include "requests.h"
-
-volatile uint8_t requests; /*< Flag to set requests that need to be handled. */
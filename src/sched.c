@@ -0,0 +1,62 @@
+/**
+ * Run-to-completion scheduler.
+ *
+ * Interrupt handlers post events, the main thread runs their handlers. Each
+ * event has its own flag so posting is a single store that can't race with
+ * the main thread clearing another event. The flag is cleared before the
+ * handler runs, an event posted while it runs is handled again.
+ *
+ * After every handler the scan starts over at the highest priority, so a
+ * received frame waits for at most one handler to finish. That time is
+ * measured by can_rx() as can_stats.rx_latency_max, the run time of the
+ * handlers in the HIST_HANDLER histogram. When nothing is pending the
+ * CPU sleeps until the next interrupt.
+ *
+ * A handler that waits for hardware posts its own event again and returns.
+ * The scan then continues with the lower priorities instead of starting over,
+ * so a polling handler can't starve them.
+ */
+#include "sched.h"
+#include "hist.h"
+#include "stm32f0xx.h"
+#include "timebase.h"
+#include "trace.h"
+
+volatile uint8_t sched_events[SCHED_EVENTS];
+
+/**
+ * Handle events forever.
+ *
+ * @param[in] handlers handler of each event, indexed by event
+ */
+void sched_run(const Sched_HandlerTypeDef handlers[SCHED_EVENTS]) {
+    uint32_t start;
+    uint8_t event;
+    while (1) {
+        for (event = 0; event < SCHED_EVENTS; event++) {
+            if (sched_events[event]) {
+                sched_events[event] = 0;
+                TRACE_EVENT(TRACE_HANDLER, event);
+                start = timebase_now();
+                handlers[event]();
+                hist_add(HIST_HANDLER, timebase_now() - start);
+                TRACE_EVENT(TRACE_HANDLER | TRACE_END, event);
+                if (!sched_events[event]) {
+                    break;
+                }
+            }
+        }
+        if (event < SCHED_EVENTS) {
+            continue;
+        }
+        // Check again with interrupts masked, an event posted after the scan
+        // would otherwise sleep until the next interrupt. WFI still wakes up
+        // on a pending interrupt, it is taken once they are unmasked.
+        __disable_irq();
+        for (event = 0; event < SCHED_EVENTS && !sched_events[event]; event++);
+        if (event == SCHED_EVENTS) {
+            __WFI();
+        }
+        __enable_irq();
+    }
+}
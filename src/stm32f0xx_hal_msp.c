@@ -1,6 +1,39 @@
 #include "can.h"
 #include "led.h"
 
+#ifdef LEAN
+/* Number of the pin in a GPIO_PIN_x mask. */
+static uint32_t gpio_pin_number(uint32_t pin) {
+    uint32_t n = 0;
+    while (!(pin & (1u << n))) {
+        n++;
+    }
+    return n;
+}
+
+/* Push-pull alternate function with pull-up at high speed, the same as
+ * HAL_GPIO_Init() with GPIO_MODE_AF_PP. */
+static void gpio_init_af(GPIO_TypeDef *port, uint32_t pin, uint32_t af) {
+    uint32_t n = gpio_pin_number(pin);
+    uint32_t afr = 4 * (n & 7);
+    port->AFR[n >> 3] = (port->AFR[n >> 3] & ~(0xfu << afr)) | (af << afr);
+    port->OSPEEDR |= 3u << (2 * n);
+    port->OTYPER &= ~pin;
+    port->PUPDR = (port->PUPDR & ~(3u << (2 * n))) | (1u << (2 * n));
+    port->MODER = (port->MODER & ~(3u << (2 * n))) | (2u << (2 * n));
+}
+
+/* Back to a floating input, the same as HAL_GPIO_DeInit(). */
+static void gpio_deinit(GPIO_TypeDef *port, uint32_t pin) {
+    uint32_t n = gpio_pin_number(pin);
+    port->MODER &= ~(3u << (2 * n));
+    port->AFR[n >> 3] &= ~(0xfu << (4 * (n & 7)));
+    port->OSPEEDR &= ~(3u << (2 * n));
+    port->OTYPER &= ~pin;
+    port->PUPDR &= ~(3u << (2 * n));
+}
+#endif
+
 /**
  * Microcontroller specific CAN initialization.
  *
@@ -8,12 +41,25 @@
  */
 void HAL_CAN_MspInit(CAN_HandleTypeDef *hcan) {
     UNUSED(hcan);
+#ifndef LEAN
     GPIO_InitTypeDef  GPIO_InitStruct;
+#endif
 
     // Enable CANx and GPIO clock
     CANx_CLK_ENABLE();
     CANx_GPIO_CLK_ENABLE();
 
+#ifdef LEAN
+    gpio_init_af(CANx_TX_GPIO_PORT, CANx_TX_PIN, CANx_TX_AF);
+    gpio_init_af(CANx_RX_GPIO_PORT, CANx_RX_PIN, CANx_RX_AF);
+
+    // Enable CANx interrupt, as HAL_NVIC_SetPriority(CANx_IRQn, 0, 0) does.
+    // The M0 has 2 priority bits, 0 is the highest: CAN preempts USB (3), the
+    // FIFO holds only 3 frames
+    NVIC_SetPriority(CANx_IRQn, 0);
+    NVIC_EnableIRQ(CANx_IRQn);
+#else
+
     // Configure CANx TX GPIO pin
     GPIO_InitStruct.Pin = CANx_TX_PIN;
     GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
@@ -32,9 +78,11 @@ void HAL_CAN_MspInit(CAN_HandleTypeDef *hcan) {
 
     HAL_GPIO_Init(CANx_RX_GPIO_PORT, &GPIO_InitStruct);
 
-    // Enable CANx interrupt
-    HAL_NVIC_SetPriority(CANx_IRQn, 4, 0);
+    // Enable CANx interrupt. The M0 has 2 priority bits, 0 is the highest:
+    // CAN preempts USB (3), the FIFO holds only 3 frames
+    HAL_NVIC_SetPriority(CANx_IRQn, 0, 0);
     HAL_NVIC_EnableIRQ(CANx_IRQn);
+#endif
 }
 
 /**
@@ -50,13 +98,22 @@ void HAL_CAN_MspDeInit(CAN_HandleTypeDef *hcan) {
     CANx_RELEASE_RESET();
 
     // Deinitialize CANx GPIO pins
+#ifdef LEAN
+    gpio_deinit(CANx_TX_GPIO_PORT, CANx_TX_PIN);
+    gpio_deinit(CANx_RX_GPIO_PORT, CANx_RX_PIN);
+
+    NVIC_DisableIRQ(CANx_IRQn);
+#else
     HAL_GPIO_DeInit(CANx_TX_GPIO_PORT, CANx_TX_PIN);
     HAL_GPIO_DeInit(CANx_RX_GPIO_PORT, CANx_RX_PIN);
 
     // Disable CANx RX complete interrupt
     HAL_NVIC_DisableIRQ(CANx_IRQn);
+#endif
 }
 
+// The lean build runs the LED timer without HAL, @see led.c
+#ifndef LEAN
 /**
  * Microcontroller specific TIM initialization.
  */
@@ -66,8 +123,8 @@ void HAL_TIM_Base_MspInit(TIM_HandleTypeDef *htim) {
     // Enable TIMx clock
     TIMx_CLK_ENABLE();
 
-    // Enable TIMx interrupt
-    HAL_NVIC_SetPriority(TIMx_IRQn, 5, 0);
+    // Enable TIMx interrupt, below CAN and above USB
+    HAL_NVIC_SetPriority(TIMx_IRQn, 1, 0);
     HAL_NVIC_EnableIRQ(TIMx_IRQn);
 }
 
@@ -85,3 +142,4 @@ void HAL_TIM_Base_MspDeInit(TIM_HandleTypeDef *htim) {
     // Disable TIMx complete interrupt
     HAL_NVIC_DisableIRQ(TIMx_IRQn);
 }
+#endif
@@ -1,9 +1,9 @@
 #include "stm32f0xx_it.h"
 #include "can.h" // Needed for CANx defines
 #include "led.h" // Needed for TIMx defines
+#include "trace.h"
 
 extern PCD_HandleTypeDef hpcd;
-extern CAN_HandleTypeDef can_handle;
 extern TIM_HandleTypeDef tim_handle;
 
 /******************************************************************************
@@ -30,14 +30,27 @@ void SysTick_Handler(void) {
  * Peripherals Interrupt Handlers
  *****************************************************************************/
 
-void USB_IRQHandler(void) {
+RAMFUNC void USB_IRQHandler(void) {
+    TRACE_EVENT(TRACE_USB_IRQ, 0);
     HAL_PCD_IRQHandler(&hpcd);
+    TRACE_EVENT(TRACE_USB_IRQ | TRACE_END, 0);
 }
 
-void CANx_IRQHandler(void) {
-    HAL_CAN_IRQHandler(&can_handle);
+/* HAL_CAN_IRQHandler() isn't called: it would take frames that arrived after
+ * the RX handler and completions after the TX handler for its own transfers,
+ * bypass the queues and turn off FMPIE0 and TMEIE. */
+RAMFUNC void CANx_IRQHandler(void) {
+    TRACE_EVENT(TRACE_CAN_IRQ, 0);
+    can_tx_irq_handler();
+    can_rx_irq_handler();
+    can_err_irq_handler();
+    TRACE_EVENT(TRACE_CAN_IRQ | TRACE_END, 0);
 }
 
 void TIMx_IRQHandler(void) {
+#ifdef LEAN
+    led_tim_irq_handler();
+#else
     HAL_TIM_IRQHandler(&tim_handle);
+#endif
 }
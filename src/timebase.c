@@ -0,0 +1,148 @@
+/**
+ * Microsecond timebase.
+ *
+ * A 32-bit timer counting at 1MHz that is never stopped, used for hardware
+ * timestamps. Reading it is a single register load so it can be used from any
+ * context.
+ *
+ * The crystal is only accurate to some tens of ppm, so the timebase is
+ * disciplined to the USB start-of-frame the host sends every 1ms. At every SOF
+ * the timer is compared to where it should be, and the filtered phase error is
+ * slewed out by at most 1µs per frame. The timer is never stepped while it
+ * follows SOF, timestamps keep increasing. Adapters on the same host see the
+ * same SOFs, so their timebases run at exactly the same rate.
+ *
+ * timebase_reset() makes time 0 the SOF of a given frame number. Issued to
+ * every adapter, the host can line up their timestamps using the returned
+ * frame numbers, and map them to host time through the frame counter of the
+ * host controller.
+ */
+#include "timebase.h"
+
+volatile Timebase_SyncTypeDef timebase_sync;
+
+static uint32_t sof_expected; /*< Time the last SOF should have been seen. */
+static uint16_t sof_frame; /*< Frame number of the last SOF. */
+static int32_t phase_acc; /*< Phase error filter, 16 times the average. */
+static uint8_t outliers; /*< Consecutive SOFs with a large phase error. */
+static int16_t window_slew; /*< µs taken out during the drift window. */
+static uint16_t window_frames; /*< Frames in the drift window so far. */
+static uint8_t window_locked; /*< Phase stayed within the lock limit. */
+static volatile uint8_t reset_armed; /*< Reset the time at the next SOF. */
+static volatile uint16_t reset_frame; /*< Frame number that becomes time 0. */
+
+static void sof_anchor(uint16_t frame, uint32_t now);
+
+/**
+ * Start the timebase, the clock must be set up already.
+ */
+void timebase_init() {
+    TIMEBASE_CLK_ENABLE();
+    // PCLK (HCLK / 1) down to 1MHz
+    TIMEBASE_TIM->PSC = SystemCoreClock / 1000000 - 1;
+    TIMEBASE_TIM->ARR = 0xffffffff;
+    TIMEBASE_TIM->CNT = 0;
+    // The prescaler is only loaded on an update event
+    TIMEBASE_TIM->EGR = TIM_EGR_UG;
+    TIMEBASE_TIM->CR1 = TIM_CR1_CEN;
+    timebase_sync.state = TIMEBASE_FREE_RUNNING;
+}
+
+/**
+ * Discipline the timebase, called from the USB SOF interrupt.
+ *
+ * Nothing else may write the timer while this runs, so it must not be
+ * preempted by code that calls timebase_reset().
+ */
+void timebase_sof() {
+    uint32_t now = TIMEBASE_TIM->CNT;
+    uint16_t frame = USB->FNR & USB_FNR_FN;
+    uint16_t elapsed;
+    int32_t error;
+
+    if (reset_armed) {
+        reset_armed = 0;
+        // Time 0 is the SOF of reset_frame even if that one was missed, keep
+        // the time that passed since this SOF was seen
+        elapsed = (frame - reset_frame) & USB_FNR_FN;
+        TIMEBASE_TIM->CNT = elapsed * 1000 + (TIMEBASE_TIM->CNT - now);
+        sof_anchor(frame, elapsed * 1000);
+        return;
+    }
+    if (timebase_sync.state == TIMEBASE_FREE_RUNNING) {
+        sof_anchor(frame, now);
+        return;
+    }
+
+    // SOFs can be missed, the frame number says how many
+    elapsed = (frame - sof_frame) & USB_FNR_FN;
+    sof_frame = frame;
+    sof_expected += elapsed * 1000;
+    error = (int32_t) (now - sof_expected);
+    if (error > TIMEBASE_OUTLIER_LIMIT || error < -TIMEBASE_OUTLIER_LIMIT) {
+        // A single late SOF is interrupt latency, a run of them means the
+        // frame count was lost (suspend) and the phase has to be found again
+        if (++outliers == TIMEBASE_OUTLIER_MAX) {
+            sof_anchor(frame, now);
+        }
+        return;
+    }
+    outliers = 0;
+
+    phase_acc += error - phase_acc / 16;
+    // Slew at most 1µs per frame, 1000ppm is far more than any crystal is
+    // off. The filter is corrected as well, it would overshoot otherwise.
+    if (phase_acc > 16) {
+        TIMEBASE_TIM->CNT--;
+        phase_acc -= 16;
+        window_slew++;
+    } else if (phase_acc < -16) {
+        TIMEBASE_TIM->CNT++;
+        phase_acc += 16;
+        window_slew--;
+    }
+    timebase_sync.phase = phase_acc / 16;
+    if (timebase_sync.phase > TIMEBASE_LOCK_LIMIT
+            || timebase_sync.phase < -TIMEBASE_LOCK_LIMIT) {
+        window_locked = 0;
+    }
+
+    window_frames += elapsed;
+    if (window_frames >= TIMEBASE_DRIFT_WINDOW) {
+        // µs per ms is ppm/1000
+        timebase_sync.drift = (int32_t) window_slew * 1000 / window_frames;
+        timebase_sync.state = window_locked ? TIMEBASE_LOCKED : TIMEBASE_LOCKING;
+        window_slew = 0;
+        window_frames = 0;
+        window_locked = 1;
+    }
+}
+
+/**
+ * Reset the time to 0 at the next USB SOF.
+ *
+ * @return frame number of the SOF that is time 0
+ */
+uint16_t timebase_reset() {
+    uint16_t frame;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    frame = ((USB->FNR & USB_FNR_FN) + 1) & USB_FNR_FN;
+    reset_frame = frame;
+    reset_armed = 1;
+    __set_PRIMASK(primask);
+    return frame;
+}
+
+/* Follow SOF from here on, with the SOF of frame seen at time now. */
+static void sof_anchor(uint16_t frame, uint32_t now) {
+    sof_frame = frame;
+    sof_expected = now;
+    phase_acc = 0;
+    outliers = 0;
+    window_slew = 0;
+    window_frames = 0;
+    window_locked = 1;
+    timebase_sync.phase = 0;
+    timebase_sync.state = TIMEBASE_LOCKING;
+}
@@ -0,0 +1,78 @@
+/**
+ * Event trace.
+ *
+ * Only built with TRACE defined (make TRACE=1). Interrupt handlers, main loop
+ * handlers and queue operations add a record with the time, the last
+ * TRACE_SIZE records are kept in a ring in RAM. The host reads them with
+ * USB_8DEV_GET_TRACE, tools/trace2chrome.py turns a dump into a Chrome trace
+ * (chrome://tracing or Perfetto) that shows interrupt nesting and queue
+ * depths.
+ *
+ * Recording stops while the host reads the ring so the dump is consistent.
+ */
+#include "trace.h"
+#include "stm32f0xx.h"
+#include "timebase.h"
+
+#ifdef TRACE
+static Trace_RecordTypeDef ring[TRACE_SIZE];
+static uint8_t head; /*< Free running, the next record to write. */
+static uint8_t count; /*< Records in the ring. */
+static volatile uint8_t frozen;
+
+/**
+ * Add a record, safe from any context.
+ *
+ * @param[in] event TRACE_USB_IRQ etc.
+ * @param[in] arg event specific
+ */
+void trace(uint8_t event, uint16_t arg) {
+    Trace_RecordTypeDef *record;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (!frozen) {
+        record = &ring[head++ & (TRACE_SIZE - 1)];
+        record->timestamp = timebase_now();
+        record->arg = arg;
+        record->event = event;
+        if (count < TRACE_SIZE) {
+            count++;
+        }
+    }
+    __set_PRIMASK(primask);
+}
+#endif
+
+/**
+ * Get a record of the trace.
+ *
+ * @param[in] index 0 for the oldest record
+ * @param[out] record copy of the record
+ * @return 0 if OK, 1 if there is no such record or tracing isn't built in
+ */
+uint8_t trace_read(uint8_t index, Trace_RecordTypeDef *record) {
+#ifdef TRACE
+    if (index >= count) {
+        return 1;
+    }
+    *record = ring[(uint8_t) (head - count + index) & (TRACE_SIZE - 1)];
+    return 0;
+#else
+    (void) index;
+    (void) record;
+    return 1;
+#endif
+}
+
+/**
+ * Stop or restart recording.
+ *
+ * @param[in] freeze 1 to stop, 0 to restart
+ */
+void trace_freeze(uint8_t freeze) {
+#ifdef TRACE
+    frozen = freeze;
+#else
+    (void) freeze;
+#endif
+}
@@ -1,6 +1,4 @@
 #include "usbd.h"
-#include "usbd_8dev.h"
-#include "usbd_8dev_if.h"
 #include "usbd_core.h"
 #include "usbd_desc.h"
 
@@ -11,10 +9,16 @@ void usb_init() {
     USBD_Init(&usbd_handle, &usbd_8dev_desc, 0);
 
     // Add Supported Class
+#ifdef USBD_GS_USB
+    USBD_RegisterClass(&usbd_handle, &usbd_gs);
+
+    usbd_gs_registerinterface(&usbd_handle, &usbd_gs_fops);
+#else
     USBD_RegisterClass(&usbd_handle, &usbd_8dev);
 
     // Add CDC Interface Class
     usbd_8dev_registerinterface(&usbd_handle, &usbd_8dev_fops);
+#endif
 
     // Start Device Process
     USBD_Start(&usbd_handle);
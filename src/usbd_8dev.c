@@ -18,6 +18,7 @@
 #include "usbd_desc.h"
 #include "usbd_ctlreq.h"
 #include "usbd_ioreq.h"
+#include "timebase.h"
 
 #define USB_8DEV_CONFIG_DESC_SIZE   46 /*< Length of the configuration descriptor */
 
@@ -37,11 +38,15 @@ typedef struct {
     __IO uint8_t datarxstate;
 } USBD_8DEV_HandleTypeDef;
 
+/* Class data, there is only one device. */
+static USBD_8DEV_HandleTypeDef class_data;
+
 static uint8_t usbd_8dev_init(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
 static uint8_t usbd_8dev_deinit(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
 static uint8_t usbd_8dev_setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
 static uint8_t usbd_8dev_datain(USBD_HandleTypeDef *pdev, uint8_t epnum);
 static uint8_t usbd_8dev_dataout(USBD_HandleTypeDef *pdev, uint8_t epnum);
+static uint8_t usbd_8dev_sof(USBD_HandleTypeDef *pdev);
 static uint8_t *usbd_8dev_getfscfgdesc(uint16_t *length);
 
 /**
@@ -59,7 +64,7 @@ USBD_ClassTypeDef usbd_8dev = {
     /* Class specific endpoints */
     usbd_8dev_datain,
     usbd_8dev_dataout,
-    NULL,                           /* SOF */
+    usbd_8dev_sof,
     NULL,                           /* IsoINIncomplete */
     NULL,                           /* IsoOUTIncomplete */
     NULL,                           /* GetHSConfigDescriptor */
@@ -248,7 +253,7 @@ uint8_t usbd_8dev_receive_data_packet(USBD_HandleTypeDef *pdev) {
 static uint8_t usbd_8dev_init(USBD_HandleTypeDef *pdev, uint8_t cfgidx) {
     UNUSED(cfgidx);
     USBD_8DEV_HandleTypeDef *h8dev;
-    pdev->pClassData = USBD_malloc(sizeof (USBD_8DEV_HandleTypeDef));
+    pdev->pClassData = &class_data;
     if ((h8dev = (USBD_8DEV_HandleTypeDef*) pdev->pClassData)) {
         if (pdev->dev_speed == USBD_SPEED_FULL) {
             USBD_LL_OpenEP(pdev, USBD_8DEV_DATA_IN_EP, USBD_EP_TYPE_BULK,
@@ -287,7 +292,6 @@ static uint8_t usbd_8dev_deinit(USBD_HandleTypeDef *pdev, uint8_t cfgidx) {
     USBD_LL_CloseEP(pdev, USBD_8DEV_CMD_OUT_EP);
     if (pdev->pClassData) {
         ((USBD_8DEV_ItfTypeDef *)pdev->pUserData)->deinit();
-        USBD_free(pdev->pClassData);
         pdev->pClassData = NULL;
     }
     return USBD_OK;
@@ -321,8 +325,12 @@ static uint8_t usbd_8dev_datain(USBD_HandleTypeDef *pdev, uint8_t epnum) {
         /* Data in */
         if ((USBD_8DEV_DATA_IN_EP & 0x0f) == epnum) {
             h8dev->datatxstate = 0;
+            // Start the next packet right away instead of waiting for the
+            // main loop
+            ((USBD_8DEV_ItfTypeDef*) pdev->pUserData)->data_transmitted();
         } else { /* Command in */
             h8dev->cmdtxstate = 0;
+            ((USBD_8DEV_ItfTypeDef*) pdev->pUserData)->cmd_transmitted();
         }
         return USBD_OK;
     } else {
@@ -350,6 +358,14 @@ static uint8_t usbd_8dev_dataout(USBD_HandleTypeDef *pdev, uint8_t epnum) {
     }
 }
 
+/* Callback at every USB start-of-frame (1ms), keeps the timebase in step
+ * with the host. */
+static uint8_t usbd_8dev_sof(USBD_HandleTypeDef *pdev) {
+    UNUSED(pdev);
+    timebase_sof();
+    return USBD_OK;
+}
+
 static uint8_t *usbd_8dev_getfscfgdesc(uint16_t *length) {
     *length = sizeof(usbd_8dev_cfgfsdesc);
     return usbd_8dev_cfgfsdesc;
@@ -8,23 +8,67 @@
  * usbd_8dev.c
  *
  * How it works
- *  Commands are exchanged in @see usb_8dev_cmd_msg format.
+ *  Commands are exchanged in @see usb_8dev_cmd_msg format. Received
+ *  commands are queued and executed in order by the main loop, @see
+ *  usbd_8dev_process_cmds. Replies are queued as well and sent one per
+ *  packet. The host can send up to USB_8DEV_CMD_QUEUE_SIZE commands without
+ *  waiting for their replies, the command OUT endpoint NAKs after that. The
+ *  channel byte of a command is echoed in its reply and can be used as a tag.
+ *
+ *  The get status, statistics, trace and bus load replies are the exception,
+ *  they consist of USB_8DEV_STATUS_PAGES messages in one packet, @see
+ *  status_pack, hist_pack, trace_pack and busload_pack.
  *  Commands:
  *      open: start monitoring the CAN bus and USB. Relay the data between
  *      interfaces
  *      close: disable the can bus
  *      version: send the current hardware and firmware version
+ *      stream format: select the data IN record format (CANalyze extension)
+ *      reset timestamp: make time 0 the next USB SOF, @see timebase.c
+ *      statistics: read (and reset) a latency histogram, @see hist.c
+ *      trace: read the event trace (CANalyze extension), @see trace.c
+ *      auto-baud: detect the bitrate of the bus, in silent mode (CANalyze
+ *      extension), @see can_autobaud and autobaud_pack
+ *      bus load: measure the bus load and count frames by type (CANalyze
+ *      extension), @see busload.c
  *
  *  Data is sent in @see usb_8dev_tx_msg and received in @see usb_8dev_rx_msg
  *  format and mostly consists of a CAN frame and starts/stops once open/close
  *  command is called respectively.
+ *
+ *  Instead of usb_8dev_tx_msg records the host can request the compact stream
+ *  format, @see USB_8DEV_SET_STREAM_FORMAT and compact_encode. A reference
+ *  decoder is in tools/stream_decode.py.
+ *
+ *  With the USB_8DEV_STREAM_SEQ option every record carries an 8 bit sequence
+ *  number that also counts the records dropped because the host wasn't
+ *  reading fast enough. tools/seq_check.py reports the gaps in a capture, with
+ *  the dropped records counter of GET_STATUS it also finds runs of 256.
+ *
+ *  Records carry the time in µs the frame arrived, latched in the CAN RX
+ *  interrupt, @see can_rx_irq_handler.
+ *
+ *  CAN frames and errors for the host are put in a queue of records. Every
+ *  data IN packet carries as many queued records as fit, and the next packet
+ *  is started from the data IN complete interrupt so back-to-back transfers
+ *  don't depend on the main loop, @see usbd_8dev_transmit_queued.
+ *
+ *  Received CAN frames are put in the CAN TX queue @see can_tx_enqueue. The
+ *  data OUT endpoint is re-armed right away as long as the queue has room for
+ *  another frame. When it is full the endpoint NAKs until a frame has been
+ *  moved to a transmit mailbox, @see can_tx_dequeue_callback.
  */
 #include <string.h>
 #include "usbd_8dev_if.h"
 #include "stm32f0xx_hal.h"
 #include "led.h"
+#include "bittiming.h"
+#include "busload.h"
 #include "can.h"
-#include "requests.h"
+#include "hist.h"
+#include "sched.h"
+#include "timebase.h"
+#include "trace.h"
 
 #define FIRMWARE_VER    0x0010  /* bcd v0.1 */
 #define HARDWARE_VER    0x0010  /* bcd v0.1 */
@@ -57,13 +101,47 @@
 #define USB_8DEV_ERROR_STF      0x20    // rx error
 #define USB_8DEV_ERROR_FOR      0x21    // rx error
 #define USB_8DEV_ERROR_ACK      0x23    // tx error
-#define USB_8DEV_ERROR_BR       0x24    // tx error
-#define USB_8DEV_ERROR_BD       0x25    // tx error
+#define USB_8DEV_ERROR_BD       0x24    // tx error, dominant bit not sent
+#define USB_8DEV_ERROR_BR       0x25    // tx error, recessive bit not sent
 #define USB_8DEV_ERROR_CRC      0x27    // rx error
 #define USB_8DEV_ERROR_UNK      0xff
 
-// Needed because 8dev works at 32MHz, and this device at 48MHz
-#define TQ_SCALE    (1.5)       /* 48MHz/32MHz = 1.5 */
+/* Number of data bytes used by an error frame: the error code, the REC in
+ * bits 0-6 with bit 7 set when receive error passive, the TEC and the number
+ * of coalesced errors it stands for */
+#define USB_8DEV_ERROR_DATA_LEN 4
+
+// Data IN stream formats, @see USB_8DEV_SET_STREAM_FORMAT
+#define USB_8DEV_STREAM_8DEV    0       // usb_8dev_tx_msg records
+#define USB_8DEV_STREAM_COMPACT 1       // variable length records
+// Stream options
+#define USB_8DEV_STREAM_XOR     0x01    // XOR payload against previous frame
+#define USB_8DEV_STREAM_SEQ     0x02    // add sequence numbers to records
+
+/* In the 8dev format a CAN frame carries the lower 5 bits of the sequence
+ * number in the unused upper bits of the flags and the upper 3 bits in bits
+ * 4-6 of the DLC, which usb_8dev masks with 0xf. An error frame carries it in
+ * data[7], the driver requires its flags to be exactly USB_8DEV_ERR. */
+#define USB_8DEV_SEQ_SHIFT      3
+#define USB_8DEV_SEQ_DLC_SHIFT  4
+#define USB_8DEV_SEQ_ERR_BYTE   7
+
+// Compact record header flags, the lower 4 bits hold the DLC
+#define COMPACT_EXTID           0x10
+#define COMPACT_RTR             0x20
+#define COMPACT_ERR             0x40
+#define COMPACT_XOR             0x80
+// Header, sequence number, 5 byte delta timestamp, 4 byte ID, XOR mask and 8
+// data bytes
+#define COMPACT_MAX_RECORD_SIZE 20
+
+// Error of the open command when the bitrate can't be made, follows the
+// can_open() errors
+#define USB_8DEV_OPEN_ERR_BITTIMING 4
+
+// Options of the bus load command
+#define USB_8DEV_BUSLOAD_RESET  0x01    /* Clear peak and counters */
+#define USB_8DEV_BUSLOAD_STOP   0x02    /* Stop measuring */
 
 enum usb_8dev_cmd {
     USB_8DEV_RESET = 1,             /* not used */
@@ -71,13 +149,18 @@ enum usb_8dev_cmd {
     USB_8DEV_CLOSE,
     USB_8DEV_SET_SPEED,             /* not used */
     USB_8DEV_SET_MASK_FILTER,       /* not used */
-    USB_8DEV_GET_STATUS,            /* not used */
-    USB_8DEV_GET_STATISTICS,        /* not used */
+    USB_8DEV_GET_STATUS,
+    USB_8DEV_GET_STATISTICS,
     USB_8DEV_GET_SERIAL,            /* not used */
     USB_8DEV_GET_SOFTW_VER,         /* not used */
     USB_8DEV_GET_HARDW_VER,         /* not used */
-    USB_8DEV_RESET_TIMESTAMP,       /* not used */
-    USB_8DEV_GET_SOFTW_HARDW_VER
+    USB_8DEV_RESET_TIMESTAMP,
+    USB_8DEV_GET_SOFTW_HARDW_VER,
+    /* CANalyze extensions, not used by the 8dev device driver */
+    USB_8DEV_SET_STREAM_FORMAT = 0x40,
+    USB_8DEV_GET_TRACE,
+    USB_8DEV_AUTOBAUD,
+    USB_8DEV_GET_BUSLOAD
 };
 
 /* Format of transmitted USB data messages. */
@@ -88,7 +171,7 @@ typedef struct __packed usb_8dev_tx_msg {
     uint32_t id;        // upper 3 bits not used
     uint8_t dlc;        // data length code 0-8 bytes
     uint8_t data[8];    // 64-bit data
-    uint32_t timestamp; // 32-bit timestamp
+    uint32_t timestamp; // 32-bit timestamp in µs
     uint8_t end;        // end of message byte
 } Msg_TxTypeDef;
 
@@ -113,11 +196,71 @@ typedef struct __packed usb_8dev_cmd_msg {
     uint8_t end;         // end of message byte
 } Msg_CmdTypeDef;
 
-static volatile uint8_t usb_8dev_error; /*< Last USB 8dev CAN error. */
+/* CAN error waiting for the main loop. */
+typedef struct can_error {
+    uint32_t timestamp; // timebase_now() when the error was reported
+    uint8_t code;       // USB_8DEV_ERROR_*
+    uint8_t tec;        // transmit error counter at the time
+    uint8_t rec;        // receive error counter at the time
+    uint8_t count;      // occurrences it stands for, saturates
+} Can_ErrorTypeDef;
+
+/* Payload of a previous frame, used for XOR coding in the compact format. */
+typedef struct compact_cache {
+    uint32_t key;       // ID, bit 31 set for extended ID, bit 30 if valid
+    uint8_t data[8];    // data bytes beyond the DLC are 0
+} Compact_CacheTypeDef;
+
+static volatile uint8_t datarx_paused; /*< Data OUT NAKs, TX queue is full. */
+static volatile uint8_t cmdrx_paused; /*< Command OUT NAKs, queues are full. */
+static volatile uint8_t cmdtx_busy; /*< Command IN transfer in progress. */
+static volatile uint8_t cmd_pending; /*< Command is executed by main loop. */
+/* Status counters, @see status_pack */
+static uint32_t datatx_drops; /*< Records dropped, host didn't read them. */
+static uint8_t datatxq_max; /*< High-water mark of the data IN queue. */
+static uint8_t cmdq_max; /*< High-water mark of the command queue. */
+static uint8_t err_drops; /*< CAN errors dropped, the error queue was full. */
+static uint8_t err_state; /*< Error state last queued, USB_8DEV_ERROR_OK etc. */
+static volatile uint8_t datatx_busy; /*< Data IN transfer in progress. */
+
+static uint8_t stream_format; /*< Data IN stream format. */
+static uint8_t stream_options; /*< Data IN stream options. */
 
-Msg_TxTypeDef buf_datatx;// = {USB_8DEV_CMD_START, 0, 0, 0, 0, {0}, 0, USB_8DEV_CMD_END};
+/* Compact format encoder state, the host decoder keeps an identical copy.
+ * Starts from zero whenever the format is selected. */
+static uint32_t compact_timestamp; /*< Timestamp of the previous record. */
+static Compact_CacheTypeDef compact_cache[USB_8DEV_XOR_CACHE_SIZE];
+
+/* Records waiting for the data IN endpoint. The head is only written by the
+ * main thread, the tail only by usbd_8dev_transmit_queued(). */
+static Msg_TxTypeDef datatxq[USB_8DEV_TX_QUEUE_SIZE];
+static uint8_t datatxq_seq[USB_8DEV_TX_QUEUE_SIZE]; /*< Sequence numbers. */
+static volatile uint8_t datatxq_head;
+static volatile uint8_t datatxq_tail;
+static uint8_t datatx_seq; /*< Sequence number of the next record. */
+
+/* CAN errors, the head is only written by HAL_CAN_ErrorCallback() in the CAN
+ * interrupt or with interrupts disabled, the tail only by the main thread. Unlike a single error variable
+ * a burst of errors isn't reduced to the last one. */
+static Can_ErrorTypeDef errq[USB_8DEV_ERR_QUEUE_SIZE];
+static volatile uint8_t errq_head;
+static volatile uint8_t errq_tail;
+
+/* Received commands, the head is only written by the USB interrupt, the tail
+ * only by the main thread. */
+static Msg_CmdTypeDef cmdq[USB_8DEV_CMD_QUEUE_SIZE];
+static volatile uint8_t cmdq_head;
+static volatile uint8_t cmdq_tail;
+/* Replies, the head is only written by the main thread, the tail only by
+ * cmd_transmit_queued(). Commands and replies together never exceed
+ * USB_8DEV_CMD_QUEUE_SIZE so a command always has room for its reply. */
+static Msg_CmdTypeDef cmdrspq[USB_8DEV_CMD_QUEUE_SIZE];
+static volatile uint8_t cmdrspq_head;
+static volatile uint8_t cmdrspq_tail;
+
+uint8_t buf_datatx[USBD_8DEV_DATA_FS_IN_PACKET_SIZE];
 Msg_RxTypeDef buf_datarx;
-Msg_CmdTypeDef buf_cmdtx;// = {USB_8DEV_CMD_START, 0, 0, 0, 0, {0}, USB_8DEV_CMD_END};
+uint8_t buf_cmdtx[USBD_8DEV_CMD_FS_IN_PACKET_SIZE];
 Msg_CmdTypeDef buf_cmdrx;
 
 extern USBD_HandleTypeDef usbd_handle;
@@ -126,6 +269,28 @@ static uint8_t usbd_8dev_itf_init(void);
 static uint8_t usbd_8dev_itf_deinit(void);
 static uint8_t usbd_8dev_itf_rcv_cmd(uint8_t* pbuf, uint8_t *len);
 static uint8_t usbd_8dev_itf_rcv_data(uint8_t* pbuf, uint8_t *len);
+static uint8_t usbd_8dev_itf_data_transmitted(void);
+static uint8_t usbd_8dev_itf_cmd_transmitted(void);
+static uint8_t cmd_room(void);
+static Msg_CmdTypeDef *cmd_rsp_alloc(void);
+static void cmd_rsp_push(void);
+static void cmd_transmit_queued(void);
+static uint8_t status_pack(Msg_CmdTypeDef *rsp);
+static uint8_t hist_pack(Msg_CmdTypeDef *rsp);
+static uint8_t trace_pack(Msg_CmdTypeDef *rsp);
+static uint8_t busload_pack(Msg_CmdTypeDef *rsp);
+static void put_be32(uint8_t *buf, uint32_t val);
+
+static Msg_TxTypeDef *datatxq_alloc(void);
+static void datatxq_push(void);
+static uint8_t pack_8dev(void);
+static uint8_t pack_compact(void);
+static uint8_t compact_encode(Msg_TxTypeDef *msg, uint8_t seq, uint8_t *buf);
+static void compact_commit(Msg_TxTypeDef *msg);
+static void stream_reset(void);
+static void errq_push(uint8_t code, uint32_t timestamp, uint32_t esr,
+        uint16_t count);
+static void autobaud_pack(Msg_CmdTypeDef *rsp);
 
 static void error_handler(void);
 
@@ -138,72 +303,272 @@ USBD_8DEV_ItfTypeDef usbd_8dev_fops = {
     usbd_8dev_itf_init,
     usbd_8dev_itf_deinit,
     usbd_8dev_itf_rcv_cmd,
-    usbd_8dev_itf_rcv_data
+    usbd_8dev_itf_rcv_data,
+    usbd_8dev_itf_data_transmitted,
+    usbd_8dev_itf_cmd_transmitted
 };
 
 /**
- * Send response of a command over USB to host.
+ * Execute the queued commands in order.
+ *
+ * Stops at open and close, those are done by the main loop which then replies
+ * with usbd_8dev_send_cmd_rsp() and continues with the next command.
+ */
+void usbd_8dev_process_cmds() {
+    Can_BitTimingTypeDef can_bittiming;
+    Msg_CmdTypeDef *cmd;
+    Msg_CmdTypeDef *rsp;
+    uint32_t primask;
+    uint16_t frame;
+    while (!cmd_pending && cmdq_tail != cmdq_head) {
+        cmd = &cmdq[cmdq_tail & (USB_8DEV_CMD_QUEUE_SIZE - 1)];
+        switch (cmd->command) {
+            case USB_8DEV_GET_SOFTW_HARDW_VER:
+                rsp = cmd_rsp_alloc();
+                rsp->data[0] = (FIRMWARE_VER & 0xff00) >> 8; // major
+                rsp->data[1] = (FIRMWARE_VER & 0x00f0) >> 4; // minor
+                rsp->data[2] = (HARDWARE_VER & 0xff00) >> 8; // major
+                rsp->data[3] = (HARDWARE_VER & 0x00f0) >> 4; // minor
+                cmd_rsp_push();
+                break;
+            case USB_8DEV_GET_STATUS:
+                // Filled in right before it is sent so it is as recent as
+                // possible
+                cmd_rsp_alloc();
+                cmd_rsp_push();
+                break;
+            case USB_8DEV_GET_STATISTICS:
+                // opt1 is the histogram, opt2 1 to reset it after reading
+                rsp = cmd_rsp_alloc();
+                if (cmd->opt1 >= HIST_COUNT) {
+                    rsp->opt1 = USB_8DEV_CMD_ERROR;
+                } else {
+                    // Read right before it is sent, like the status
+                    rsp->data[0] = cmd->opt1;
+                    rsp->data[1] = cmd->opt2;
+                }
+                cmd_rsp_push();
+                break;
+            case USB_8DEV_GET_TRACE:
+                // opt1 is the first record, opt2 1 to restart recording after
+                // this read. Recording stops until then.
+                trace_freeze(1);
+                rsp = cmd_rsp_alloc();
+                rsp->data[0] = cmd->opt1;
+                rsp->data[1] = cmd->opt2;
+                cmd_rsp_push();
+                break;
+            case USB_8DEV_GET_BUSLOAD:
+                // opt1 is the window in 10ms, 0 to keep it, opt2 the options.
+                // Read right before it is sent, like the status.
+                if (cmd->opt2 & USB_8DEV_BUSLOAD_STOP) {
+                    busload_start(0);
+                } else if (cmd->opt1) {
+                    busload_start(cmd->opt1 * 10);
+                }
+                rsp = cmd_rsp_alloc();
+                rsp->data[0] = cmd->opt2 & USB_8DEV_BUSLOAD_RESET;
+                cmd_rsp_push();
+                break;
+            case USB_8DEV_RESET_TIMESTAMP:
+                // data[0..1] is the frame number of the SOF that is time 0
+                frame = timebase_reset();
+                rsp = cmd_rsp_alloc();
+                rsp->data[0] = frame >> 8;
+                rsp->data[1] = frame;
+                cmd_rsp_push();
+                break;
+            case USB_8DEV_SET_STREAM_FORMAT:
+                // opt1 is the format, opt2 the options
+                if (cmd->opt1 > USB_8DEV_STREAM_COMPACT) {
+                    rsp = cmd_rsp_alloc();
+                    rsp->opt1 = USB_8DEV_CMD_ERROR;
+                    cmd_rsp_push();
+                    break;
+                }
+                // The data IN interrupt uses the stream state
+                primask = __get_PRIMASK();
+                __disable_irq();
+                stream_format = cmd->opt1;
+                stream_options = cmd->opt2;
+                stream_reset();
+                __set_PRIMASK(primask);
+                cmd_rsp_alloc();
+                cmd_rsp_push();
+                break;
+            case USB_8DEV_OPEN:
+                // The bit timing is for the 32MHz clock of the 8dev adapter
+                if (bittiming_from_host(cmd->data[0], cmd->data[1],
+                            cmd->data[2], (cmd->data[3] << 8) | cmd->data[4],
+                            &can_bittiming)) {
+                    rsp = cmd_rsp_alloc();
+                    rsp->opt1 = USB_8DEV_CMD_ERROR;
+                    rsp->data[0] = USB_8DEV_OPEN_ERR_BITTIMING;
+                    cmd_rsp_push();
+                    break;
+                }
+                /*  Ctrl mode is be32 stored in data[5]..data[8], only 1 byte
+                 *  is used. If multiple bytes are used, ctrlmode =
+                 *  bswap((uint32_t) data[5]..data[8])
+                 */
+                // The controller starts error active
+                err_state = USB_8DEV_ERROR_OK;
+                can_open_req(&can_bittiming, cmd->data[8]);
+                cmd_pending = 1;
+                sched_post(SCHED_CAN_OPEN);
+                break;
+            case USB_8DEV_CLOSE:
+                cmd_pending = 1;
+                sched_post(SCHED_CAN_CLOSE);
+                break;
+            case USB_8DEV_AUTOBAUD:
+                // opt1 is the time (in ms) at every bitrate, opt2 2 to try
+                // two sample points. Replies when done.
+                can_autobaud_req(cmd->opt1, cmd->opt2);
+                cmd_pending = 1;
+                sched_post(SCHED_CAN_AUTOBAUD);
+                break;
+            default:
+                rsp = cmd_rsp_alloc();
+                rsp->opt1 = USB_8DEV_CMD_ERROR;
+                cmd_rsp_push();
+                error_handler();
+        }
+    }
+}
+
+/**
+ * Send response of the command executed by the main loop over USB to host.
  *
  * @param[in] error code
  */
 void usbd_8dev_send_cmd_rsp(uint8_t error) {
-    buf_cmdtx.opt1 = error ? USB_8DEV_CMD_ERROR : USB_8DEV_CMD_SUCCESS;
-    if (usbd_8dev_transmit_cmd_packet(&usbd_handle)) {
-        error_handler();
+    Msg_CmdTypeDef *rsp;
+    // CAN is also closed when USB is disconnected, there is no command then
+    if (!cmd_pending) {
+        return;
     }
-    if (usbd_8dev_receive_cmd_packet(&usbd_handle)) {
-        error_handler();
+    rsp = cmd_rsp_alloc();
+    if (error) {
+        rsp->opt1 = USB_8DEV_CMD_ERROR;
+        // Which step failed, @see can_open, can_close and can_autobaud
+        rsp->data[0] = error;
+    } else if (rsp->command == USB_8DEV_AUTOBAUD) {
+        autobaud_pack(rsp);
     }
+    cmd_rsp_push();
+    cmd_pending = 0;
+    // Continue with the commands queued behind it
+    sched_post(SCHED_CMD);
 }
 
 /**
  * Transmit a CAN frame over USB to host.
+ *
+ * @param[in] timestamp time in µs the frame arrived
  */
-void usbd_8dev_transmit_can_frame() {
+RAMFUNC void usbd_8dev_transmit_can_frame(
+        uint32_t timestamp) {
     CanRxMsgTypeDef *buf_canrx = can_handle.pRxMsg;
-    char *tmp_ptr = (char *) buf_canrx->Data;
+    Msg_TxTypeDef *msg = datatxq_alloc();
+    if (!msg) {
+        // Host isn't reading fast enough, drop the frame
+        return;
+    }
      // See http://infocenter.arm.com/help/index.jsp?topic=/com.arm.doc.faqs/ka3934.html
-    buf_datatx.start = USB_8DEV_DATA_START;
-    buf_datatx.type = USB_8DEV_TYPE_CAN_FRAME;
-    buf_datatx.flags = 0; // Default is STD ID.
+    msg->start = USB_8DEV_DATA_START;
+    msg->type = USB_8DEV_TYPE_CAN_FRAME;
+    msg->flags = 0; // Default is STD ID.
     if (buf_canrx->IDE == CAN_ID_EXT) {
-        buf_datatx.flags |= USB_8DEV_EXTID;
-        buf_datatx.id = __builtin_bswap32(buf_canrx->ExtId & 0x1ffffff);
+        msg->flags |= USB_8DEV_EXTID;
+        msg->id = __builtin_bswap32(buf_canrx->ExtId & 0x1fffffff);
     } else {
-        buf_datatx.id = __builtin_bswap32(buf_canrx->StdId & 0x00007ff);
-    }
-    if (buf_canrx->RTR) buf_datatx.flags |= USB_8DEV_RTR;
-    buf_datatx.dlc = buf_canrx->DLC;
-    memcpy(buf_datatx.data, tmp_ptr, buf_canrx->DLC);
-    buf_datatx.timestamp = HAL_GetTick();
-    buf_datatx.end = USB_8DEV_DATA_END;
-    // TODO sometimes USBD is busy due to the previous transmit not being
-    // completed yet. This could be solved using a buffer for all USB tx data
-    // (CAN frames and CAN errors) or a blocking transmit.
-    if (usbd_8dev_transmit_data_packet(&usbd_handle)) {
-        //error_handler();
+        msg->id = __builtin_bswap32(buf_canrx->StdId & 0x00007ff);
     }
+    if (buf_canrx->RTR) msg->flags |= USB_8DEV_RTR;
+    msg->dlc = buf_canrx->DLC;
+    memcpy(msg->data, buf_canrx->Data, sizeof(msg->data));
+    msg->timestamp = timestamp;
+    msg->end = USB_8DEV_DATA_END;
+    datatxq_push();
 }
 
 /**
- * Transmit a CAN error over USB to host.
+ * Transmit the queued CAN errors over USB to host.
  */
 void usbd_8dev_transmit_can_error() {
-    buf_datatx.start = USB_8DEV_DATA_START;
-    buf_datatx.type = USB_8DEV_TYPE_ERROR_FRAME;
-    buf_datatx.flags = USB_8DEV_ERR;
-    buf_datatx.end = USB_8DEV_DATA_END;
+    Can_ErrorTypeDef *err;
+    Msg_TxTypeDef *msg;
+    uint32_t last;
+    uint32_t when;
+    uint16_t repeats;
+    uint32_t primask = __get_PRIMASK();
 
-    buf_datatx.data[0] = usb_8dev_error;
-    // TODO see usbd_8dev_transmit()'s comment
-    if (usbd_8dev_transmit_data_packet(&usbd_handle)) {
-        //error_handler();
+    // Repeats of a protocol error that didn't happen again after the
+    // coalescing interval, with the state after them like in
+    // HAL_CAN_ErrorCallback()
+    __disable_irq();
+    repeats = can_lec_flush(0, timebase_now(), &last, &when);
+    if (repeats) {
+        errq_push(last, when, CANx->ESR, repeats);
+        errq_push(err_state, when, CANx->ESR, 1);
+    }
+    __set_PRIMASK(primask);
+
+    while (errq_tail != errq_head) {
+        err = &errq[errq_tail & (USB_8DEV_ERR_QUEUE_SIZE - 1)];
+        msg = datatxq_alloc();
+        if (msg) {
+            memset(msg, 0, sizeof(*msg));
+            msg->start = USB_8DEV_DATA_START;
+            msg->type = USB_8DEV_TYPE_ERROR_FRAME;
+            msg->flags = USB_8DEV_ERR;
+            msg->data[0] = err->code;
+            // Bit 7 is receive error passive, the driver masks it off the REC
+            msg->data[1] = err->rec > 127 ? 0xff : err->rec;
+            msg->data[2] = err->tec;
+            // usb_8dev ignores this byte
+            msg->data[3] = err->count;
+            msg->timestamp = err->timestamp;
+            msg->end = USB_8DEV_DATA_END;
+            datatxq_push();
+        }
+        // Can't put this in HAL_CAN_ErrorCallback because HAL calls must be
+        // from main thread.
+        if (err->code == USB_8DEV_ERROR_BOF) {
+            led_blink(LED_RED);
+        }
+        errq_tail++;
     }
-    // Can't put this in HAL_CAN_ErrorCallback because HAL calls must be from
-    // main thread.
-    if (usb_8dev_error == USB_8DEV_ERROR_BOF) {
-        led_blink(LED_RED);
+}
+
+/**
+ * Start a data IN transfer with the queued records.
+ *
+ * Packs as many records as fit in one packet. Does nothing if a transfer is
+ * still in progress since it is called again from the data IN complete
+ * interrupt. Can be called from the main thread and from interrupt context.
+ */
+RAMFUNC void usbd_8dev_transmit_queued() {
+    uint8_t len;
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    if (!datatx_busy && datatxq_tail != datatxq_head) {
+        if (stream_format == USB_8DEV_STREAM_COMPACT) {
+            len = pack_compact();
+        } else {
+            len = pack_8dev();
+        }
+        TRACE_EVENT(TRACE_USB_TXQ, (uint8_t) (datatxq_head - datatxq_tail));
+        // Fails when USB isn't configured, the records are lost then but
+        // nobody is listening anyway
+        if (usbd_8dev_set_data_txbuf(&usbd_handle, buf_datatx, len) == USBD_OK
+                && usbd_8dev_transmit_data_packet(&usbd_handle) == USBD_OK) {
+            datatx_busy = 1;
+        }
     }
+    __set_PRIMASK(primask);
 }
 
 /**
@@ -216,151 +581,641 @@ void usbd_8dev_receive() {
 }
 
 static uint8_t usbd_8dev_itf_init(void) {
-    usbd_8dev_set_cmd_txbuf(&usbd_handle, (uint8_t*) &buf_cmdtx, sizeof(Msg_CmdTypeDef));
     usbd_8dev_set_cmd_rxbuf(&usbd_handle, (uint8_t*)  &buf_cmdrx);
-    usbd_8dev_set_data_txbuf(&usbd_handle, (uint8_t*)  &buf_datatx, sizeof(Msg_TxTypeDef));
+    usbd_8dev_set_data_txbuf(&usbd_handle, buf_datatx, 0);
     usbd_8dev_set_data_rxbuf(&usbd_handle, (uint8_t*)  &buf_datarx);
+    datatx_busy = 0;
+    cmdq_tail = cmdq_head;
+    cmdrspq_tail = cmdrspq_head;
+    cmdrx_paused = 0;
+    cmdtx_busy = 0;
+    cmd_pending = 0;
+    stream_format = USB_8DEV_STREAM_8DEV;
+    stream_options = 0;
+    stream_reset();
     return USBD_OK;
 }
 
 static uint8_t usbd_8dev_itf_deinit(void) {
-    requests |= REQ_CAN_CLOSE;
+    sched_post(SCHED_CAN_CLOSE);
     return USBD_OK;
 }
 
 // buf == buf_cmdrx
 static uint8_t usbd_8dev_itf_rcv_cmd(uint8_t* buf, uint8_t *len) {
     UNUSED(buf);
-    Can_BitTimingTypeDef can_bittiming;
     if (*len == sizeof(buf_cmdrx) && buf_cmdrx.start == USB_8DEV_CMD_START && buf_cmdrx.end == USB_8DEV_CMD_END) {
-        buf_cmdtx.start = USB_8DEV_CMD_START;
-        buf_cmdtx.channel = buf_cmdrx.channel;
-        buf_cmdtx.command = buf_cmdrx.command;
-        buf_cmdtx.opt1 = buf_cmdrx.opt1;
-        buf_cmdtx.opt2 = buf_cmdrx.opt2;
-        buf_cmdtx.end = USB_8DEV_CMD_END;
-        switch (buf_cmdrx.command) {
-            case USB_8DEV_GET_SOFTW_HARDW_VER:
-                buf_cmdtx.data[0] = (FIRMWARE_VER & 0xff00) >> 8; // major
-                buf_cmdtx.data[1] = (FIRMWARE_VER & 0x00f0) >> 4; // minor
-                buf_cmdtx.data[2] = (HARDWARE_VER & 0xff00) >> 8; // major
-                buf_cmdtx.data[3] = (HARDWARE_VER & 0x00f0) >> 4; // minor
-                buf_cmdtx.opt1 = USB_8DEV_CMD_SUCCESS;
-                requests |= REQ_VER;
-                break;
-            case USB_8DEV_OPEN:
-                can_bittiming.ts1 = buf_cmdrx.data[0] - 1;
-                can_bittiming.ts2 = buf_cmdrx.data[1] - 1;
-                can_bittiming.sjw = buf_cmdrx.data[2] - 1;
-                can_bittiming.brp = (buf_cmdrx.data[3] << 8) | buf_cmdrx.data[4];
-                can_bittiming.brp *= TQ_SCALE;
-                /*  Ctrl mode is be32 stored in data[5]..data[8], only 1 byte
-                 *  is used. If multiple bytes are used, ctrlmode =
-                 *  bswap((uint32_t) data[5]..data[8])
-                 */
-                can_open_req(&can_bittiming, buf_cmdrx.data[8]);
-                requests |= REQ_CAN_OPEN;
-                break;
-            case USB_8DEV_CLOSE:
-                requests |= REQ_CAN_CLOSE;
-                break;
-            default:
-                error_handler();
+        memcpy(&cmdq[cmdq_head & (USB_8DEV_CMD_QUEUE_SIZE - 1)], &buf_cmdrx,
+                sizeof(buf_cmdrx));
+        cmdq_head++;
+        TRACE_EVENT(TRACE_CMDQ, (uint8_t) (cmdq_head - cmdq_tail));
+        if ((uint8_t) (cmdq_head - cmdq_tail) > cmdq_max) {
+            cmdq_max = cmdq_head - cmdq_tail;
         }
+        sched_post(SCHED_CMD);
     } else {
         error_handler();
     }
+    // Only accept the next command if it has room for its reply
+    if (cmd_room()) {
+        if (usbd_8dev_receive_cmd_packet(&usbd_handle)) {
+            error_handler();
+        }
+    } else {
+        cmdrx_paused = 1;
+    }
     return USBD_OK;
 }
 
 // buf == buf_datarx
 static uint8_t usbd_8dev_itf_rcv_data(uint8_t* buf, uint8_t *len) {
     UNUSED(buf);
-    CanTxMsgTypeDef *buf_cantx = can_handle.pTxMsg;
-    char *tmp_ptr = (char *) buf_datarx.data;
+    CanTxMsgTypeDef buf_cantx;
+    uint32_t primask;
     if (*len == sizeof(buf_datarx) && buf_datarx.start == USB_8DEV_DATA_START && buf_datarx.end == USB_8DEV_DATA_END) {
         // Extended frame format
         if (buf_datarx.flags & USB_8DEV_EXTID) {
-            buf_cantx->IDE = CAN_ID_EXT;
-            buf_cantx->ExtId = __builtin_bswap32(buf_datarx.id) & 0x1fffffff;
+            buf_cantx.IDE = CAN_ID_EXT;
+            buf_cantx.ExtId = __builtin_bswap32(buf_datarx.id) & 0x1fffffff;
         } else { // Base frame format
-            buf_cantx->IDE = CAN_ID_STD;
-            buf_cantx->StdId = __builtin_bswap32(buf_datarx.id) & 0x00007ff;
+            buf_cantx.IDE = CAN_ID_STD;
+            buf_cantx.StdId = __builtin_bswap32(buf_datarx.id) & 0x00007ff;
         }
-        buf_cantx->DLC = buf_datarx.dlc;
-        memcpy(buf_cantx->Data, tmp_ptr, buf_datarx.dlc);
-        requests |= REQ_CAN_TX;
+        buf_cantx.RTR = (buf_datarx.flags & USB_8DEV_RTR) ? CAN_RTR_REMOTE : CAN_RTR_DATA;
+        buf_cantx.DLC = buf_datarx.dlc > 8 ? 8 : buf_datarx.dlc;
+        memcpy(buf_cantx.Data, buf_datarx.data, sizeof(buf_cantx.Data));
+        // Fails when CAN is closed, the frame is dropped like before
+        can_tx_enqueue(&buf_cantx, 0);
+        sched_post(SCHED_CAN_TX);
     } else {
         error_handler();
     }
+    // Only accept the next frame if the TX queue can hold it. Checked and
+    // paused at once, else the CAN TX interrupt could free a slot in between
+    // and not see the pause.
+    primask = __get_PRIMASK();
+    __disable_irq();
+    if (can_tx_free()) {
+        usbd_8dev_receive();
+    } else {
+        datarx_paused = 1;
+    }
+    __set_PRIMASK(primask);
     return USBD_OK;
 }
 
+/**
+ * Re-arm the data OUT endpoint once the TX queue has room again.
+ *
+ * Called from can_tx() in the main thread or the CAN TX interrupt.
+ */
+void can_tx_dequeue_callback() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (datarx_paused && can_tx_free()) {
+        datarx_paused = 0;
+        usbd_8dev_receive();
+    }
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Report the recovery from bus-off as a return to error active.
+ *
+ * Called from can_busoff_poll() in the main thread.
+ */
+void can_busoff_recovered_callback() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    err_state = USB_8DEV_ERROR_OK;
+    errq_push(USB_8DEV_ERROR_OK, timebase_now(), CANx->ESR, 1);
+    __set_PRIMASK(primask);
+    led_off(LED_RED);
+    sched_post(SCHED_CAN_ERR);
+}
+
+RAMFUNC static uint8_t usbd_8dev_itf_data_transmitted(void) {
+    datatx_busy = 0;
+    usbd_8dev_transmit_queued();
+    return USBD_OK;
+}
+
+static uint8_t usbd_8dev_itf_cmd_transmitted(void) {
+    cmdtx_busy = 0;
+    cmd_transmit_queued();
+    return USBD_OK;
+}
+
+/* Whether another command fits, counting the replies that are not sent yet. */
+static uint8_t cmd_room(void) {
+    return (uint8_t) (cmdq_head - cmdq_tail) + (uint8_t) (cmdrspq_head - cmdrspq_tail)
+        < USB_8DEV_CMD_QUEUE_SIZE;
+}
+
+/* Get the reply for the command at the head of the command queue, filled in
+ * as a successful reply to it. */
+static Msg_CmdTypeDef *cmd_rsp_alloc(void) {
+    Msg_CmdTypeDef *rsp = &cmdrspq[cmdrspq_head & (USB_8DEV_CMD_QUEUE_SIZE - 1)];
+    memcpy(rsp, &cmdq[cmdq_tail & (USB_8DEV_CMD_QUEUE_SIZE - 1)], sizeof(*rsp));
+    rsp->opt1 = USB_8DEV_CMD_SUCCESS;
+    return rsp;
+}
+
+/* Queue the reply returned by cmd_rsp_alloc(), remove its command and start
+ * sending it. */
+static void cmd_rsp_push(void) {
+    // Reply first, so the interrupt never sees room that isn't there
+    cmdrspq_head++;
+    cmdq_tail++;
+    TRACE_EVENT(TRACE_CMDQ, (uint8_t) (cmdq_head - cmdq_tail));
+    cmd_transmit_queued();
+}
+
+/* Start a command IN transfer with the next reply. */
+static void cmd_transmit_queued(void) {
+    Msg_CmdTypeDef *rsp;
+    uint8_t len;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (!cmdtx_busy && cmdrspq_tail != cmdrspq_head) {
+        rsp = &cmdrspq[cmdrspq_tail & (USB_8DEV_CMD_QUEUE_SIZE - 1)];
+        if (rsp->command == USB_8DEV_GET_STATUS) {
+            len = status_pack(rsp);
+        } else if (rsp->command == USB_8DEV_GET_STATISTICS
+                && rsp->opt1 == USB_8DEV_CMD_SUCCESS) {
+            len = hist_pack(rsp);
+        } else if (rsp->command == USB_8DEV_GET_TRACE) {
+            len = trace_pack(rsp);
+        } else if (rsp->command == USB_8DEV_GET_BUSLOAD) {
+            len = busload_pack(rsp);
+        } else {
+            memcpy(buf_cmdtx, rsp, sizeof(*rsp));
+            len = sizeof(*rsp);
+        }
+        cmdrspq_tail++;
+        if (cmdrx_paused && cmd_room()) {
+            cmdrx_paused = 0;
+            if (usbd_8dev_receive_cmd_packet(&usbd_handle)) {
+                error_handler();
+            }
+        }
+        // Fails when USB isn't configured, the reply is lost then but nobody
+        // is waiting for it anyway
+        if (usbd_8dev_set_cmd_txbuf(&usbd_handle, buf_cmdtx, len) == USBD_OK
+                && usbd_8dev_transmit_cmd_packet(&usbd_handle) == USBD_OK) {
+            cmdtx_busy = 1;
+        }
+    }
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Fill the command IN buffer with the get status reply.
+ *
+ * Each message is a copy of the reply with the page number in opt2, all
+ * counters are big endian and free running:
+ *  - page 0: data[0] TEC, data[1] REC, data[2] last error code, data[3] error
+ *    state (ESR EWGF, EPVF and BOFF bits), data[4] CAN TX queue, data[5] data
+ *    IN queue and data[6] command queue high-water marks, data[7..8] longest
+ *    time in µs a received frame waited for the main loop
+ *  - page 1: data[0..3] received and data[4..7] sent CAN frames, data[8..9]
+ *    receive FIFO overruns
+ *  - page 2: data[0..3] records dropped because the host didn't read them,
+ *    data[4..5] timebase drift against USB SOF in ppm, data[6] timebase
+ *    state (TIMEBASE_LOCKED etc.), data[7..8] timebase phase error in µs.
+ *    Drift and phase are signed. data[9] CAN errors dropped because the main
+ *    loop didn't report them in time.
+ * Must be called with interrupts disabled so the counters are a snapshot.
+ *
+ * @param[in] rsp reply to the get status command
+ * @return length of the reply
+ */
+static uint8_t status_pack(Msg_CmdTypeDef *rsp) {
+    Msg_CmdTypeDef *page = (Msg_CmdTypeDef*) buf_cmdtx;
+    uint32_t esr = CANx->ESR;
+    uint8_t i;
+    for (i = 0; i < USB_8DEV_STATUS_PAGES; i++) {
+        memcpy(&page[i], rsp, sizeof(*rsp));
+        memset(page[i].data, 0, sizeof(page[i].data));
+        page[i].opt2 = i;
+    }
+    page[0].data[0] = (esr & CAN_ESR_TEC) >> 16;
+    page[0].data[1] = (esr & CAN_ESR_REC) >> 24;
+    page[0].data[2] = (esr & CAN_ESR_LEC) >> 4;
+    page[0].data[3] = esr & (CAN_ESR_EWGF | CAN_ESR_EPVF | CAN_ESR_BOFF);
+    page[0].data[4] = can_stats.txq_max;
+    page[0].data[5] = datatxq_max;
+    page[0].data[6] = cmdq_max;
+    page[0].data[7] = can_stats.rx_latency_max >> 8;
+    page[0].data[8] = can_stats.rx_latency_max;
+    put_be32(&page[1].data[0], can_stats.rx_frames);
+    put_be32(&page[1].data[4], can_stats.tx_frames);
+    page[1].data[8] = can_stats.rx_overruns >> 8;
+    page[1].data[9] = can_stats.rx_overruns;
+    put_be32(&page[2].data[0], datatx_drops);
+    page[2].data[4] = (uint16_t) timebase_sync.drift >> 8;
+    page[2].data[5] = timebase_sync.drift;
+    page[2].data[6] = timebase_sync.state;
+    page[2].data[7] = (uint16_t) timebase_sync.phase >> 8;
+    page[2].data[8] = timebase_sync.phase;
+    page[2].data[9] = err_drops;
+    return USB_8DEV_STATUS_PAGES * sizeof(Msg_CmdTypeDef);
+}
+
+/**
+ * Fill the command IN buffer with the get statistics reply.
+ *
+ * USB_8DEV_STATUS_PAGES copies of the reply with the page number in opt2,
+ * each carrying 5 big endian 16-bit buckets of the histogram, @see hist.h.
+ *
+ * @param[in] rsp reply to the get statistics command, data[0] is the
+ * histogram and data[1] the reset flag
+ * @return length of the reply
+ */
+static uint8_t hist_pack(Msg_CmdTypeDef *rsp) {
+    Msg_CmdTypeDef *page = (Msg_CmdTypeDef*) buf_cmdtx;
+    uint16_t buckets[HIST_BUCKETS];
+    uint8_t i;
+    hist_read(rsp->data[0], buckets, rsp->data[1] == 1);
+    for (i = 0; i < USB_8DEV_STATUS_PAGES; i++) {
+        memcpy(&page[i], rsp, sizeof(*rsp));
+        page[i].opt2 = i;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        page[i / 5].data[2 * (i % 5)] = buckets[i] >> 8;
+        page[i / 5].data[2 * (i % 5) + 1] = buckets[i];
+    }
+    return USB_8DEV_STATUS_PAGES * sizeof(Msg_CmdTypeDef);
+}
+
+/**
+ * Fill the command IN buffer with the get trace reply.
+ *
+ * USB_8DEV_STATUS_PAGES copies of the reply with the page number in opt2, each
+ * carrying a trace record: data[0..3] timestamp, data[4] event and data[5..6]
+ * argument, big endian. Event 0 means there are no more records, tracing
+ * isn't built in if there are none at all, @see trace.c.
+ *
+ * @param[in] rsp reply to the get trace command, data[0] is the first record
+ * and data[1] the restart flag
+ * @return length of the reply
+ */
+static uint8_t trace_pack(Msg_CmdTypeDef *rsp) {
+    Msg_CmdTypeDef *page = (Msg_CmdTypeDef*) buf_cmdtx;
+    Trace_RecordTypeDef record;
+    uint8_t first = rsp->data[0];
+    uint8_t restart = rsp->data[1] == 1;
+    uint8_t i;
+    for (i = 0; i < USB_8DEV_STATUS_PAGES; i++) {
+        memcpy(&page[i], rsp, sizeof(*rsp));
+        memset(page[i].data, 0, sizeof(page[i].data));
+        page[i].opt2 = i;
+        if (trace_read(first + i, &record) == 0) {
+            put_be32(&page[i].data[0], record.timestamp);
+            page[i].data[4] = record.event;
+            page[i].data[5] = record.arg >> 8;
+            page[i].data[6] = record.arg;
+        }
+    }
+    if (restart) {
+        trace_freeze(0);
+    }
+    return USB_8DEV_STATUS_PAGES * sizeof(Msg_CmdTypeDef);
+}
+
+/**
+ * Fill the command IN buffer with the bus load reply.
+ *
+ * USB_8DEV_STATUS_PAGES copies of the reply with the page number in opt2, all
+ * values big endian, @see busload.h:
+ *  - page 0: data[0..1] load of the last complete window and data[2..3] peak
+ *    load in ‰, data[4..5] window in ms (0 if not measuring), data[6..9]
+ *    bitrate
+ *  - page 1: data[0..3] standard and data[4..7] extended data frames
+ *  - page 2: data[0..3] remote and data[4..7] error frames
+ * Frames are counted in both directions and only while measuring.
+ *
+ * @param[in] rsp reply to the bus load command, data[0] is the reset flag
+ * @return length of the reply
+ */
+static uint8_t busload_pack(Msg_CmdTypeDef *rsp) {
+    Msg_CmdTypeDef *page = (Msg_CmdTypeDef*) buf_cmdtx;
+    Busload_StatsTypeDef stats;
+    uint8_t i;
+    busload_read(&stats, rsp->data[0]);
+    for (i = 0; i < USB_8DEV_STATUS_PAGES; i++) {
+        memcpy(&page[i], rsp, sizeof(*rsp));
+        memset(page[i].data, 0, sizeof(page[i].data));
+        page[i].opt2 = i;
+    }
+    page[0].data[0] = stats.load >> 8;
+    page[0].data[1] = stats.load;
+    page[0].data[2] = stats.peak >> 8;
+    page[0].data[3] = stats.peak;
+    page[0].data[4] = stats.window >> 8;
+    page[0].data[5] = stats.window;
+    put_be32(&page[0].data[6], stats.bitrate);
+    put_be32(&page[1].data[0], stats.frames[BUSLOAD_STD]);
+    put_be32(&page[1].data[4], stats.frames[BUSLOAD_EXT]);
+    put_be32(&page[2].data[0], stats.frames[BUSLOAD_RTR]);
+    put_be32(&page[2].data[4], stats.frames[BUSLOAD_ERR]);
+    return USB_8DEV_STATUS_PAGES * sizeof(Msg_CmdTypeDef);
+}
+
+/**
+ * Fill in the reply to USB_8DEV_AUTOBAUD with can_autobaud_result.
+ *
+ * Layout:
+ *  - data[0..4]: bit timing for the 32MHz clock of the 8dev adapter, in the
+ *    layout of the open command so it can be used for it directly: time
+ *    segment 1, time segment 2, SJW, prescaler (big endian)
+ *  - data[5..8]: bitrate in bit/s (big endian)
+ *  - data[9]: frames received at it, saturates
+ *
+ * @param[in,out] rsp reply
+ */
+static void autobaud_pack(Msg_CmdTypeDef *rsp) {
+    Can_AutobaudTypeDef *result = &can_autobaud_result;
+    Can_BitTimingTypeDef bt;
+    if (!bittiming_to_host(result->cycles, result->sample_point, &bt)) {
+        rsp->data[0] = bt.ts1 + 1;
+        rsp->data[1] = bt.ts2 + 1;
+        rsp->data[2] = bt.sjw + 1;
+        rsp->data[3] = bt.brp >> 8;
+        rsp->data[4] = bt.brp;
+    }
+    put_be32(&rsp->data[5], BITTIMING_CAN_CLOCK / result->cycles);
+    rsp->data[9] = result->frames;
+}
+
+static void put_be32(uint8_t *buf, uint32_t val) {
+    buf[0] = val >> 24;
+    buf[1] = val >> 16;
+    buf[2] = val >> 8;
+    buf[3] = val;
+}
+
+/* Get a free record at the head of the data IN queue or NULL if full. */
+RAMFUNC static Msg_TxTypeDef *datatxq_alloc(void) {
+    // Dropped records use up a sequence number too, that's the whole point
+    uint8_t seq = datatx_seq++;
+    if ((uint8_t) (datatxq_head - datatxq_tail) == USB_8DEV_TX_QUEUE_SIZE) {
+        datatx_drops++;
+        return NULL;
+    }
+    datatxq_seq[datatxq_head & (USB_8DEV_TX_QUEUE_SIZE - 1)] = seq;
+    return &datatxq[datatxq_head & (USB_8DEV_TX_QUEUE_SIZE - 1)];
+}
+
+/* Queue the record returned by datatxq_alloc() and start sending it. */
+RAMFUNC static void datatxq_push(void) {
+    datatxq_head++;
+    TRACE_EVENT(TRACE_USB_TXQ, (uint8_t) (datatxq_head - datatxq_tail));
+    if ((uint8_t) (datatxq_head - datatxq_tail) > datatxq_max) {
+        datatxq_max = datatxq_head - datatxq_tail;
+    }
+    usbd_8dev_transmit_queued();
+}
+
+/* Copy usb_8dev_tx_msg records from the queue to the data IN buffer. */
+RAMFUNC static uint8_t pack_8dev(void) {
+    Msg_TxTypeDef *msg;
+    uint8_t seq;
+    uint8_t len = 0;
+    while (datatxq_tail != datatxq_head
+            && len + sizeof(Msg_TxTypeDef) <= USBD_8DEV_DATA_FS_IN_PACKET_SIZE) {
+        msg = (Msg_TxTypeDef*) &buf_datatx[len];
+        memcpy(msg, &datatxq[datatxq_tail & (USB_8DEV_TX_QUEUE_SIZE - 1)],
+                sizeof(Msg_TxTypeDef));
+        hist_add(HIST_RX_TO_USB, timebase_now() - msg->timestamp);
+        if (stream_options & USB_8DEV_STREAM_SEQ) {
+            seq = datatxq_seq[datatxq_tail & (USB_8DEV_TX_QUEUE_SIZE - 1)];
+            if (msg->type == USB_8DEV_TYPE_ERROR_FRAME) {
+                msg->data[USB_8DEV_SEQ_ERR_BYTE] = seq;
+            } else {
+                msg->flags |= seq << USB_8DEV_SEQ_SHIFT;
+                msg->dlc |= (seq >> (8 - USB_8DEV_SEQ_SHIFT))
+                    << USB_8DEV_SEQ_DLC_SHIFT;
+            }
+        }
+        len += sizeof(Msg_TxTypeDef);
+        datatxq_tail++;
+    }
+    return len;
+}
+
+/* Encode queued records in the compact format into the data IN buffer. */
+RAMFUNC static uint8_t pack_compact(void) {
+    uint8_t record[COMPACT_MAX_RECORD_SIZE];
+    Msg_TxTypeDef *msg;
+    uint8_t len = 0;
+    uint8_t n;
+    while (datatxq_tail != datatxq_head) {
+        msg = &datatxq[datatxq_tail & (USB_8DEV_TX_QUEUE_SIZE - 1)];
+        n = compact_encode(msg, datatxq_seq[datatxq_tail & (USB_8DEV_TX_QUEUE_SIZE - 1)],
+                record);
+        // Always send a short packet so each packet ends the transfer and
+        // records never span packets
+        if (len + n >= USBD_8DEV_DATA_FS_IN_PACKET_SIZE) {
+            break;
+        }
+        memcpy(&buf_datatx[len], record, n);
+        hist_add(HIST_RX_TO_USB, timebase_now() - msg->timestamp);
+        compact_commit(msg);
+        len += n;
+        datatxq_tail++;
+    }
+    return len;
+}
+
+/**
+ * Encode a record in the compact stream format.
+ *
+ * A record is:
+ *  - header: DLC in bits 0-3 and the COMPACT_* flags
+ *  - sequence number, only with the USB_8DEV_STREAM_SEQ option
+ *  - timestamp delta to the previous record, unsigned LEB128
+ *  - ID, 2 bytes for a standard and 4 bytes for an extended ID, little endian.
+ *    Not present in error records.
+ *  - payload: DLC data bytes, none for RTR frames. With COMPACT_XOR it is a
+ *    mask byte followed by the non-zero bytes of the payload XORed with the
+ *    previous payload of the same ID, bit n of the mask set if byte n is sent.
+ * Error records have USB_8DEV_ERROR_DATA_LEN as DLC and carry the data bytes
+ * of the usb_8dev_tx_msg error frame.
+ *
+ * Doesn't change the encoder state, @see compact_commit.
+ *
+ * @param[in] msg record to encode
+ * @param[in] seq sequence number of the record
+ * @param[out] buf at least COMPACT_MAX_RECORD_SIZE bytes
+ * @return length of the encoded record
+ */
+RAMFUNC static uint8_t compact_encode(Msg_TxTypeDef *msg, uint8_t seq,
+        uint8_t *buf) {
+    uint32_t delta = msg->timestamp - compact_timestamp;
+    uint32_t id = __builtin_bswap32(msg->id);
+    uint8_t dlc = msg->dlc > 8 ? 8 : msg->dlc;
+    Compact_CacheTypeDef *prev;
+    uint8_t *p = buf + 1;
+    uint8_t *mask;
+    uint8_t i;
+
+    if (msg->type == USB_8DEV_TYPE_ERROR_FRAME) {
+        dlc = USB_8DEV_ERROR_DATA_LEN;
+        buf[0] = COMPACT_ERR | dlc;
+    } else {
+        buf[0] = dlc;
+    }
+    if (stream_options & USB_8DEV_STREAM_SEQ) {
+        *p++ = seq;
+    }
+    while (delta > 0x7f) {
+        *p++ = (delta & 0x7f) | 0x80;
+        delta >>= 7;
+    }
+    *p++ = delta;
+    if (buf[0] & COMPACT_ERR) {
+        memcpy(p, msg->data, dlc);
+        return p + dlc - buf;
+    }
+
+    *p++ = id;
+    *p++ = id >> 8;
+    if (msg->flags & USB_8DEV_EXTID) {
+        buf[0] |= COMPACT_EXTID;
+        *p++ = id >> 16;
+        *p++ = id >> 24;
+    }
+    if (msg->flags & USB_8DEV_RTR) {
+        buf[0] |= COMPACT_RTR;
+        return p - buf;
+    }
+
+    prev = &compact_cache[id & (USB_8DEV_XOR_CACHE_SIZE - 1)];
+    id |= 0x40000000 | ((msg->flags & USB_8DEV_EXTID) ? 0x80000000 : 0);
+    if ((stream_options & USB_8DEV_STREAM_XOR) && prev->key == id) {
+        buf[0] |= COMPACT_XOR;
+        mask = p++;
+        *mask = 0;
+        for (i = 0; i < dlc; i++) {
+            if (msg->data[i] ^ prev->data[i]) {
+                *mask |= 1 << i;
+                *p++ = msg->data[i] ^ prev->data[i];
+            }
+        }
+    } else {
+        memcpy(p, msg->data, dlc);
+        p += dlc;
+    }
+    return p - buf;
+}
+
+/* Update the compact encoder state after a record was put in a packet. */
+RAMFUNC static void compact_commit(Msg_TxTypeDef *msg) {
+    uint32_t id = __builtin_bswap32(msg->id);
+    uint8_t dlc = msg->dlc > 8 ? 8 : msg->dlc;
+    Compact_CacheTypeDef *prev;
+
+    compact_timestamp = msg->timestamp;
+    if (!(stream_options & USB_8DEV_STREAM_XOR) || msg->type == USB_8DEV_TYPE_ERROR_FRAME
+            || (msg->flags & USB_8DEV_RTR)) {
+        return;
+    }
+    prev = &compact_cache[id & (USB_8DEV_XOR_CACHE_SIZE - 1)];
+    prev->key = id | 0x40000000 | ((msg->flags & USB_8DEV_EXTID) ? 0x80000000 : 0);
+    memset(prev->data, 0, sizeof(prev->data));
+    memcpy(prev->data, msg->data, dlc);
+}
+
+/* Reset the compact encoder state, the host decoder does the same. */
+static void stream_reset(void) {
+    datatx_seq = 0;
+    compact_timestamp = 0;
+    memset(compact_cache, 0, sizeof(compact_cache));
+}
+
+/* Queue an error standing for count occurrences with the error counters from
+ * esr. Called from the CAN interrupt or with interrupts disabled. */
+static void errq_push(uint8_t code, uint32_t timestamp, uint32_t esr,
+        uint16_t count) {
+    Can_ErrorTypeDef *err;
+    if ((uint8_t) (errq_head - errq_tail) == USB_8DEV_ERR_QUEUE_SIZE) {
+        err_drops++;
+        return;
+    }
+    err = &errq[errq_head & (USB_8DEV_ERR_QUEUE_SIZE - 1)];
+    err->timestamp = timestamp;
+    err->code = code;
+    err->tec = (esr & CAN_ESR_TEC) >> 16;
+    err->rec = (esr & CAN_ESR_REC) >> 24;
+    err->count = count > 0xff ? 0xff : count;
+    errq_head++;
+}
+
+/**
+ * Queue the errors HAL reported.
+ *
+ * The last error code (LEC) and the error state are separate in the
+ * controller and both can change with one error, so they are queued as
+ * separate records with the same timestamp. HAL reports the warning and
+ * passive flags on every error while they are set, a state record is queued
+ * when the state changed or a protocol error was queued. usb_8dev takes every
+ * protocol error for a move to the warning state, the state record after it
+ * puts the driver back in the real state.
+ *
+ * Repeated protocol errors are coalesced, @see can_lec_error.
+ */
 void HAL_CAN_ErrorCallback(CAN_HandleTypeDef *hcan) {
     uint32_t errorcode = hcan->ErrorCode;
-    /* Multiple errors can happen simultaneously but there is no way to report
-     * this to the device driver. */
-#if 1
-    if (errorcode & HAL_CAN_ERROR_NONE) {
-        usb_8dev_error = USB_8DEV_ERROR_OK;
-    } else if (errorcode & HAL_CAN_ERROR_BOF) {
-        usb_8dev_error = USB_8DEV_ERROR_BOF;
-    } else if (errorcode & HAL_CAN_ERROR_EPV) {
-        usb_8dev_error = USB_8DEV_ERROR_EPV;
-    } else if (errorcode & HAL_CAN_ERROR_EWG) {
-        usb_8dev_error = USB_8DEV_ERROR_EWG;
-    } else if (errorcode & HAL_CAN_ERROR_STF) {
-        usb_8dev_error = USB_8DEV_ERROR_STF;
+    // The LEC was cleared already, the counters and flags are still valid
+    uint32_t esr = hcan->Instance->ESR;
+    uint32_t timestamp = timebase_now();
+    uint32_t last;
+    uint32_t when;
+    uint16_t repeats;
+    uint8_t lec = 0;
+    uint8_t queued = 0;
+    uint8_t state;
+
+    if (errorcode & HAL_CAN_ERROR_STF) {
+        lec = USB_8DEV_ERROR_STF;
     } else if (errorcode & HAL_CAN_ERROR_FOR) {
-        usb_8dev_error = USB_8DEV_ERROR_FOR;
+        lec = USB_8DEV_ERROR_FOR;
     } else if (errorcode & HAL_CAN_ERROR_ACK) {
-        usb_8dev_error = USB_8DEV_ERROR_ACK;
+        lec = USB_8DEV_ERROR_ACK;
     } else if (errorcode & HAL_CAN_ERROR_BR) {
-        usb_8dev_error = USB_8DEV_ERROR_BR;
+        lec = USB_8DEV_ERROR_BR;
     } else if (errorcode & HAL_CAN_ERROR_BD) {
-        usb_8dev_error = USB_8DEV_ERROR_BD;
+        lec = USB_8DEV_ERROR_BD;
     } else if (errorcode & HAL_CAN_ERROR_CRC) {
-        usb_8dev_error = USB_8DEV_ERROR_CRC;
+        lec = USB_8DEV_ERROR_CRC;
     }
-#else
-    switch (errorcode) {
-        case HAL_CAN_ERROR_NONE:
-            usb_8dev_error = USB_8DEV_ERROR_OK;
-            break;
-        case HAL_CAN_ERROR_EWG:
-            usb_8dev_error = USB_8DEV_ERROR_EWG;
-            break;
-        case HAL_CAN_ERROR_EPV:
-            usb_8dev_error = USB_8DEV_ERROR_EPV;
-            break;
-        case HAL_CAN_ERROR_BOF:
-            usb_8dev_error = USB_8DEV_ERROR_BOF;
-            break;
-        case HAL_CAN_ERROR_STF:
-            usb_8dev_error = USB_8DEV_ERROR_STF;
-            break;
-        case HAL_CAN_ERROR_FOR:
-            usb_8dev_error = USB_8DEV_ERROR_FOR;
-            break;
-        case HAL_CAN_ERROR_ACK:
-            usb_8dev_error = USB_8DEV_ERROR_ACK;
-            break;
-        case HAL_CAN_ERROR_BR:
-            usb_8dev_error = USB_8DEV_ERROR_BR;
-            break;
-        case HAL_CAN_ERROR_BD:
-            usb_8dev_error = USB_8DEV_ERROR_BD;
-            break;
-        case HAL_CAN_ERROR_CRC:
-            usb_8dev_error = USB_8DEV_ERROR_CRC;
-            break;
-        default:
-            // Occurs when multiple errors happen simultaneously
-            //usb_8dev_error = USB_8DEV_ERROR_UNK;
-            usb_8dev_error = errorcode;
+    if (lec) {
+        repeats = can_lec_flush(lec, timestamp, &last, &when);
+        if (repeats) {
+            errq_push(last, when, esr, repeats);
+            queued = 1;
+        }
+        if (can_lec_error(lec, timestamp)) {
+            errq_push(lec, timestamp, esr, 1);
+            queued = 1;
+        }
+    }
+
+    if (esr & CAN_ESR_BOFF) {
+        state = USB_8DEV_ERROR_BOF;
+    } else if (esr & CAN_ESR_EPVF) {
+        state = USB_8DEV_ERROR_EPV;
+    } else if (esr & CAN_ESR_EWGF) {
+        state = USB_8DEV_ERROR_EWG;
+    } else {
+        state = USB_8DEV_ERROR_OK;
+    }
+    if (state != err_state || queued) {
+        err_state = state;
+        errq_push(state, timestamp, esr, 1);
     }
-#endif
-    requests |= REQ_CAN_ERR;
+    sched_post(SCHED_CAN_ERR);
 }
 
 static void error_handler(void) {
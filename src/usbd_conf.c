@@ -1,6 +1,10 @@
 #include "stm32f0xx_hal.h"
 #include "usbd_core.h"
+#ifdef USBD_GS_USB
+#include "usbd_gs.h"
+#else
 #include "usbd_8dev.h"
+#endif
 
 PCD_HandleTypeDef hpcd;
 
@@ -36,11 +40,14 @@ void HAL_PCD_MspDeInit(PCD_HandleTypeDef *hpcd) {
     __HAL_RCC_USB_CLK_DISABLE();
 }
 
+static uint8_t stall_status; /*< Stall the next EP0 status stage, @see USBD_LL_StallStatus */
+
 /******************************************************************************
  * LL Driver Callbacks (PCD -> USB Device Library)
  *****************************************************************************/
 
 void HAL_PCD_SetupStageCallback(PCD_HandleTypeDef *hpcd) {
+    stall_status = 0;
     USBD_LL_SetupStage((USBD_HandleTypeDef*)hpcd->pData, (uint8_t *)hpcd->Setup);
 }
 
@@ -96,6 +103,8 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev) {
     hpcd.Init.ep0_mps = 0x40;
     hpcd.Init.phy_itface = PCD_PHY_EMBEDDED;
     hpcd.Init.speed = PCD_SPEED_FULL;
+    // SOF disciplines the timebase
+    hpcd.Init.Sof_enable = ENABLE;
     hpcd.Init.low_power_enable = DISABLE;
     hpcd.Init.battery_charging_enable = DISABLE;
     /* Link The driver to the stack */
@@ -105,12 +114,19 @@ USBD_StatusTypeDef USBD_LL_Init(USBD_HandleTypeDef *pdev) {
     HAL_PCD_Init(&hpcd);
 
     // Why start at 0x18?
+#ifdef USBD_GS_USB
+    HAL_PCDEx_PMAConfig(pdev->pData, 0x00, PCD_SNG_BUF, 0x40+0*USBD_GS_FS_MAX_PACKET_SIZE);
+    HAL_PCDEx_PMAConfig(pdev->pData, 0x80, PCD_SNG_BUF, 0x40+1*USBD_GS_FS_MAX_PACKET_SIZE);
+    HAL_PCDEx_PMAConfig(pdev->pData, USBD_GS_DATA_IN_EP, PCD_SNG_BUF, 0x40+2*USBD_GS_FS_MAX_PACKET_SIZE);
+    HAL_PCDEx_PMAConfig(pdev->pData, USBD_GS_DATA_OUT_EP, PCD_SNG_BUF, 0x40+3*USBD_GS_FS_MAX_PACKET_SIZE);
+#else
     HAL_PCDEx_PMAConfig(pdev->pData, 0x00, PCD_SNG_BUF, 0x40+0*USBD_8DEV_FS_MAX_PACKET_SIZE);
     HAL_PCDEx_PMAConfig(pdev->pData, 0x80, PCD_SNG_BUF, 0x40+1*USBD_8DEV_FS_MAX_PACKET_SIZE);
     HAL_PCDEx_PMAConfig(pdev->pData, USBD_8DEV_DATA_IN_EP, PCD_SNG_BUF, 0x40+2*USBD_8DEV_FS_MAX_PACKET_SIZE);
     HAL_PCDEx_PMAConfig(pdev->pData, USBD_8DEV_DATA_OUT_EP, PCD_SNG_BUF, 0x40+3*USBD_8DEV_FS_MAX_PACKET_SIZE);
     HAL_PCDEx_PMAConfig(pdev->pData, USBD_8DEV_CMD_IN_EP, PCD_SNG_BUF, 0x40+4*USBD_8DEV_FS_MAX_PACKET_SIZE);
     HAL_PCDEx_PMAConfig(pdev->pData, USBD_8DEV_CMD_OUT_EP, PCD_SNG_BUF, 0x40+5*USBD_8DEV_FS_MAX_PACKET_SIZE);
+#endif
 
     return USBD_OK;
 }
@@ -188,8 +204,27 @@ USBD_StatusTypeDef USBD_LL_SetUSBAddress(USBD_HandleTypeDef *pdev, uint8_t dev_a
     return USBD_OK;
 }
 
+/**
+ * Stall the status stage of the current control write.
+ *
+ * The core sends the status stage right after the class has handled the data
+ * stage, which would clear a stall set there. Instead the status stage is
+ * turned into the stall.
+ *
+ * @param  pdev: Device handle
+ */
+void USBD_LL_StallStatus(USBD_HandleTypeDef *pdev) {
+    UNUSED(pdev);
+    stall_status = 1;
+}
+
 USBD_StatusTypeDef USBD_LL_Transmit(USBD_HandleTypeDef *pdev, uint8_t ep_addr,
         uint8_t *pbuf, uint16_t size) {
+    if (ep_addr == 0x00 && size == 0 && stall_status) {
+        stall_status = 0;
+        HAL_PCD_EP_SetStall((PCD_HandleTypeDef*)pdev->pData, 0x80);
+        return USBD_OK;
+    }
     HAL_PCD_EP_Transmit((PCD_HandleTypeDef*)pdev->pData, ep_addr, pbuf, size);
     return USBD_OK;
 }
@@ -213,13 +248,3 @@ uint32_t USBD_LL_GetRxDataSize(USBD_HandleTypeDef *pdev, uint8_t ep_addr) {
 void USBD_LL_Delay(uint32_t Delay) {
     HAL_Delay(Delay);
 }
-
-void *USBD_static_malloc(uint32_t size) {
-    UNUSED(size);
-    static uint32_t mem[MAX_STATIC_ALLOC_SIZE];
-    return mem;
-}
-
-void USBD_static_free(void *p) {
-    UNUSED(p);
-}
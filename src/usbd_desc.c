@@ -49,14 +49,22 @@
 #include "usbd_core.h"
 #include "usbd_desc.h"
 #include "usbd_conf.h"
+#include "config.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
+#ifdef USBD_GS_USB
+/* IDs of the gs_usb (candleLight) device the Linux gs_usb driver binds to */
+#define USBD_VID                        0x1d50
+#define USBD_PID                        0x606f
+#define USBD_PRODUCT_FS_STRING          "CANalyze gs_usb"
+#else
 #define USBD_VID                        0x0483
 #define USBD_PID                        0x1234
+#define USBD_PRODUCT_FS_STRING          "USB2CAN converter"
+#endif
 #define USBD_LANGID_STRING              0x0409
 #define USBD_MANUFACTURER_STRING        "STMicroelectronics"
-#define USBD_PRODUCT_FS_STRING          "USB2CAN converter"
 #define USBD_CONFIGURATION_FS_STRING    "CDC Config"
 #define USBD_INTERFACE_FS_STRING        "CDC Interface"
 
@@ -123,6 +131,13 @@ uint8_t USBD_StringSerial[USB_SIZ_STRING_SERIAL] =
 
 uint8_t USBD_StrDesc[USBD_MAX_STR_DESC_SIZ];
 
+/* A string descriptor takes 2 bytes per character and a 2 byte header */
+#define USBD_STR_FITS(s)    (2 * sizeof(s) <= USBD_MAX_STR_DESC_SIZ)
+CONFIG_ASSERT(product_string, USBD_STR_FITS(USBD_PRODUCT_FS_STRING));
+CONFIG_ASSERT(manufacturer_string, USBD_STR_FITS(USBD_MANUFACTURER_STRING));
+CONFIG_ASSERT(config_string, USBD_STR_FITS(USBD_CONFIGURATION_FS_STRING));
+CONFIG_ASSERT(interface_string, USBD_STR_FITS(USBD_INTERFACE_FS_STRING));
+
 /* Private functions ---------------------------------------------------------*/
 static void IntToUnicode (uint32_t value , uint8_t *pbuf , uint8_t len);
 static void Get_SerialNum(void);
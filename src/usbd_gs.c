@@ -0,0 +1,313 @@
+/**
+ * Set up USB configuration for the gs_usb personality.
+ *
+ * Responsible for setting up USB class configuration such as the configuration
+ * descriptor, endpoints, etc according to the Linux gs_usb device driver
+ * (https://github.com/torvalds/linux/blob/master/drivers/net/can/usb/gs_usb.c)
+ * When a relevant action occurs, a callback is done via a USBD_GS_ItfTypeDef
+ * interface. This does not handle protocol specifics, for this @see
+ * usbd_gs_if.c
+ *
+ * There are 2 endpoints (in addition to the default EP0)
+ *  - EP1-IN, bulk, send frames and TX echoes
+ *  - EP2-OUT, bulk, receive frames
+ * Configuration is done with vendor requests to the interface on EP0.
+ */
+#include "usbd_gs.h"
+#include "usbd_desc.h"
+#include "usbd_ctlreq.h"
+#include "usbd_ioreq.h"
+#include "timebase.h"
+
+#define USB_GS_CONFIG_DESC_SIZE     32 /*< Length of the configuration descriptor */
+
+typedef struct {
+    uint8_t *buf_datarx;
+    uint8_t *buf_datatx;
+    uint8_t buf_datarxlen;
+    uint8_t buf_datatxlen;
+
+    uint8_t ctrlbuf[USBD_GS_CTRL_BUF_SIZE]; /*< Vendor request data stage */
+    uint8_t ctrlreq;    /*< Vendor request waiting for its data stage */
+    uint16_t ctrllen;
+
+    __IO uint8_t datatxstate;
+} USBD_GS_HandleTypeDef;
+
+/* Class data, there is only one device. */
+static USBD_GS_HandleTypeDef class_data;
+
+static uint8_t usbd_gs_init(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
+static uint8_t usbd_gs_deinit(USBD_HandleTypeDef *pdev, uint8_t cfgidx);
+static uint8_t usbd_gs_setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req);
+static uint8_t usbd_gs_ep0_rxready(USBD_HandleTypeDef *pdev);
+static uint8_t usbd_gs_datain(USBD_HandleTypeDef *pdev, uint8_t epnum);
+static uint8_t usbd_gs_dataout(USBD_HandleTypeDef *pdev, uint8_t epnum);
+static uint8_t usbd_gs_sof(USBD_HandleTypeDef *pdev);
+static uint8_t *usbd_gs_getfscfgdesc(uint16_t *length);
+
+/**
+ * USB class callbacks.
+ *
+ * Callbacks from USB core to implement custom classes.
+ */
+USBD_ClassTypeDef usbd_gs = {
+    usbd_gs_init,
+    usbd_gs_deinit,
+    usbd_gs_setup,
+    /* Control endpoints */
+    NULL,                           /* EP0_TxSent, */
+    usbd_gs_ep0_rxready,
+    /* Class specific endpoints */
+    usbd_gs_datain,
+    usbd_gs_dataout,
+    usbd_gs_sof,
+    NULL,                           /* IsoINIncomplete */
+    NULL,                           /* IsoOUTIncomplete */
+    NULL,                           /* GetHSConfigDescriptor */
+    usbd_gs_getfscfgdesc,
+    NULL,                           /* GetOtherSpeedConfigDescriptor */
+    NULL,                           /* GetDeviceQualifierDescriptor */
+};
+
+__ALIGN_BEGIN uint8_t usbd_gs_cfgfsdesc[USB_GS_CONFIG_DESC_SIZE] __ALIGN_END = {
+    /* Configuration descriptor */
+    USB_LEN_CFG_DESC,               /* bLength */
+    USB_DESC_TYPE_CONFIGURATION,    /* bDescriptorType */
+    USB_GS_CONFIG_DESC_SIZE,        /* wTotalLength */
+    0x00,                           /* wTotalLength */
+    0x01,                           /* bNumInterfaces */
+    0x01,                           /* bConfigurationValue */
+    0x00,                           /* iConfiguration */
+    0x00,                           /* bmAttributes */
+    0x32,                           /* MaxPower: 100mA */
+
+    /* Interface descriptor */
+    USB_LEN_IF_DESC,                /* bLength */
+    USB_DESC_TYPE_INTERFACE,        /* bDescriptorType */
+    0x00,                           /* bInterfaceNumber */
+    0x00,                           /* bAlternateSetting */
+    0x02,                           /* bNumEndpoints */
+    0xff,                           /* bInterfaceClass: vendor specific */
+    0xff,                           /* bInterfaceSubClass: vendor specific  */
+    0xff,                           /* bInterfaceProtocol: vendor specific */
+    0x00,                           /* iInterface: */
+
+    /* Endpoint 1 descriptor: data IN */
+    USB_LEN_EP_DESC,                /* bLength */
+    USB_DESC_TYPE_ENDPOINT,         /* bDescriptorType */
+    USBD_GS_DATA_IN_EP,             /* bEndpointAddress */
+    USBD_EP_TYPE_BULK,              /* bmAttributes */
+    LOBYTE(USBD_GS_DATA_FS_IN_PACKET_SIZE),     /* wMaxPacketSize */
+    HIBYTE(USBD_GS_DATA_FS_IN_PACKET_SIZE),     /* wMaxPacketSize */
+    0x00,                           /* bInterval */
+
+    /* Endpoint 2 descriptor: data OUT */
+    USB_LEN_EP_DESC,                /* bLength */
+    USB_DESC_TYPE_ENDPOINT,         /* bDescriptorType */
+    USBD_GS_DATA_OUT_EP,            /* bEndpointAddress */
+    USBD_EP_TYPE_BULK,              /* bmAttributes */
+    LOBYTE(USBD_GS_DATA_FS_OUT_PACKET_SIZE),    /* wMaxPacketSize: */
+    HIBYTE(USBD_GS_DATA_FS_OUT_PACKET_SIZE),    /* wMaxPacketSize: */
+    0x00,                           /* bInterval: */
+};
+
+uint8_t usbd_gs_registerinterface(USBD_HandleTypeDef *pdev, USBD_GS_ItfTypeDef *fops) {
+    if (fops) {
+        pdev->pUserData = fops;
+        return USBD_OK;
+    } else {
+        return USBD_FAIL;
+    }
+}
+
+uint8_t usbd_gs_set_data_txbuf(USBD_HandleTypeDef *pdev, uint8_t *pbuff, uint16_t len) {
+    USBD_GS_HandleTypeDef *hgs;
+    if ((hgs = (USBD_GS_HandleTypeDef*) pdev->pClassData)) {
+        hgs->buf_datatx = pbuff;
+        hgs->buf_datatxlen = len;
+        return USBD_OK;
+    } else {
+        return USBD_FAIL;
+    }
+}
+
+uint8_t usbd_gs_set_data_rxbuf(USBD_HandleTypeDef *pdev, uint8_t *pbuff) {
+    USBD_GS_HandleTypeDef *hgs;
+    if ((hgs = (USBD_GS_HandleTypeDef*) pdev->pClassData)) {
+        hgs->buf_datarx = pbuff;
+        return USBD_OK;
+    } else {
+        return USBD_FAIL;
+    }
+}
+
+uint8_t usbd_gs_transmit_data_packet(USBD_HandleTypeDef *pdev) {
+    USBD_GS_HandleTypeDef *hgs;
+    if ((hgs = (USBD_GS_HandleTypeDef*) pdev->pClassData)) {
+        if (hgs->datatxstate == 0) {
+            /* Tx Transfer in progress */
+            hgs->datatxstate = 1;
+            USBD_LL_Transmit(pdev, USBD_GS_DATA_IN_EP, hgs->buf_datatx,
+                    hgs->buf_datatxlen);
+            return USBD_OK;
+        }
+        else {
+            return USBD_BUSY;
+        }
+    }
+    else {
+        return USBD_FAIL;
+    }
+}
+
+uint8_t usbd_gs_receive_data_packet(USBD_HandleTypeDef *pdev) {
+    USBD_GS_HandleTypeDef *hgs;
+    if ((hgs = (USBD_GS_HandleTypeDef*) pdev->pClassData)) {
+        if (pdev->dev_speed == USBD_SPEED_FULL) {
+            USBD_LL_PrepareReceive(pdev, USBD_GS_DATA_OUT_EP,
+                    hgs->buf_datarx, USBD_GS_DATA_FS_OUT_PACKET_SIZE);
+        }
+        return USBD_OK;
+    }
+    else {
+        return USBD_FAIL;
+    }
+}
+
+/* Callback for class initialization */
+static uint8_t usbd_gs_init(USBD_HandleTypeDef *pdev, uint8_t cfgidx) {
+    UNUSED(cfgidx);
+    USBD_GS_HandleTypeDef *hgs;
+    pdev->pClassData = &class_data;
+    if ((hgs = (USBD_GS_HandleTypeDef*) pdev->pClassData)) {
+        if (pdev->dev_speed == USBD_SPEED_FULL) {
+            USBD_LL_OpenEP(pdev, USBD_GS_DATA_IN_EP, USBD_EP_TYPE_BULK,
+                    USBD_GS_DATA_FS_IN_PACKET_SIZE);
+            USBD_LL_OpenEP(pdev, USBD_GS_DATA_OUT_EP, USBD_EP_TYPE_BULK,
+                    USBD_GS_DATA_FS_OUT_PACKET_SIZE);
+
+            ((USBD_GS_ItfTypeDef *)pdev->pUserData)->init();
+
+            hgs->datatxstate = 0;
+
+            USBD_LL_PrepareReceive(pdev, USBD_GS_DATA_OUT_EP,
+                    hgs->buf_datarx, USBD_GS_DATA_FS_OUT_PACKET_SIZE);
+        }
+        return USBD_OK;
+    } else {
+        return USBD_FAIL;
+    }
+}
+
+/* Callback for class deinitialization */
+static uint8_t usbd_gs_deinit(USBD_HandleTypeDef *pdev, uint8_t cfgidx) {
+    UNUSED(cfgidx);
+    USBD_LL_CloseEP(pdev, USBD_GS_DATA_IN_EP);
+    USBD_LL_CloseEP(pdev, USBD_GS_DATA_OUT_EP);
+    if (pdev->pClassData) {
+        ((USBD_GS_ItfTypeDef *)pdev->pUserData)->deinit();
+        pdev->pClassData = NULL;
+    }
+    return USBD_OK;
+}
+
+/* Callback for when setup commands are received on EP0 */
+static uint8_t usbd_gs_setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req) {
+    static uint8_t ifalt = 0;
+    USBD_GS_HandleTypeDef *hgs = (USBD_GS_HandleTypeDef*) pdev->pClassData;
+    uint16_t len;
+    switch (req->bmRequest & USB_REQ_TYPE_MASK) {
+        case USB_REQ_TYPE_VENDOR:
+            if (!hgs || req->wLength > sizeof(hgs->ctrlbuf)) {
+                USBD_CtlError(pdev, req);
+                return USBD_FAIL;
+            }
+            if (req->bmRequest & 0x80) { /* Device to host */
+                len = ((USBD_GS_ItfTypeDef*) pdev->pUserData)->control_in(
+                    req->bRequest, hgs->ctrlbuf, req->wLength);
+                if (len == 0) {
+                    USBD_CtlError(pdev, req);
+                    return USBD_FAIL;
+                }
+                USBD_CtlSendData(pdev, hgs->ctrlbuf, len);
+            } else if (req->wLength) { /* Host to device, @see usbd_gs_ep0_rxready */
+                hgs->ctrlreq = req->bRequest;
+                hgs->ctrllen = req->wLength;
+                USBD_CtlPrepareRx(pdev, hgs->ctrlbuf, req->wLength);
+            } else if (((USBD_GS_ItfTypeDef*) pdev->pUserData)->control_out(
+                    req->bRequest, hgs->ctrlbuf, 0) != USBD_OK) {
+                USBD_CtlError(pdev, req);
+                return USBD_FAIL;
+            }
+            break;
+        case USB_REQ_TYPE_STANDARD:
+            switch (req->bRequest) {
+                case USB_REQ_GET_INTERFACE:
+                    USBD_CtlSendData(pdev, &ifalt, 1);
+                    break;
+                case USB_REQ_SET_INTERFACE:
+                default:
+                    break;
+            }
+            break;
+        default:
+            break;
+    }
+    return USBD_OK;
+}
+
+/* Callback when the data stage of a host to device request has been received. */
+static uint8_t usbd_gs_ep0_rxready(USBD_HandleTypeDef *pdev) {
+    USBD_GS_HandleTypeDef *hgs;
+    if ((hgs = (USBD_GS_HandleTypeDef*) pdev->pClassData)) {
+        // The core sends the status stage after this returns, whatever the
+        // result, so it has to be turned into a stall
+        if (((USBD_GS_ItfTypeDef*) pdev->pUserData)->control_out(hgs->ctrlreq,
+                hgs->ctrlbuf, hgs->ctrllen) != USBD_OK) {
+            USBD_LL_StallStatus(pdev);
+        }
+        return USBD_OK;
+    } else {
+        return USBD_FAIL;
+    }
+}
+
+/* Callback when data sent to EP<epnum>-IN has been completed. */
+static uint8_t usbd_gs_datain(USBD_HandleTypeDef *pdev, uint8_t epnum) {
+    USBD_GS_HandleTypeDef *hgs;
+    UNUSED(epnum);
+    if ((hgs = (USBD_GS_HandleTypeDef*) pdev->pClassData)) {
+        hgs->datatxstate = 0;
+        ((USBD_GS_ItfTypeDef*) pdev->pUserData)->data_transmitted();
+        return USBD_OK;
+    } else {
+        return USBD_FAIL;
+    }
+}
+
+/* Callback when data received on EP<epnum>-OUT has been completed. */
+static uint8_t usbd_gs_dataout(USBD_HandleTypeDef *pdev, uint8_t epnum) {
+    USBD_GS_HandleTypeDef *hgs;
+    if ((hgs = (USBD_GS_HandleTypeDef*) pdev->pClassData)) {
+        hgs->buf_datarxlen = USBD_LL_GetRxDataSize(pdev, epnum);
+        ((USBD_GS_ItfTypeDef*) pdev->pUserData)->receive_data(
+            hgs->buf_datarx, &hgs->buf_datarxlen);
+        return USBD_OK;
+    } else {
+        return USBD_FAIL;
+    }
+}
+
+/* Callback at every USB start-of-frame (1ms), keeps the timebase in step
+ * with the host. */
+static uint8_t usbd_gs_sof(USBD_HandleTypeDef *pdev) {
+    UNUSED(pdev);
+    timebase_sof();
+    return USBD_OK;
+}
+
+static uint8_t *usbd_gs_getfscfgdesc(uint16_t *length) {
+    *length = sizeof(usbd_gs_cfgfsdesc);
+    return usbd_gs_cfgfsdesc;
+}
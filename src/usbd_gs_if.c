@@ -0,0 +1,654 @@
+/**
+ * Handle gs_usb device driver protocol.
+ *
+ * Alternative to usbd_8dev_if.c, selected at build time with
+ * PERSONALITY=gs_usb. Makes the device work with the Linux gs_usb driver
+ * (candleLight) on the same CAN core. All USB communication is piped through
+ * @see usbd_gs.c
+ *
+ * How it works
+ *  The device is configured with vendor requests on EP0:
+ *      host format: byte order check, the device is little endian anyway
+ *      bit timing: prop seg, phase segs, sjw and brp for the next start
+ *      mode: start or reset CAN, with the listen only, loop back, one shot and
+ *      hardware timestamp flags
+ *      bit timing constants, device config: capabilities of the device
+ *      timestamp: current value of the µs timebase
+ *
+ *  Frames are exchanged in @see gs_host_frame format, one frame per
+ *  transfer. Frames from the host carry an echo ID. Once a frame left its
+ *  transmit mailbox it is echoed back with the same echo ID, the host has up
+ *  to 10 frames in flight this way instead of waiting for a round trip per
+ *  frame. Received frames have echo ID GS_ECHO_ID_RX.
+ *
+ *  With the hardware timestamp flag every frame to the host carries the time
+ *  in µs it was received or sent, @see timebase.c
+ *
+ *  Like in the 8dev personality the data OUT endpoint is only re-armed while
+ *  the CAN TX queue has room, @see can_tx_dequeue_callback.
+ */
+#include <string.h>
+#include "usbd_gs_if.h"
+#include "stm32f0xx_hal.h"
+#include "led.h"
+#include "can.h"
+#include "hist.h"
+#include "sched.h"
+#include "timebase.h"
+#include "trace.h"
+
+#define FIRMWARE_VER    0x0010  /* bcd v0.1 */
+#define HARDWARE_VER    0x0010  /* bcd v0.1 */
+
+#define GS_HOST_FORMAT          0x0000beef
+#define GS_ECHO_ID_RX           0xffffffff
+
+// Device mode
+#define GS_CAN_MODE_RESET       0
+#define GS_CAN_MODE_START       1
+
+// Device mode flags and features
+#define GS_CAN_MODE_LISTEN_ONLY     0x01
+#define GS_CAN_MODE_LOOP_BACK       0x02
+#define GS_CAN_MODE_TRIPLE_SAMPLE   0x04    /* not supported */
+#define GS_CAN_MODE_ONE_SHOT        0x08
+#define GS_CAN_MODE_HW_TIMESTAMP    0x10
+#define GS_CAN_MODE_BERR_REPORTING  0x1000
+
+#define GS_CAN_FEATURES     (GS_CAN_MODE_LISTEN_ONLY | GS_CAN_MODE_LOOP_BACK \
+        | GS_CAN_MODE_ONE_SHOT | GS_CAN_MODE_HW_TIMESTAMP \
+        | GS_CAN_MODE_BERR_REPORTING)
+
+// gs_host_frame flags
+#define GS_CAN_FLAG_OVERFLOW    0x01
+
+// can_id flags, @see linux/can.h
+#define CAN_EFF_FLAG            0x80000000
+#define CAN_RTR_FLAG            0x40000000
+#define CAN_ERR_FLAG            0x20000000
+
+// Error frames, @see linux/can/error.h
+#define CAN_ERR_DLC             8
+#define CAN_ERR_CRTL            0x00000004
+#define CAN_ERR_PROT            0x00000008
+#define CAN_ERR_ACK             0x00000020
+#define CAN_ERR_BUSOFF          0x00000040
+#define CAN_ERR_RESTARTED       0x00000100
+#define CAN_ERR_CNT             0x00000200
+// data[1]
+#define CAN_ERR_CRTL_RX_WARNING 0x04
+#define CAN_ERR_CRTL_TX_WARNING 0x08
+#define CAN_ERR_CRTL_RX_PASSIVE 0x10
+#define CAN_ERR_CRTL_TX_PASSIVE 0x20
+// data[2]
+#define CAN_ERR_PROT_FORM       0x02
+#define CAN_ERR_PROT_STUFF      0x04
+#define CAN_ERR_PROT_BIT0       0x08
+#define CAN_ERR_PROT_BIT1       0x10
+// data[3]
+#define CAN_ERR_PROT_LOC_CRC_SEQ 0x08
+
+// HAL errors from the last error code
+#define GS_CAN_ERROR_LEC    (HAL_CAN_ERROR_STF | HAL_CAN_ERROR_FOR \
+        | HAL_CAN_ERROR_ACK | HAL_CAN_ERROR_BR | HAL_CAN_ERROR_BD \
+        | HAL_CAN_ERROR_CRC)
+// Not a HAL error, the controller recovered from bus-off
+#define GS_CAN_ERROR_RESTARTED  0x80000000
+
+// bxCAN bit timing limits, CAN is clocked from PCLK
+#define GS_FCLK_CAN     48000000
+
+enum gs_usb_breq {
+    GS_USB_BREQ_HOST_FORMAT = 0,
+    GS_USB_BREQ_BITTIMING,
+    GS_USB_BREQ_MODE,
+    GS_USB_BREQ_BERR,               /* not used */
+    GS_USB_BREQ_BT_CONST,
+    GS_USB_BREQ_DEVICE_CONFIG,
+    GS_USB_BREQ_TIMESTAMP,
+    GS_USB_BREQ_IDENTIFY            /* not used */
+};
+
+/* Format of frames in both directions, all fields little endian. */
+typedef struct __packed gs_host_frame {
+    uint32_t echo_id;       // GS_ECHO_ID_RX for received frames
+    uint32_t can_id;        // ID and CAN_*_FLAG
+    uint8_t can_dlc;        // data length code 0-8 bytes
+    uint8_t channel;        // always 0
+    uint8_t flags;          // GS_CAN_FLAG_*
+    uint8_t reserved;
+    uint8_t data[8];        // 64-bit data
+    uint32_t timestamp_us;  // only sent in hardware timestamp mode
+} Gs_HostFrameTypeDef;
+
+// Frame size without the timestamp, the host always sends this size
+#define GS_HOST_FRAME_SIZE  (sizeof(Gs_HostFrameTypeDef) - sizeof(uint32_t))
+
+typedef struct __packed gs_device_bittiming {
+    uint32_t prop_seg;
+    uint32_t phase_seg1;
+    uint32_t phase_seg2;
+    uint32_t sjw;
+    uint32_t brp;
+} Gs_BitTimingTypeDef;
+
+typedef struct __packed gs_device_mode {
+    uint32_t mode;      // GS_CAN_MODE_RESET or GS_CAN_MODE_START
+    uint32_t flags;     // GS_CAN_MODE_* flags
+} Gs_ModeTypeDef;
+
+typedef struct __packed gs_device_config {
+    uint8_t reserved1;
+    uint8_t reserved2;
+    uint8_t reserved3;
+    uint8_t icount;     // number of CAN channels - 1
+    uint32_t sw_version;
+    uint32_t hw_version;
+} Gs_DeviceConfigTypeDef;
+
+typedef struct __packed gs_device_bt_const {
+    uint32_t feature;
+    uint32_t fclk_can;
+    uint32_t tseg1_min;
+    uint32_t tseg1_max;
+    uint32_t tseg2_min;
+    uint32_t tseg2_max;
+    uint32_t sjw_max;
+    uint32_t brp_min;
+    uint32_t brp_max;
+    uint32_t brp_inc;
+} Gs_BtConstTypeDef;
+
+/* TX echo waiting for the data IN endpoint. */
+typedef struct gs_echo {
+    uint32_t echo_id;
+    uint32_t timestamp;
+} Gs_EchoTypeDef;
+
+static const Gs_BtConstTypeDef gs_bt_const = {
+    GS_CAN_FEATURES,
+    GS_FCLK_CAN,
+    1, 16,      // tseg1
+    1, 8,       // tseg2
+    4,          // sjw
+    1, 1024, 1  // brp
+};
+
+static volatile uint32_t can_errorcode; /*< HAL errors since the last report. */
+static volatile uint8_t datarx_paused; /*< Data OUT NAKs, TX queue is full. */
+static volatile uint8_t datatx_busy; /*< Data IN transfer in progress. */
+static uint8_t datatx_overflow; /*< A received frame was dropped. */
+static uint8_t hw_timestamp; /*< Send timestamps, set when CAN is started. */
+static Can_BitTimingTypeDef can_bittiming;
+static uint8_t can_bittiming_set; /*< can_bittiming holds a timing from the host. */
+
+/* Received frames and errors waiting for the data IN endpoint. The head is
+ * only written by the main thread, the tail only by usbd_gs_transmit_queued().
+ */
+static Gs_HostFrameTypeDef datatxq[USB_GS_TX_QUEUE_SIZE];
+static volatile uint8_t datatxq_head;
+static volatile uint8_t datatxq_tail;
+/* TX echoes, the head is only written by the CAN TX interrupt. Echoes are sent
+ * before received frames and never dropped, the host stalls once it ran out
+ * of echo IDs. */
+static Gs_EchoTypeDef echoq[USB_GS_ECHO_QUEUE_SIZE];
+static volatile uint8_t echoq_head;
+static volatile uint8_t echoq_tail;
+
+Gs_HostFrameTypeDef buf_datatx;
+uint8_t buf_datarx[USBD_GS_DATA_FS_OUT_PACKET_SIZE];
+
+extern USBD_HandleTypeDef usbd_handle;
+
+static uint8_t usbd_gs_itf_init(void);
+static uint8_t usbd_gs_itf_deinit(void);
+static uint8_t usbd_gs_itf_control_out(uint8_t request, uint8_t *pbuf, uint16_t len);
+static uint16_t usbd_gs_itf_control_in(uint8_t request, uint8_t *pbuf, uint16_t len);
+static uint8_t usbd_gs_itf_rcv_data(uint8_t* pbuf, uint8_t *len);
+static uint8_t usbd_gs_itf_data_transmitted(void);
+static uint8_t bittiming_in_range(const Gs_BitTimingTypeDef *bt);
+static Gs_HostFrameTypeDef *datatxq_alloc(void);
+static void datatxq_push(void);
+static void error_handler(void);
+
+/**
+ * USB gs_usb class callbacks.
+ *
+ * Callback from gs_usb class for protocol specifics.
+ */
+USBD_GS_ItfTypeDef usbd_gs_fops = {
+    usbd_gs_itf_init,
+    usbd_gs_itf_deinit,
+    usbd_gs_itf_control_out,
+    usbd_gs_itf_control_in,
+    usbd_gs_itf_rcv_data,
+    usbd_gs_itf_data_transmitted
+};
+
+/**
+ * Report the result of opening or closing CAN.
+ *
+ * gs_usb has no command responses, the control request was already
+ * acknowledged. Only indicate the failure.
+ *
+ * @param[in] error code
+ */
+void usbd_gs_send_cmd_rsp(uint8_t error) {
+    if (error) {
+        error_handler();
+    }
+}
+
+/**
+ * Transmit a CAN frame over USB to host.
+ *
+ * @param[in] timestamp time in µs the frame arrived
+ */
+RAMFUNC void usbd_gs_transmit_can_frame(uint32_t timestamp) {
+    CanRxMsgTypeDef *buf_canrx = can_handle.pRxMsg;
+    Gs_HostFrameTypeDef *hf = datatxq_alloc();
+    if (!hf) {
+        // Host isn't reading fast enough, drop the frame
+        return;
+    }
+    hf->echo_id = GS_ECHO_ID_RX;
+    if (buf_canrx->IDE == CAN_ID_EXT) {
+        hf->can_id = (buf_canrx->ExtId & 0x1fffffff) | CAN_EFF_FLAG;
+    } else {
+        hf->can_id = buf_canrx->StdId & 0x00007ff;
+    }
+    if (buf_canrx->RTR) hf->can_id |= CAN_RTR_FLAG;
+    hf->can_dlc = buf_canrx->DLC;
+    memcpy(hf->data, buf_canrx->Data, sizeof(hf->data));
+    hf->timestamp_us = timestamp;
+    datatxq_push();
+}
+
+/**
+ * Transmit a CAN error over USB to host as a SocketCAN error frame.
+ */
+void usbd_gs_transmit_can_error() {
+    Gs_HostFrameTypeDef *hf;
+    uint32_t errorcode;
+    uint32_t esr = CANx->ESR;
+    uint8_t tec = (esr & CAN_ESR_TEC) >> 16;
+    uint8_t rec = (esr & CAN_ESR_REC) >> 24;
+    uint32_t last;
+    uint32_t when;
+    uint32_t primask = __get_PRIMASK();
+
+    __disable_irq();
+    errorcode = can_errorcode;
+    can_errorcode = 0;
+    // A protocol error that repeated within the coalescing interval is
+    // reported once more when the interval ended
+    if (can_lec_flush(0, timebase_now(), &last, &when)) {
+        errorcode |= last;
+    }
+    __set_PRIMASK(primask);
+    // Called again while the error interrupts are rate limited
+    if (!errorcode) {
+        return;
+    }
+
+    // Can't put this in HAL_CAN_ErrorCallback because HAL calls must be from
+    // main thread.
+    if (errorcode & HAL_CAN_ERROR_BOF) {
+        led_blink(LED_RED);
+    }
+
+    if (!(hf = datatxq_alloc())) {
+        return;
+    }
+    memset(hf->data, 0, sizeof(hf->data));
+    hf->echo_id = GS_ECHO_ID_RX;
+    hf->can_id = CAN_ERR_FLAG | CAN_ERR_CNT;
+    hf->can_dlc = CAN_ERR_DLC;
+    if (errorcode & HAL_CAN_ERROR_BOF) {
+        hf->can_id |= CAN_ERR_BUSOFF;
+    }
+    if (errorcode & GS_CAN_ERROR_RESTARTED) {
+        hf->can_id |= CAN_ERR_RESTARTED;
+    }
+    if (errorcode & (HAL_CAN_ERROR_EPV | HAL_CAN_ERROR_EWG)) {
+        hf->can_id |= CAN_ERR_CRTL;
+        if (tec > 127) {
+            hf->data[1] |= CAN_ERR_CRTL_TX_PASSIVE;
+        } else if (tec >= 96) {
+            hf->data[1] |= CAN_ERR_CRTL_TX_WARNING;
+        }
+        if (rec > 127) {
+            hf->data[1] |= CAN_ERR_CRTL_RX_PASSIVE;
+        } else if (rec >= 96) {
+            hf->data[1] |= CAN_ERR_CRTL_RX_WARNING;
+        }
+    }
+    if (errorcode & HAL_CAN_ERROR_ACK) {
+        hf->can_id |= CAN_ERR_ACK;
+    }
+    if (errorcode & (HAL_CAN_ERROR_STF | HAL_CAN_ERROR_FOR | HAL_CAN_ERROR_BR
+                | HAL_CAN_ERROR_BD | HAL_CAN_ERROR_CRC)) {
+        hf->can_id |= CAN_ERR_PROT;
+        if (errorcode & HAL_CAN_ERROR_STF) hf->data[2] |= CAN_ERR_PROT_STUFF;
+        if (errorcode & HAL_CAN_ERROR_FOR) hf->data[2] |= CAN_ERR_PROT_FORM;
+        // Recessive bit error: sent recessive, read dominant
+        if (errorcode & HAL_CAN_ERROR_BR) hf->data[2] |= CAN_ERR_PROT_BIT1;
+        if (errorcode & HAL_CAN_ERROR_BD) hf->data[2] |= CAN_ERR_PROT_BIT0;
+        if (errorcode & HAL_CAN_ERROR_CRC) hf->data[3] = CAN_ERR_PROT_LOC_CRC_SEQ;
+    }
+    hf->data[6] = tec;
+    hf->data[7] = rec;
+    hf->timestamp_us = timebase_now();
+    datatxq_push();
+}
+
+/**
+ * Start a data IN transfer with the next TX echo or queued frame.
+ *
+ * Does nothing if a transfer is still in progress since it is called again
+ * from the data IN complete interrupt. Can be called from the main thread and
+ * from interrupt context.
+ */
+RAMFUNC void usbd_gs_transmit_queued() {
+    Gs_EchoTypeDef *echo;
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (!datatx_busy && (echoq_tail != echoq_head || datatxq_tail != datatxq_head)) {
+        if (echoq_tail != echoq_head) {
+            // The host only looks at the echo ID and timestamp of an echo
+            echo = &echoq[echoq_tail & (USB_GS_ECHO_QUEUE_SIZE - 1)];
+            memset(&buf_datatx, 0, sizeof(buf_datatx));
+            buf_datatx.echo_id = echo->echo_id;
+            buf_datatx.timestamp_us = echo->timestamp;
+            echoq_tail++;
+        } else {
+            memcpy(&buf_datatx, &datatxq[datatxq_tail & (USB_GS_TX_QUEUE_SIZE - 1)],
+                    sizeof(buf_datatx));
+            hist_add(HIST_RX_TO_USB, timebase_now() - buf_datatx.timestamp_us);
+            datatxq_tail++;
+            TRACE_EVENT(TRACE_USB_TXQ, (uint8_t) (datatxq_head - datatxq_tail));
+        }
+        // Fails when USB isn't configured, the frame is lost then but nobody
+        // is listening anyway
+        if (usbd_gs_set_data_txbuf(&usbd_handle, (uint8_t*) &buf_datatx,
+                    hw_timestamp ? sizeof(buf_datatx) : GS_HOST_FRAME_SIZE) == USBD_OK
+                && usbd_gs_transmit_data_packet(&usbd_handle) == USBD_OK) {
+            datatx_busy = 1;
+        }
+    }
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Allow for new data from USB to be received.
+ */
+void usbd_gs_receive() {
+    if (usbd_gs_receive_data_packet(&usbd_handle)) {
+        error_handler();
+    }
+}
+
+static uint8_t usbd_gs_itf_init(void) {
+    usbd_gs_set_data_txbuf(&usbd_handle, (uint8_t*) &buf_datatx, 0);
+    usbd_gs_set_data_rxbuf(&usbd_handle, buf_datarx);
+    datatx_busy = 0;
+    hw_timestamp = 0;
+    can_bittiming_set = 0;
+    return USBD_OK;
+}
+
+static uint8_t usbd_gs_itf_deinit(void) {
+    sched_post(SCHED_CAN_CLOSE);
+    return USBD_OK;
+}
+
+/* Host to device vendor request, pbuf holds the data stage. Returns USBD_FAIL
+ * to stall the request. */
+static uint8_t usbd_gs_itf_control_out(uint8_t request, uint8_t *pbuf, uint16_t len) {
+    Gs_BitTimingTypeDef *bt = (Gs_BitTimingTypeDef*) pbuf;
+    Gs_ModeTypeDef *mode = (Gs_ModeTypeDef*) pbuf;
+    uint8_t ctrlmode = 0;
+    switch (request) {
+        case GS_USB_BREQ_HOST_FORMAT:
+            // Only sent by older drivers, always little endian
+            break;
+        case GS_USB_BREQ_BITTIMING:
+            if (len < sizeof(*bt)) {
+                error_handler();
+                return USBD_FAIL;
+            }
+            // Keep the previous timing, the stall tells the host it failed
+            if (!bittiming_in_range(bt)) {
+                return USBD_FAIL;
+            }
+            can_bittiming.ts1 = bt->prop_seg + bt->phase_seg1 - 1;
+            can_bittiming.ts2 = bt->phase_seg2 - 1;
+            can_bittiming.sjw = bt->sjw - 1;
+            can_bittiming.brp = bt->brp;
+            can_bittiming_set = 1;
+            break;
+        case GS_USB_BREQ_MODE:
+            if (len < sizeof(*mode)) {
+                error_handler();
+                return USBD_FAIL;
+            }
+            if (mode->mode == GS_CAN_MODE_START) {
+                // Without a timing brp is 0, which the bxCAN can't be set to
+                if (!can_bittiming_set) {
+                    return USBD_FAIL;
+                }
+                if (mode->flags & GS_CAN_MODE_LISTEN_ONLY) {
+                    ctrlmode |= USB_8DEV_CAN_MODE_SILENT;
+                }
+                if (mode->flags & GS_CAN_MODE_LOOP_BACK) {
+                    ctrlmode |= USB_8DEV_CAN_MODE_LOOPBACK;
+                }
+                if (mode->flags & GS_CAN_MODE_ONE_SHOT) {
+                    ctrlmode |= USB_8DEV_MODE_ONESHOT;
+                }
+                if (mode->flags & GS_CAN_MODE_BERR_REPORTING) {
+                    ctrlmode |= USB_8DEV_MODE_BERR_REPORTING;
+                }
+                hw_timestamp = (mode->flags & GS_CAN_MODE_HW_TIMESTAMP) != 0;
+                // Echoes from before a restart belong to echo IDs the host
+                // has reused already
+                echoq_tail = echoq_head;
+                datatx_overflow = 0;
+                can_open_req(&can_bittiming, ctrlmode);
+                sched_post(SCHED_CAN_OPEN);
+            } else {
+                sched_post(SCHED_CAN_CLOSE);
+            }
+            break;
+        default:
+            break;
+    }
+    return USBD_OK;
+}
+
+/**
+ * Check a bit timing from the host against the limits in gs_bt_const.
+ *
+ * @param[in] bt bit timing as sent by the host
+ * @retval 1 if the bxCAN can be set to it, 0 otherwise
+ */
+static uint8_t bittiming_in_range(const Gs_BitTimingTypeDef *bt) {
+    // Each part on its own first, so the sum can't overflow
+    if (bt->prop_seg > gs_bt_const.tseg1_max ||
+            bt->phase_seg1 > gs_bt_const.tseg1_max) {
+        return 0;
+    }
+    return bt->prop_seg + bt->phase_seg1 >= gs_bt_const.tseg1_min &&
+        bt->prop_seg + bt->phase_seg1 <= gs_bt_const.tseg1_max &&
+        bt->phase_seg2 >= gs_bt_const.tseg2_min &&
+        bt->phase_seg2 <= gs_bt_const.tseg2_max &&
+        bt->sjw >= 1 && bt->sjw <= gs_bt_const.sjw_max &&
+        bt->brp >= gs_bt_const.brp_min && bt->brp <= gs_bt_const.brp_max;
+}
+
+/* Device to host vendor request, returns the length of the reply in pbuf or
+ * 0 to stall the request. */
+static uint16_t usbd_gs_itf_control_in(uint8_t request, uint8_t *pbuf, uint16_t len) {
+    Gs_DeviceConfigTypeDef *config = (Gs_DeviceConfigTypeDef*) pbuf;
+    uint32_t timestamp;
+    uint16_t n;
+    switch (request) {
+        case GS_USB_BREQ_BT_CONST:
+            memcpy(pbuf, &gs_bt_const, sizeof(gs_bt_const));
+            n = sizeof(gs_bt_const);
+            break;
+        case GS_USB_BREQ_DEVICE_CONFIG:
+            memset(config, 0, sizeof(*config));
+            config->icount = 0;
+            config->sw_version = FIRMWARE_VER;
+            config->hw_version = HARDWARE_VER;
+            n = sizeof(*config);
+            break;
+        case GS_USB_BREQ_TIMESTAMP:
+            timestamp = timebase_now();
+            memcpy(pbuf, &timestamp, sizeof(timestamp));
+            n = sizeof(timestamp);
+            break;
+        default:
+            return 0;
+    }
+    return n < len ? n : len;
+}
+
+// buf == buf_datarx
+static uint8_t usbd_gs_itf_rcv_data(uint8_t* buf, uint8_t *len) {
+    Gs_HostFrameTypeDef *hf = (Gs_HostFrameTypeDef*) buf;
+    CanTxMsgTypeDef buf_cantx;
+    uint32_t primask;
+    if (*len >= GS_HOST_FRAME_SIZE && hf->channel == 0) {
+        if (hf->can_id & CAN_EFF_FLAG) {
+            buf_cantx.IDE = CAN_ID_EXT;
+            buf_cantx.ExtId = hf->can_id & 0x1fffffff;
+        } else {
+            buf_cantx.IDE = CAN_ID_STD;
+            buf_cantx.StdId = hf->can_id & 0x00007ff;
+        }
+        buf_cantx.RTR = (hf->can_id & CAN_RTR_FLAG) ? CAN_RTR_REMOTE : CAN_RTR_DATA;
+        buf_cantx.DLC = hf->can_dlc > 8 ? 8 : hf->can_dlc;
+        memcpy(buf_cantx.Data, hf->data, sizeof(buf_cantx.Data));
+        // The echo ID comes back in can_tx_cplt_callback. Fails when CAN is
+        // closed, the host forgets its echo IDs when it restarts CAN.
+        can_tx_enqueue(&buf_cantx, hf->echo_id);
+        sched_post(SCHED_CAN_TX);
+    } else {
+        error_handler();
+    }
+    // Only accept the next frame if the TX queue can hold it. Checked and
+    // paused at once, else the CAN TX interrupt could free a slot in between
+    // and not see the pause.
+    primask = __get_PRIMASK();
+    __disable_irq();
+    if (can_tx_free()) {
+        usbd_gs_receive();
+    } else {
+        datarx_paused = 1;
+    }
+    __set_PRIMASK(primask);
+    return USBD_OK;
+}
+
+/**
+ * Re-arm the data OUT endpoint once the TX queue has room again.
+ *
+ * Called from can_tx() in the main thread or the CAN TX interrupt.
+ */
+void can_tx_dequeue_callback() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    if (datarx_paused && can_tx_free()) {
+        datarx_paused = 0;
+        usbd_gs_receive();
+    }
+    __set_PRIMASK(primask);
+}
+
+/**
+ * Echo a frame back to the host once it left its transmit mailbox.
+ *
+ * Called from the CAN TX interrupt.
+ *
+ * @param[in] tag echo ID of the frame
+ */
+void can_tx_cplt_callback(uint32_t tag) {
+    Gs_EchoTypeDef *echo = &echoq[echoq_head & (USB_GS_ECHO_QUEUE_SIZE - 1)];
+    // Can't overflow, the host has fewer echo IDs than the queue holds
+    echo->echo_id = tag;
+    echo->timestamp = timebase_now();
+    echoq_head++;
+    usbd_gs_transmit_queued();
+}
+
+/**
+ * Report the recovery from bus-off.
+ *
+ * Called from can_busoff_poll() in the main thread.
+ */
+void can_busoff_recovered_callback() {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    can_errorcode |= GS_CAN_ERROR_RESTARTED;
+    __set_PRIMASK(primask);
+    led_off(LED_RED);
+    sched_post(SCHED_CAN_ERR);
+}
+
+RAMFUNC static uint8_t usbd_gs_itf_data_transmitted(void) {
+    datatx_busy = 0;
+    usbd_gs_transmit_queued();
+    return USBD_OK;
+}
+
+/* Get a free frame at the head of the data IN queue or NULL if full. */
+RAMFUNC static Gs_HostFrameTypeDef *datatxq_alloc(void) {
+    Gs_HostFrameTypeDef *hf;
+    if ((uint8_t) (datatxq_head - datatxq_tail) == USB_GS_TX_QUEUE_SIZE) {
+        datatx_overflow = 1;
+        return NULL;
+    }
+    hf = &datatxq[datatxq_head & (USB_GS_TX_QUEUE_SIZE - 1)];
+    // The host counts an RX overrun when the next frame has the flag set
+    hf->channel = 0;
+    hf->flags = datatx_overflow ? GS_CAN_FLAG_OVERFLOW : 0;
+    hf->reserved = 0;
+    datatx_overflow = 0;
+    return hf;
+}
+
+/* Queue the frame returned by datatxq_alloc() and start sending it. */
+static void datatxq_push(void) {
+    datatxq_head++;
+    TRACE_EVENT(TRACE_USB_TXQ, (uint8_t) (datatxq_head - datatxq_tail));
+    usbd_gs_transmit_queued();
+}
+
+void HAL_CAN_ErrorCallback(CAN_HandleTypeDef *hcan) {
+    uint32_t errorcode = hcan->ErrorCode;
+    uint32_t lec = errorcode & GS_CAN_ERROR_LEC;
+    uint32_t now = timebase_now();
+    uint32_t last;
+    uint32_t when;
+
+    // Repeated protocol errors are reported once per interval, gs_usb error
+    // frames have no room for a count, @see can_lec_error
+    if (lec) {
+        if (can_lec_flush(lec, now, &last, &when)) {
+            can_errorcode |= last;
+        }
+        if (!can_lec_error(lec, now)) {
+            errorcode &= ~lec;
+        }
+    }
+    // Collected until the main thread reports them, gs_usb error frames can
+    // carry multiple errors
+    can_errorcode |= errorcode;
+    sched_post(SCHED_CAN_ERR);
+}
+
+static void error_handler(void) {
+    led_on(LED_RED);
+}
@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+"""Run the frame pipeline benchmarks on the host build of the firmware.
+
+Every scenario script is run by bin/canalyze-host, which reports in JSON how
+many frames per second reached the host and went out on the bus, how many
+were dropped on the way and the latency from end of frame on the bus to the
+host. The results of all scenarios are written to one JSON file. Given the
+results of an earlier run, anything that got worse by more than the tolerance
+is listed and the exit status is 1. With --strict the exit status is also 1
+if anything went missing in the firmware: received frames the host never saw,
+commands without a reply, or records and errors the firmware says it dropped.
+The simulation is deterministic, the same tree always gives the same numbers.
+
+Example:
+    make bench
+    bench.py --out new.json --baseline old.json host/bench/*.txt
+"""
+import argparse
+import json
+import os
+import subprocess
+import sys
+
+# (name, path in the results, True if higher is better)
+METRICS = (
+    ("rx frames/s", ("rx", "host_fps"), True),
+    ("tx frames/s", ("tx", "fps"), True),
+    ("dropped", ("dropped",), False),
+    ("p50 µs", ("rx", "latency_us", "p50"), False),
+    ("p99 µs", ("rx", "latency_us", "p99"), False),
+)
+
+
+def run(binary, script, options):
+    """Run one scenario and return its results."""
+    out = subprocess.run([binary, "-j"] + options + [script], check=True,
+                         stdout=subprocess.PIPE, universal_newlines=True).stdout
+    result = json.loads(out)
+    # Frames that never made it: overwritten in the FIFO, lost in the
+    # firmware or still waiting to be sent
+    result["dropped"] = (result["rx"]["fifo_overrun"]
+                         + result["rx"]["lost_in_firmware"]
+                         + result["tx"]["queued"])
+    return result
+
+
+def value(result, path):
+    for key in path:
+        if result is None:
+            return None
+        result = result.get(key)
+    return result
+
+
+def report(results, out):
+    out.write("%-22s" % "" + "".join("%13s" % m[0] for m in METRICS) + "\n")
+    for result in results:
+        out.write("%-22s" % result["scenario"])
+        for _, path, _ in METRICS:
+            v = value(result, path)
+            out.write("%13s" % ("-" if v is None else "%g" % v))
+        out.write("\n")
+
+
+def missing(results, out):
+    """Return the number of scenarios that lost something in the firmware."""
+    failed = 0
+    for result in results:
+        firmware = result["firmware"]
+        reasons = []
+        if result["rx"]["lost_in_firmware"]:
+            reasons.append("%d frames lost" % result["rx"]["lost_in_firmware"])
+        if result["rx"]["unmatched"]:
+            reasons.append("%d frames not from the bus" % result["rx"]["unmatched"])
+        if result["commands_unanswered"]:
+            reasons.append("%d commands without reply"
+                           % result["commands_unanswered"])
+        # null unless the scenario asked for the status
+        if firmware["records_dropped"]:
+            reasons.append("%d records dropped" % firmware["records_dropped"])
+        if firmware["errors_dropped"]:
+            reasons.append("%d errors dropped" % firmware["errors_dropped"])
+        if reasons:
+            out.write("%s: %s\n" % (result["scenario"], ", ".join(reasons)))
+            failed += 1
+    return failed
+
+
+def compare(results, baseline, tolerance, out):
+    """Return the number of metrics that got worse than the baseline."""
+    old = {r["scenario"]: r for r in baseline["scenarios"]}
+    worse = 0
+    for result in results:
+        before = old.get(result["scenario"])
+        if before is None:
+            continue
+        for name, path, higher in METRICS:
+            a = value(before, path)
+            b = value(result, path)
+            if a is None or b is None:
+                continue
+            # A single new dropped frame counts, even with none before
+            limit = abs(a) * tolerance / 100.0
+            if (a - b if higher else b - a) > max(limit, 0.5):
+                out.write("%s: %s %g -> %g\n" % (result["scenario"], name, a, b))
+                worse += 1
+    return worse
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("scripts", nargs="+", help="scenario scripts")
+    parser.add_argument("--bin", default="bin/canalyze-host",
+                        help="host build of the firmware")
+    parser.add_argument("--out", help="write the results to this JSON file")
+    parser.add_argument("--baseline", help="results of an earlier run")
+    parser.add_argument("--tolerance", type=float, default=5.0,
+                        help="allowed change in percent (default 5)")
+    parser.add_argument("--sim", action="append", default=[],
+                        help="option for canalyze-host, e.g. --sim=-c250")
+    parser.add_argument("--strict", action="store_true",
+                        help="fail if anything went missing in the firmware")
+    args = parser.parse_args()
+
+    results = [run(args.bin, s, args.sim) for s in args.scripts]
+    report(results, sys.stdout)
+    if args.out:
+        with open(args.out, "w") as f:
+            json.dump({"binary": os.path.basename(args.bin), "options": args.sim,
+                       "scenarios": results}, f, indent=1)
+            f.write("\n")
+    failed = args.strict and missing(results, sys.stdout)
+    if args.baseline:
+        with open(args.baseline) as f:
+            baseline = json.load(f)
+        failed = compare(results, baseline, args.tolerance, sys.stdout) or failed
+    if failed:
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
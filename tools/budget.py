@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""Show the RAM and flash used by every part of the CANalyze firmware.
+
+Reads the map file the linker writes next to the ELF and adds up the input
+sections that made it into the image, after garbage collection, by the object
+file they came from. Object files are grouped into subsystems, the STM32Cube
+library by HAL and USB core. Initialized data counts for both RAM and flash.
+
+Example:
+    make budget
+    budget.py bin/canalyze.map
+"""
+import argparse
+import os
+import re
+import sys
+
+# Object file (without .o) to subsystem
+SUBSYSTEMS = {
+    "can": "CAN",
+    "bittiming": "CAN",
+    "busload": "CAN",
+    "usbd_8dev_if": "8dev protocol",
+    "usbd_gs_if": "gs_usb protocol",
+    "usbd_8dev": "USB class",
+    "usbd_gs": "USB class",
+    "usbd": "USB class",
+    "usbd_conf": "USB class",
+    "usbd_desc": "USB class",
+    "timebase": "timebase",
+    "hist": "diagnostics",
+    "trace": "diagnostics",
+}
+SYSTEM = "system"
+
+RAM_SECTIONS = (".data", ".bss")
+FLASH_SECTIONS = (".isr_vector", ".text", ".rodata", ".ARM", ".ARM.extab",
+                  ".preinit_array", ".init_array", ".fini_array", ".data")
+STACK_SECTION = "._user_heap_stack"
+
+MEMORY = re.compile(r"^(\w+)\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)")
+OUTPUT = re.compile(r"^(\.\S+)(?:\s+0x([0-9a-f]+)\s+0x([0-9a-f]+))?")
+INPUT = re.compile(r"^ (\S+)?\s+0x([0-9a-f]+)\s+0x([0-9a-f]+)\s+(\S+)$")
+INPUT_NAME = re.compile(r"^ (\.\S+|COMMON)$")
+
+
+def subsystem(path):
+    """Subsystem of an object file or archive member."""
+    member = re.match(r"^(.*)\((.*)\)$", path)
+    if member:
+        archive = os.path.basename(member.group(1))
+        name = member.group(2)
+        if archive.startswith("libgcc"):
+            return "libgcc"
+        if archive.startswith("lib"):
+            return "libc"
+        return "USB core" if name.startswith("usbd_") else "HAL"
+    name = os.path.splitext(os.path.basename(path))[0]
+    return SUBSYSTEMS.get(name, SYSTEM)
+
+
+def parse(lines):
+    """Return the memory regions and the (ram, flash) bytes by subsystem."""
+    regions = {}
+    usage = {}
+    section = None
+    name = None
+    state = None
+    for line in lines:
+        line = line.rstrip("\n")
+        if line.startswith("Memory Configuration"):
+            state = "memory"
+            continue
+        if line.startswith("Linker script and memory map"):
+            state = "map"
+            continue
+        if state == "memory":
+            match = MEMORY.match(line)
+            if match and match.group(1) != "Name":
+                regions[match.group(1)] = int(match.group(3), 16)
+            continue
+        if state != "map":
+            continue
+        match = OUTPUT.match(line)
+        if match:
+            section = match.group(1)
+            name = None
+            if section == STACK_SECTION and match.group(3):
+                usage.setdefault("stack", [0, 0])[0] += int(match.group(3), 16)
+            continue
+        match = INPUT_NAME.match(line)
+        if match:
+            name = match.group(1)
+            continue
+        match = INPUT.match(line)
+        if not match or section is None or not (match.group(1) or name):
+            name = None
+            continue
+        name = None
+        size = int(match.group(3), 16)
+        if not size or match.group(1) == "*fill*":
+            continue
+        owner = usage.setdefault(subsystem(match.group(4)), [0, 0])
+        if section in RAM_SECTIONS:
+            owner[0] += size
+        if section in FLASH_SECTIONS:
+            owner[1] += size
+    return regions, usage
+
+
+def report(regions, usage, out):
+    ram = sum(u[0] for u in usage.values())
+    flash = sum(u[1] for u in usage.values())
+    out.write("%-18s %8s %8s\n" % ("", "RAM", "flash"))
+    for name, (r, f) in sorted(usage.items(), key=lambda i: -i[1][0] - i[1][1]):
+        out.write("%-18s %8d %8d\n" % (name, r, f))
+    out.write("%-18s %8d %8d\n" % ("total", ram, flash))
+    if "RAM" in regions and "FLASH" in regions:
+        out.write("%-18s %8d %8d\n" % ("free", regions["RAM"] - ram,
+                                        regions["FLASH"] - flash))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("map", help="linker map file")
+    args = parser.parse_args()
+    with open(args.map) as mapfile:
+        regions, usage = parse(mapfile)
+    report(regions, usage, sys.stdout)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+"""Merge candump logs of several CANalyze adapters into one timeline.
+
+Send USB_8DEV_RESET_TIMESTAMP to every adapter before capturing. The reply
+carries in data[0..1] the USB frame number of the SOF that became time 0 on
+that adapter. All adapters on a host follow the same SOFs, so their timestamps
+only differ by the distance between those frames. Pass each log together with
+its frame number, the timestamps are shifted onto the timeline of the adapter
+that was reset first and the frames are printed in order.
+
+Example:
+    stream_decode.py a.bin > a.log; stream_decode.py b.bin > b.log
+    merge_captures.py a.log:1530 b.log:1532
+"""
+import argparse
+import heapq
+import re
+import sys
+
+FRAME_MASK = 0x7FF  # USB frame numbers are 11 bits
+
+LINE = re.compile(r"^\((\d+)\.(\d{6})\)\s+(\S+)\s+(.*)$")
+
+
+def frame_offset(frame, ref):
+    """Offset in µs of an adapter reset at frame against one reset at ref.
+
+    The resets are expected within a second of each other, frame numbers wrap
+    after 2048 ms.
+    """
+    diff = (frame - ref) & FRAME_MASK
+    if diff > FRAME_MASK // 2:
+        diff -= FRAME_MASK + 1
+    return diff * 1000
+
+
+def read_log(path, offset, iface):
+    """Yield (timestamp, iface, rest) of the lines of a candump log."""
+    with open(path) as log:
+        for line in log:
+            match = LINE.match(line.strip())
+            if not match:
+                continue
+            stamp = int(match.group(1)) * 1000000 + int(match.group(2))
+            yield stamp + offset, iface or match.group(3), match.group(4)
+
+
+def parse_capture(arg):
+    path, sep, frame = arg.rpartition(":")
+    if not sep:
+        raise argparse.ArgumentTypeError("expected LOG:FRAME, got %r" % arg)
+    return path, int(frame, 0)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("captures", nargs="+", type=parse_capture,
+                        metavar="LOG:FRAME",
+                        help="candump log and its reset timestamp frame")
+    parser.add_argument("--rename", action="store_true",
+                        help="name the interfaces can0, can1, ... in the "
+                             "order of the arguments")
+    args = parser.parse_args()
+
+    ref = args.captures[0][1]
+    offsets = [frame_offset(frame, ref) for _, frame in args.captures]
+    # Time 0 is the adapter that was reset first
+    first = min(offsets)
+    logs = []
+    for i, (path, _) in enumerate(args.captures):
+        iface = "can%d" % i if args.rename else None
+        logs.append(read_log(path, offsets[i] - first, iface))
+    # Every log is in order already
+    for stamp, iface, rest in heapq.merge(*logs):
+        sec, usec = divmod(stamp, 1000000)
+        sys.stdout.write("(%d.%06d) %s %s\n" % (sec, usec, iface, rest))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+"""Check a capture of the CANalyze data IN stream for dropped records.
+
+The capture must be recorded with the USB_8DEV_STREAM_SEQ option. Every record
+the device produces gets the next 8 bit sequence number, including the records
+it had to drop, so each gap in the numbers is a run of lost records. A run of
+256 more lost records looks the same, so the numbers alone can't prove that a
+capture is complete. Two ways to rule out hidden runs:
+
+- --drops: the increase of the dropped records counter on page 2 of
+  USB_8DEV_GET_STATUS from before to after the capture. Every drop is then
+  accounted for if it equals the lost records found.
+- --bitrate: the device can't produce records faster than the bus carries
+  errors, so a run of 256 records takes some time. Only the spells between two
+  records that were long enough for that are suspect.
+
+Without either, or with suspect spells, the capture can't be certified.
+The exit status is 0 if the capture is complete, 1 if records were lost and
+2 if it can't be certified.
+
+Example:
+    seq_check.py --format compact --seq --bitrate 500000 capture.bin
+"""
+import argparse
+import json
+import sys
+
+from stream_decode import add_stream_arguments, decode_capture
+
+MODULUS = 256
+# Shortest bus time per record: an error frame takes at least 18 bit times
+# (a bit of the destroyed frame, error flag, delimiter and intermission) and
+# can give three records (earlier repeats, the error and the error state)
+RECORD_BITS = 6
+TIMESTAMP_MODULUS = 1 << 32
+
+
+def check(frames, record_us):
+    """Return (records, gaps, lost, first gap timestamps, suspect spells).
+
+    A spell between two records is suspect if it was long enough for another
+    MODULUS records, with record_us the shortest time per record. Without
+    record_us every spell is suspect.
+    """
+    records = gaps = lost = suspect = 0
+    where = []
+    expected = None
+    last = None
+    for frame in frames:
+        if frame.seq is None:
+            raise ValueError("capture has no sequence numbers")
+        missing = 0
+        if expected is not None and frame.seq != expected:
+            missing = (frame.seq - expected) % MODULUS
+            gaps += 1
+            lost += missing
+            if len(where) < 10:
+                where.append((frame.timestamp, missing))
+        if last is not None:
+            # Timestamps wrap after about 71 minutes
+            spell = (frame.timestamp - last) % TIMESTAMP_MODULUS
+            if record_us is None or spell >= (missing + MODULUS) * record_us:
+                suspect += 1
+        expected = (frame.seq + 1) % MODULUS
+        last = frame.timestamp
+        records += 1
+    return records, gaps, lost, where, suspect
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    add_stream_arguments(parser)
+    parser.add_argument("--bitrate", type=int,
+                        help="bitrate of the bus in bit/s")
+    parser.add_argument("--drops", type=int,
+                        help="increase of the GET_STATUS dropped records "
+                        "counter over the capture")
+    parser.add_argument("--json", action="store_true",
+                        help="print the result as JSON")
+    args = parser.parse_args()
+    args.seq = True
+
+    record_us = RECORD_BITS * 1e6 / args.bitrate if args.bitrate else None
+    records, gaps, lost, where, suspect = check(decode_capture(args),
+                                                record_us)
+
+    if args.drops is not None:
+        # The counter also has the drops the numbers can't show
+        verdict = "complete" if args.drops == 0 and gaps == 0 else "INCOMPLETE"
+        certified = args.drops >= lost
+    else:
+        verdict = "complete" if gaps == 0 else "INCOMPLETE"
+        certified = gaps != 0 or suspect == 0
+    if not certified:
+        verdict = "not certified"
+
+    if args.json:
+        json.dump({"records": records, "gaps": gaps, "lost": lost,
+                   "suspect_spells": suspect, "drops": args.drops,
+                   "verdict": verdict, "complete": verdict == "complete"},
+                  sys.stdout)
+        print()
+    else:
+        print("records: %d" % records)
+        print("gaps:    %d" % gaps)
+        print("lost:    %d" % lost)
+        for timestamp, missing in where:
+            print("  %d record(s) lost before timestamp %d us" % (missing, timestamp))
+        if args.drops is not None:
+            print("drops:   %d (device)" % args.drops)
+            if args.drops > lost:
+                print("  %d record(s) lost in runs of %d" % (args.drops - lost,
+                                                         MODULUS))
+        else:
+            print("suspect: %d spell(s) long enough to hide %d lost records"
+                  % (suspect, MODULUS))
+        print("capture is %s" % verdict)
+    if verdict == "complete":
+        return 0
+    return 1 if verdict == "INCOMPLETE" else 2
+
+
+if __name__ == "__main__":
+    sys.exit(main())
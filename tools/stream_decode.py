@@ -0,0 +1,189 @@
+#!/usr/bin/env python3
+"""Decode a capture of the CANalyze data IN stream.
+
+The input is the raw payload of the data IN endpoint (EP1), i.e. the packets
+as read with libusb, concatenated. Both the usb_8dev record format and the
+compact format selected with USB_8DEV_SET_STREAM_FORMAT are supported. Frames
+are printed in candump log format.
+
+Example:
+    stream_decode.py --format compact --xor capture.bin
+"""
+import argparse
+import struct
+import sys
+
+DATA_START = 0x55
+DATA_END = 0xAA
+TYPE_CAN_FRAME = 0
+TYPE_ERROR_FRAME = 3
+FLAG_EXTID = 0x01
+FLAG_RTR = 0x02
+SEQ_SHIFT = 3
+SEQ_DLC_SHIFT = 4
+SEQ_ERR_BYTE = 7
+
+COMPACT_EXTID = 0x10
+COMPACT_RTR = 0x20
+COMPACT_ERR = 0x40
+COMPACT_XOR = 0x80
+XOR_CACHE_SIZE = 8
+
+
+class Frame:
+    """A CAN frame or error record from the stream."""
+
+    def __init__(self, timestamp, can_id=0, ext=False, rtr=False, err=False,
+                 data=b"", dlc=None, seq=None):
+        self.timestamp = timestamp
+        self.seq = seq
+        self.can_id = can_id
+        self.ext = ext
+        self.rtr = rtr
+        self.err = err
+        self.data = bytes(data)
+        self.dlc = len(self.data) if dlc is None else dlc
+
+    def candump(self, iface="can0"):
+        # Timestamps are in µs
+        stamp = "(%d.%06d)" % divmod(self.timestamp, 1000000)
+        if self.err:
+            # Same convention as SocketCAN, error frames use CAN_ERR_FLAG
+            return "%s %s 20000000#%s" % (stamp, iface,
+                                          self.data.hex().upper())
+        ident = "%08X" % self.can_id if self.ext else "%03X" % self.can_id
+        if self.rtr:
+            return "%s %s %s#R%d" % (stamp, iface, ident, self.dlc)
+        return "%s %s %s#%s" % (stamp, iface, ident, self.data.hex().upper())
+
+
+def decode_8dev(buf, seq=False):
+    """Decode usb_8dev_tx_msg records.
+
+    With seq the sequence numbers of the USB_8DEV_STREAM_SEQ option are
+    extracted, split over the flags and the DLC of a CAN frame.
+    """
+    pos = 0
+    while pos + 21 <= len(buf):
+        start, rtype, flags, can_id, dlc = struct.unpack_from(">BBBIB", buf, pos)
+        data = buf[pos + 8:pos + 16]
+        timestamp, end = struct.unpack_from("<IB", buf, pos + 16)
+        if start != DATA_START or end != DATA_END:
+            raise ValueError("bad record framing at offset %d" % pos)
+        pos += 21
+        if rtype == TYPE_ERROR_FRAME:
+            yield Frame(timestamp, err=True, data=data[:4],
+                        seq=data[SEQ_ERR_BYTE] if seq else None)
+        elif rtype == TYPE_CAN_FRAME:
+            number = None
+            if seq:
+                number = (flags >> SEQ_SHIFT
+                          | (dlc >> SEQ_DLC_SHIFT) << (8 - SEQ_SHIFT))
+            dlc = min(dlc & 0x0f, 8)
+            yield Frame(timestamp, can_id, bool(flags & FLAG_EXTID),
+                        bool(flags & FLAG_RTR), data=b"" if flags & FLAG_RTR
+                        else data[:dlc], dlc=dlc, seq=number)
+
+
+class CompactDecoder:
+    """Decoder for the compact stream format.
+
+    Keeps the same state as the encoder in usbd_8dev_if.c, so it must see
+    every record since the format was selected.
+    """
+
+    def __init__(self, xor=False, seq=False):
+        self.xor = xor
+        self.seq = seq
+        self.timestamp = 0
+        self.cache = [None] * XOR_CACHE_SIZE
+
+    def decode(self, buf):
+        pos = 0
+        while pos < len(buf):
+            header = buf[pos]
+            pos += 1
+            dlc = header & 0x0f
+            seq = None
+            if self.seq:
+                seq = buf[pos]
+                pos += 1
+            delta, shift = 0, 0
+            while True:
+                byte = buf[pos]
+                pos += 1
+                delta |= (byte & 0x7f) << shift
+                shift += 7
+                if not byte & 0x80:
+                    break
+            self.timestamp = (self.timestamp + delta) & 0xffffffff
+            if header & COMPACT_ERR:
+                yield Frame(self.timestamp, err=True, data=buf[pos:pos + dlc],
+                            seq=seq)
+                pos += dlc
+                continue
+            ext = bool(header & COMPACT_EXTID)
+            idlen = 4 if ext else 2
+            can_id = int.from_bytes(buf[pos:pos + idlen], "little")
+            pos += idlen
+            if header & COMPACT_RTR:
+                yield Frame(self.timestamp, can_id, ext, rtr=True, dlc=dlc,
+                            seq=seq)
+                continue
+            key = (can_id, ext)
+            slot = can_id & (XOR_CACHE_SIZE - 1)
+            if header & COMPACT_XOR:
+                prev = self.cache[slot]
+                if prev is None or prev[0] != key:
+                    raise ValueError("XOR record without previous payload")
+                mask = buf[pos]
+                pos += 1
+                data = bytearray(prev[1][:dlc])
+                for i in range(dlc):
+                    if mask & (1 << i):
+                        data[i] ^= buf[pos]
+                        pos += 1
+            else:
+                data = bytearray(buf[pos:pos + dlc])
+                pos += dlc
+            if self.xor:
+                self.cache[slot] = (key, bytes(data) + bytes(8 - dlc))
+            yield Frame(self.timestamp, can_id, ext, data=data, seq=seq)
+
+
+def add_stream_arguments(parser):
+    """Add the arguments describing the capture to an argument parser."""
+    parser.add_argument("capture", help="raw data IN payload, - for stdin")
+    parser.add_argument("--format", choices=("8dev", "compact"),
+                        default="8dev", help="stream format")
+    parser.add_argument("--xor", action="store_true",
+                        help="compact stream uses XOR payload coding")
+    parser.add_argument("--seq", action="store_true",
+                        help="records carry sequence numbers")
+
+
+def decode_capture(args):
+    """Decode the capture described by add_stream_arguments()."""
+    if args.capture == "-":
+        buf = sys.stdin.buffer.read()
+    else:
+        with open(args.capture, "rb") as f:
+            buf = f.read()
+    if args.format == "compact":
+        return CompactDecoder(args.xor, args.seq).decode(buf)
+    return decode_8dev(buf, args.seq)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    add_stream_arguments(parser)
+    parser.add_argument("--iface", default="can0",
+                        help="interface name in the output")
+    args = parser.parse_args()
+
+    for frame in decode_capture(args):
+        print(frame.candump(args.iface))
+
+
+if __name__ == "__main__":
+    main()
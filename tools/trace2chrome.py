@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""Convert a CANalyze event trace dump to Chrome trace JSON.
+
+The input is the raw payload of the command IN endpoint for a series of
+USB_8DEV_GET_TRACE (0x41) commands, i.e. the replies as read with libusb,
+concatenated. Read with opt1 = 0, 3, 6, ... until a reply has an empty page,
+set opt2 = 1 on the last one to restart recording. The firmware must be built
+with make TRACE=1.
+
+Open the output in chrome://tracing or https://ui.perfetto.dev. Interrupts and
+main loop handlers are spans on one CPU track, so preemption shows up as
+nesting, queue depths are counters.
+
+Example:
+    trace2chrome.py dump.bin > trace.json
+"""
+import argparse
+import json
+import struct
+import sys
+
+CMD_START = 0x11
+CMD_END = 0x22
+CMD_GET_TRACE = 0x41
+MSG_SIZE = 16
+
+TRACE_END = 0x80
+SPANS = {
+    0x01: "USB IRQ",
+    0x02: "CAN IRQ",
+    0x03: "handler",
+}
+QUEUES = {
+    0x10: "CAN RX queue",
+    0x11: "CAN TX queue",
+    0x12: "data IN queue",
+    0x13: "command queue",
+}
+# sched.h, the argument of a handler span
+HANDLERS = ["CAN RX", "CAN error", "CAN TX", "command", "CAN open",
+            "CAN close", "CAN auto-baud"]
+
+
+def read_records(buf):
+    """Yield (timestamp, event, arg) of the records in a dump."""
+    for offset in range(0, len(buf) - MSG_SIZE + 1, MSG_SIZE):
+        msg = buf[offset:offset + MSG_SIZE]
+        if (msg[0] != CMD_START or msg[2] != CMD_GET_TRACE
+                or msg[-1] != CMD_END):
+            continue
+        data = msg[5:15]
+        timestamp, event, arg = struct.unpack(">IBH", data[:7])
+        if event:
+            yield timestamp, event, arg
+
+
+def unwrap(records):
+    """Extend the 32-bit µs timestamps, they wrap after about 71 minutes."""
+    base = 0
+    prev = None
+    for timestamp, event, arg in records:
+        if prev is not None and timestamp < prev:
+            base += 1 << 32
+        prev = timestamp
+        yield base + timestamp, event, arg
+
+
+def convert(records):
+    events = []
+    for timestamp, event, arg in unwrap(records):
+        base = event & ~TRACE_END
+        if base in SPANS:
+            name = SPANS[base]
+            if base == 0x03:
+                name = HANDLERS[arg] if arg < len(HANDLERS) else "event %d" % arg
+            events.append({
+                "name": name,
+                "ph": "E" if event & TRACE_END else "B",
+                "ts": timestamp,
+                "pid": 0,
+                "tid": 0,
+            })
+        elif event in QUEUES:
+            events.append({
+                "name": QUEUES[event],
+                "ph": "C",
+                "ts": timestamp,
+                "pid": 0,
+                "args": {"depth": arg},
+            })
+        else:
+            events.append({
+                "name": "event 0x%02x" % event,
+                "ph": "i",
+                "s": "t",
+                "ts": timestamp,
+                "pid": 0,
+                "tid": 0,
+                "args": {"arg": arg},
+            })
+    return {
+        "traceEvents": events,
+        "displayTimeUnit": "ns",
+        "otherData": {"source": "CANalyze event trace"},
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("dump", help="concatenated GET_TRACE replies")
+    args = parser.parse_args()
+    with open(args.dump, "rb") as dump:
+        buf = dump.read()
+    json.dump(convert(read_records(buf)), sys.stdout, indent=1)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()